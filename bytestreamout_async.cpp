@@ -0,0 +1,376 @@
+// bytestreamout_async.cpp : writes the bytes in large blocks without waiting for the disk.
+
+#include "bytestreamout_async.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+BOOL ByteStreamOutAsync::open(FILE* file)
+{
+  if (file == 0) return FALSE;
+  this->file = file;
+  for (size_t b = 0; b < blocks.size(); b++)
+  {
+#ifdef _WIN32
+    blocks[b].data = (U8*)_aligned_malloc(block_size, 4096);
+#else
+    if (posix_memalign((void**)&blocks[b].data, 4096, block_size)) blocks[b].data = 0;
+#endif
+    if (blocks[b].data == 0)
+    {
+      LASMessage(LAS_ERROR, "cannot allocate %u output blocks of %u bytes", (U32)blocks.size(), block_size);
+      return FALSE;
+    }
+    free_blocks.push_back(&blocks[b]);
+  }
+
+  uring = FALSE;
+#ifdef COMPILE_WITH_IO_URING
+  // fails on old kernels and where io_uring is disabled (e.g. in containers)
+  if (io_uring_queue_init((unsigned)blocks.size(), &ring, 0) == 0)
+  {
+    uring = TRUE;
+  }
+#endif
+  if (!uring)
+  {
+    quit = FALSE;
+    thread = std::thread(&ByteStreamOutAsync::work, this);
+  }
+
+  end = 0;
+  return next_block(0);
+}
+
+BOOL ByteStreamOutAsync::putByte(U8 byte)
+{
+  return putBytes(&byte, 1);
+}
+
+BOOL ByteStreamOutAsync::putBytes(const U8* bytes, U32 num_bytes)
+{
+  if (failed) return FALSE;
+  while (num_bytes)
+  {
+    if (cursor == block_size)
+    {
+      I64 position = current->position + cursor;
+      if (!submit() || !next_block(position)) return FALSE;
+    }
+    U32 n = std::min(num_bytes, block_size - cursor);
+    memcpy(current->data + cursor, bytes, n);
+    cursor += n;
+    bytes += n;
+    num_bytes -= n;
+    if (cursor > used) used = cursor;
+  }
+  if (current->position + cursor > end) end = current->position + cursor;
+  return TRUE;
+}
+
+BOOL ByteStreamOutAsync::put16bitsLE(const U8* bytes)
+{
+  return putBytes(bytes, 2);
+}
+
+BOOL ByteStreamOutAsync::put32bitsLE(const U8* bytes)
+{
+  return putBytes(bytes, 4);
+}
+
+BOOL ByteStreamOutAsync::put64bitsLE(const U8* bytes)
+{
+  return putBytes(bytes, 8);
+}
+
+BOOL ByteStreamOutAsync::put16bitsBE(const U8* bytes)
+{
+  U8 swapped[2] = { bytes[1], bytes[0] };
+  return putBytes(swapped, 2);
+}
+
+BOOL ByteStreamOutAsync::put32bitsBE(const U8* bytes)
+{
+  U8 swapped[4] = { bytes[3], bytes[2], bytes[1], bytes[0] };
+  return putBytes(swapped, 4);
+}
+
+BOOL ByteStreamOutAsync::put64bitsBE(const U8* bytes)
+{
+  U8 swapped[8] = { bytes[7], bytes[6], bytes[5], bytes[4], bytes[3], bytes[2], bytes[1], bytes[0] };
+  return putBytes(swapped, 8);
+}
+
+BOOL ByteStreamOutAsync::isSeekable() const
+{
+  return TRUE;
+}
+
+I64 ByteStreamOutAsync::tell() const
+{
+  return (current ? current->position + cursor : end);
+}
+
+BOOL ByteStreamOutAsync::seek(const I64 position)
+{
+  if (failed) return FALSE;
+  if ((position >= current->position) && (position <= current->position + used))
+  {
+    cursor = (U32)(position - current->position);
+    return TRUE;
+  }
+  // the new block may overwrite bytes of a block that is still in flight
+  if (!submit() || !drain()) return FALSE;
+  return next_block(position);
+}
+
+BOOL ByteStreamOutAsync::seekEnd()
+{
+  return seek(end);
+}
+
+BOOL ByteStreamOutAsync::close()
+{
+  if (file == 0) return TRUE;
+  if (current) submit();
+  drain();
+  if (thread.joinable())
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      quit = TRUE;
+    }
+    condition.notify_all();
+    thread.join();
+  }
+#ifdef COMPILE_WITH_IO_URING
+  if (uring)
+  {
+    io_uring_queue_exit(&ring);
+    uring = FALSE;
+  }
+#endif
+  if (fclose(file) != 0) failed = true;
+  file = 0;
+  return !failed;
+}
+
+// hands the current block to io_uring or to the writer thread
+
+BOOL ByteStreamOutAsync::submit()
+{
+  ByteStreamBlock* block = current;
+  current = 0;
+  block->size = used;
+  block->done = 0;
+  cursor = used = 0;
+#ifdef COMPILE_WITH_IO_URING
+  if (uring)
+  {
+    if (block->size == 0)
+    {
+      free_blocks.push_back(block);
+      return TRUE;
+    }
+    in_flight++;
+    return queue_block(block);
+  }
+#endif
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (block->size == 0)
+    {
+      free_blocks.push_back(block);
+      return TRUE;
+    }
+    queue.push_back(block);
+    in_flight++;
+  }
+  condition.notify_all();
+  return !failed;
+}
+
+// starts a new block at the position. waits only when all blocks are in flight
+
+BOOL ByteStreamOutAsync::next_block(I64 position)
+{
+  ByteStreamBlock* block = 0;
+#ifdef COMPILE_WITH_IO_URING
+  if (uring)
+  {
+    while (free_blocks.size() == 0)
+    {
+      if (!reap()) return FALSE;
+    }
+    block = free_blocks.back();
+    free_blocks.pop_back();
+  }
+#endif
+  if (block == 0)
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [this] { return (free_blocks.size() > 0) || failed; });
+    if (free_blocks.size() == 0) return FALSE;
+    block = free_blocks.back();
+    free_blocks.pop_back();
+  }
+  block->position = position;
+  current = block;
+  cursor = used = 0;
+  return !failed;
+}
+
+BOOL ByteStreamOutAsync::drain()
+{
+#ifdef COMPILE_WITH_IO_URING
+  if (uring)
+  {
+    while (in_flight)
+    {
+      if (!reap()) return FALSE;
+    }
+    return !failed;
+  }
+#endif
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [this] { return in_flight == 0; });
+  return !failed;
+}
+
+void ByteStreamOutAsync::work()
+{
+  while (true)
+  {
+    ByteStreamBlock* block;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [this] { return quit || (queue.size() > 0); });
+      if (queue.size() == 0) return;
+      block = queue.front();
+      queue.pop_front();
+    }
+    BOOL written = write_block(block);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (!written) failed = true;
+      free_blocks.push_back(block);
+      in_flight--;
+    }
+    condition.notify_all();
+  }
+}
+
+BOOL ByteStreamOutAsync::write_block(ByteStreamBlock* block)
+{
+#ifdef _WIN32
+  _fseeki64(file, block->position, SEEK_SET);
+#else
+  fseeko(file, (off_t)block->position, SEEK_SET);
+#endif
+  if (fwrite(block->data, 1, block->size, file) != block->size)
+  {
+    LASMessage(LAS_ERROR, "writing %u bytes at position %lld", block->size, block->position);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+#ifdef COMPILE_WITH_IO_URING
+
+BOOL ByteStreamOutAsync::queue_block(ByteStreamBlock* block)
+{
+  // once a submission failed nothing more goes into the ring. the blocks that
+  // do not reach it are returned right away as no completion brings them back
+  // and close() reports the error
+  struct io_uring_sqe* sqe = (failed ? 0 : io_uring_get_sqe(&ring));
+  if (sqe == 0)
+  {
+    // cannot happen as the ring has one entry per block
+    if (!failed) LASMessage(LAS_ERROR, "io_uring submission queue is full");
+    failed = true;
+    in_flight--;
+    free_blocks.push_back(block);
+    return FALSE;
+  }
+  io_uring_prep_write(sqe, fileno(file), block->data + block->done, block->size - block->done, (U64)(block->position + block->done));
+  io_uring_sqe_set_data(sqe, block);
+  if (io_uring_submit(&ring) < 0)
+  {
+    LASMessage(LAS_ERROR, "submitting %u bytes at position %lld to io_uring", block->size - block->done, block->position + block->done);
+    failed = true;
+    in_flight--;
+    free_blocks.push_back(block);
+  }
+  return !failed;
+}
+
+// waits for one completed write. a short write is resubmitted for the rest
+
+BOOL ByteStreamOutAsync::reap()
+{
+  struct io_uring_cqe* cqe;
+  if (io_uring_wait_cqe(&ring, &cqe) < 0)
+  {
+    LASMessage(LAS_ERROR, "waiting for io_uring");
+    failed = true;
+    return FALSE;
+  }
+  ByteStreamBlock* block = (ByteStreamBlock*)io_uring_cqe_get_data(cqe);
+  I32 res = cqe->res;
+  io_uring_cqe_seen(&ring, cqe);
+  if (res > 0)
+  {
+    block->done += (U32)res;
+    if (block->done < block->size) return queue_block(block);
+  }
+  else
+  {
+    LASMessage(LAS_ERROR, "writing %u bytes at position %lld (%s)", block->size - block->done, block->position + block->done, (res < 0 ? strerror(-res) : "no space"));
+    failed = true;
+  }
+  in_flight--;
+  free_blocks.push_back(block);
+  return !failed;
+}
+
+#endif
+
+ByteStreamOutAsync::ByteStreamOutAsync(U32 block_size, U32 number_blocks)
+{
+  file = 0;
+  uring = FALSE;
+  this->block_size = block_size;
+  blocks.resize(number_blocks);
+  for (size_t b = 0; b < blocks.size(); b++)
+  {
+    blocks[b].data = 0;
+    blocks[b].position = 0;
+    blocks[b].size = 0;
+    blocks[b].done = 0;
+  }
+  current = 0;
+  cursor = 0;
+  used = 0;
+  end = 0;
+  in_flight = 0;
+  failed = false;
+  quit = FALSE;
+}
+
+ByteStreamOutAsync::~ByteStreamOutAsync()
+{
+  close();
+  for (size_t b = 0; b < blocks.size(); b++)
+  {
+#ifdef _WIN32
+    if (blocks[b].data) _aligned_free(blocks[b].data);
+#else
+    if (blocks[b].data) free(blocks[b].data);
+#endif
+  }
+}
@@ -0,0 +1,85 @@
+// bytestreamout_async.hpp : writes the bytes in large blocks without waiting for the disk.
+
+#ifndef BYTE_STREAM_OUT_ASYNC_HPP
+#define BYTE_STREAM_OUT_ASYNC_HPP
+
+#include "bytestreamout.hpp"
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#ifdef COMPILE_WITH_IO_URING
+#include <liburing.h>
+#endif
+
+// the bytes are gathered into large aligned blocks. a full block is handed to
+// io_uring (Linux only, when compiled with COMPILE_WITH_IO_URING and when the
+// kernel allows it) or else to a writer thread, and the next block is filled
+// right away. the caller only waits when all blocks are in flight. a seek into
+// the current block just moves the write position. any other seek (like the
+// header update on close) waits for the blocks in flight and starts a new block
+// at the new position. the host is assumed to be little endian
+
+class ByteStreamOutAsync : public ByteStreamOut
+{
+public:
+  BOOL open(FILE* file);
+  BOOL putByte(U8 byte);
+  BOOL putBytes(const U8* bytes, U32 num_bytes);
+  BOOL put16bitsLE(const U8* bytes);
+  BOOL put32bitsLE(const U8* bytes);
+  BOOL put64bitsLE(const U8* bytes);
+  BOOL put16bitsBE(const U8* bytes);
+  BOOL put32bitsBE(const U8* bytes);
+  BOOL put64bitsBE(const U8* bytes);
+  BOOL isSeekable() const;
+  I64 tell() const;
+  BOOL seek(const I64 position);
+  BOOL seekEnd();
+  // writes the last block, waits for all blocks, and closes the file
+  BOOL close();
+  BOOL uses_io_uring() const { return uring; };
+  ByteStreamOutAsync(U32 block_size = 4 * 1024 * 1024, U32 number_blocks = 8);
+  ~ByteStreamOutAsync();
+private:
+  struct ByteStreamBlock
+  {
+    U8* data;
+    I64 position;
+    U32 size;
+    U32 done;
+  };
+  BOOL submit();
+  BOOL next_block(I64 position);
+  BOOL drain();
+  void work();
+  BOOL write_block(ByteStreamBlock* block);
+#ifdef COMPILE_WITH_IO_URING
+  BOOL queue_block(ByteStreamBlock* block);
+  BOOL reap();
+  struct io_uring ring;
+#endif
+  FILE* file;
+  BOOL uring;
+  U32 block_size;
+  std::vector<ByteStreamBlock> blocks;
+  ByteStreamBlock* current;
+  // the write position and the number of bytes in the current block
+  U32 cursor;
+  U32 used;
+  I64 end;
+  U32 in_flight;
+  std::atomic<bool> failed;
+  std::vector<ByteStreamBlock*> free_blocks;
+  std::deque<ByteStreamBlock*> queue;
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable condition;
+  BOOL quit;
+};
+
+#endif
@@ -0,0 +1,992 @@
+// e57filesink.cpp : writes the converted batches into LAS, LAZ, COPC, or text files.
+
+#include "e57filesink.hpp"
+
+#include <cmath>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <charconv>
+
+#include "laswriter_las.hpp"
+#include "laswriter_copc.hpp"
+#include "bytestreamout_async.hpp"
+#include "geoprojectionconverter.hpp"
+
+#define HEADER_CHAR_LEN_MAX 4096
+
+// overwrites the payload of a reserved VLR of a closed LAS or LAZ file. the
+// VLR is found by walking the VLR headers of the file so that it does not
+// matter which other VLRs the writer put in front of it
+
+static bool e57_patch_vlr(const char* file_name, const char* user_id, U16 record_id, const void* data, U16 length)
+{
+  FILE* file = LASfopen(file_name, "r+b");
+  if (file == 0) return false;
+  U16 header_size = 0;
+  U32 number_of_variable_length_records = 0;
+  fseek(file, 94, SEEK_SET);
+  if (fread(&header_size, 2, 1, file) != 1) { fclose(file); return false; }
+  fseek(file, 100, SEEK_SET);
+  if (fread(&number_of_variable_length_records, 4, 1, file) != 1) { fclose(file); return false; }
+  long position = header_size;
+  bool patched = false;
+  for (U32 v = 0; v < number_of_variable_length_records; v++)
+  {
+    U8 vlr_header[54];
+    fseek(file, position, SEEK_SET);
+    if (fread(vlr_header, 54, 1, file) != 1) break;
+    U16 vlr_record_id = *((U16*)(vlr_header + 18));
+    U16 record_length_after_header = *((U16*)(vlr_header + 20));
+    if ((strncmp((const char*)(vlr_header + 2), user_id, 16) == 0) && (vlr_record_id == record_id) && (record_length_after_header == length))
+    {
+      fseek(file, position + 54, SEEK_SET);
+      patched = (fwrite(data, length, 1, file) == 1);
+      break;
+    }
+    position += 54 + record_length_after_header;
+  }
+  fclose(file);
+  return patched;
+}
+
+// writes the '-oparse' fields of the batches as text without printf. the
+// batches are collected into large blocks that worker threads format with
+// std::to_chars. the blocks are then written in their order with one large
+// fwrite() each. coordinates whose scale factor is a power of ten are printed
+// as integers with the decimal point put in, which is exact and fast
+
+#define E57_TXT_BLOCK_POINTS 32768
+
+class E57txtwriter {
+public:
+  static bool supports(const char* parse_string, char separator)
+  {
+    if (separator == '\0') return false;
+    for (const char* c = parse_string; *c; c++)
+    {
+      if (strchr("xyzirnRGBtp", *c) == 0) return false;
+    }
+    return true;
+  };
+  bool open(const char* file_name, const LASheader* header, const char* parse_string, char separator, int cores)
+  {
+    file = LASfopen(file_name, "wb");
+    if (file == 0) return false;
+
+    this->parse_string = LASCopyString(parse_string);
+    this->separator = separator;
+
+    const double scale[3] = { header->x_scale_factor, header->y_scale_factor, header->z_scale_factor };
+    const double offset[3] = { header->x_offset, header->y_offset, header->z_offset };
+    for (int k = 0; k < 3; k++)
+    {
+      // the fewest decimals that show every multiple of the scale factor
+      double pow10 = 1.0;
+      for (decimals[k] = 0; decimals[k] < 9; decimals[k]++, pow10 *= 10)
+      {
+        if (fabs(scale[k] * pow10 - floor(scale[k] * pow10 + 0.5)) < 1e-6) break;
+      }
+      this->scale[k] = scale[k];
+      this->offset[k] = offset[k];
+      offset_units[k] = (I64)floor(offset[k] * pow10 + 0.5);
+      exact[k] = (fabs(scale[k] * pow10 - 1.0) < 1e-9) && (fabs(offset[k] * pow10 - (double)offset_units[k]) < 1e-6);
+      divisor[k] = (I64)pow10;
+    }
+
+    fields = (int)strlen(parse_string);
+    quit = false;
+    block = 0;
+    if (cores > 1)
+    {
+      for (int k = 0; k < cores; k++)
+      {
+        threads.push_back(std::thread(&E57txtwriter::work, this));
+      }
+    }
+    return true;
+  };
+  void write(const E57batch* batch, const double* ratio, bool requantize, const LASquantizer* quantizer)
+  {
+    for (unsigned int j = 0; j < batch->count; j++)
+    {
+      if (block == 0) block = get_block();
+      unsigned int n = block->count;
+      if (requantize && batch->x)
+      {
+        block->X[n] = quantizer->get_X(batch->x[j]);
+        block->Y[n] = quantizer->get_Y(batch->y[j]);
+        block->Z[n] = quantizer->get_Z(batch->z[j]);
+      }
+      else if (requantize)
+      {
+        block->X[n] = I32_QUANTIZE(ratio[0] * batch->X[j]);
+        block->Y[n] = I32_QUANTIZE(ratio[1] * batch->Y[j]);
+        block->Z[n] = I32_QUANTIZE(ratio[2] * batch->Z[j]);
+      }
+      else
+      {
+        block->X[n] = batch->X[j];
+        block->Y[n] = batch->Y[j];
+        block->Z[n] = batch->Z[j];
+      }
+      block->intensity[n] = (batch->intensity ? batch->intensity[j] : 0);
+      block->red[n] = (batch->red ? batch->red[j] : 0);
+      block->green[n] = (batch->green ? batch->green[j] : 0);
+      block->blue[n] = (batch->blue ? batch->blue[j] : 0);
+      block->return_number[n] = (batch->return_number ? (batch->return_number[j] & 7) : 0);
+      block->number_of_returns[n] = (batch->number_of_returns ? (batch->number_of_returns[j] & 7) : 0);
+      block->gps_time[n] = (batch->gps_time ? batch->gps_time[j] : 0.0);
+      block->point_source_ID[n] = batch->point_source_ID;
+      block->count++;
+      if (block->count == E57_TXT_BLOCK_POINTS)
+      {
+        submit(block);
+        block = 0;
+      }
+    }
+  };
+  I64 close()
+  {
+    if (file == 0) return 0;
+    if (block && block->count) submit(block);
+    else if (block) blocks.push_back(block);
+    block = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      while (queue.size())
+      {
+        condition.wait(lock, [this] { return queue.front()->formatted; });
+        flush(lock);
+      }
+      quit = true;
+    }
+    condition.notify_all();
+    for (size_t k = 0; k < threads.size(); k++) threads[k].join();
+    threads.clear();
+    I64 bytes = written;
+    fclose(file);
+    file = 0;
+    return bytes;
+  };
+  E57txtwriter()
+  {
+    file = 0;
+    parse_string = 0;
+    separator = ' ';
+    fields = 0;
+    block = 0;
+    quit = false;
+    written = 0;
+  };
+  ~E57txtwriter()
+  {
+    close();
+    for (size_t k = 0; k < blocks.size(); k++) delete blocks[k];
+    if (parse_string) free(parse_string);
+  };
+private:
+  struct E57block
+  {
+    E57block() : count(0), length(0), claimed(false), formatted(false), X(E57_TXT_BLOCK_POINTS), Y(E57_TXT_BLOCK_POINTS), Z(E57_TXT_BLOCK_POINTS), intensity(E57_TXT_BLOCK_POINTS), red(E57_TXT_BLOCK_POINTS), green(E57_TXT_BLOCK_POINTS), blue(E57_TXT_BLOCK_POINTS), return_number(E57_TXT_BLOCK_POINTS), number_of_returns(E57_TXT_BLOCK_POINTS), gps_time(E57_TXT_BLOCK_POINTS), point_source_ID(E57_TXT_BLOCK_POINTS) {};
+    unsigned int count;
+    size_t length;
+    bool claimed;
+    bool formatted;
+    std::vector<I32> X, Y, Z;
+    std::vector<U16> intensity, red, green, blue;
+    std::vector<U8> return_number, number_of_returns;
+    std::vector<F64> gps_time;
+    std::vector<U16> point_source_ID;
+    std::vector<char> text;
+  };
+  E57block* get_block()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (blocks.size())
+    {
+      E57block* b = blocks.back();
+      blocks.pop_back();
+      return b;
+    }
+    return new E57block();
+  };
+  char* put_coordinate(char* p, char* end, I32 X, int k) const
+  {
+    if (!exact[k])
+    {
+      return std::to_chars(p, end, scale[k] * X + offset[k], std::chars_format::fixed, decimals[k]).ptr;
+    }
+    I64 v = X + offset_units[k];
+    if (v < 0)
+    {
+      *p++ = '-';
+      v = -v;
+    }
+    p = std::to_chars(p, end, v / divisor[k]).ptr;
+    if (decimals[k])
+    {
+      *p++ = '.';
+      I64 fraction = v % divisor[k];
+      for (int d = decimals[k] - 1; d >= 0; d--)
+      {
+        p[d] = (char)('0' + (fraction % 10));
+        fraction /= 10;
+      }
+      p += decimals[k];
+    }
+    return p;
+  };
+  void format(E57block* b) const
+  {
+    // no field needs more than 32 characters
+    b->text.resize((size_t)b->count * (fields + 1) * 32 + 1);
+    char* p = &b->text[0];
+    char* end = p + b->text.size();
+    for (unsigned int j = 0; j < b->count; j++)
+    {
+      for (int f = 0; f < fields; f++)
+      {
+        if (f) *p++ = separator;
+        switch (parse_string[f])
+        {
+        case 'x': p = put_coordinate(p, end, b->X[j], 0); break;
+        case 'y': p = put_coordinate(p, end, b->Y[j], 1); break;
+        case 'z': p = put_coordinate(p, end, b->Z[j], 2); break;
+        case 'i': p = std::to_chars(p, end, b->intensity[j]).ptr; break;
+        case 'R': p = std::to_chars(p, end, b->red[j]).ptr; break;
+        case 'G': p = std::to_chars(p, end, b->green[j]).ptr; break;
+        case 'B': p = std::to_chars(p, end, b->blue[j]).ptr; break;
+        case 'r': p = std::to_chars(p, end, (int)b->return_number[j]).ptr; break;
+        case 'n': p = std::to_chars(p, end, (int)b->number_of_returns[j]).ptr; break;
+        case 't': p = std::to_chars(p, end, b->gps_time[j], std::chars_format::fixed, 6).ptr; break;
+        case 'p': p = std::to_chars(p, end, b->point_source_ID[j]).ptr; break;
+        }
+      }
+      *p++ = '\n';
+    }
+    b->length = p - &b->text[0];
+  };
+  // writes the formatted blocks at the front of the queue. called with the lock held
+  void flush(std::unique_lock<std::mutex>& lock)
+  {
+    while (queue.size() && queue.front()->formatted)
+    {
+      E57block* b = queue.front();
+      queue.pop_front();
+      lock.unlock();
+      fwrite(&b->text[0], 1, b->length, file);
+      written += b->length;
+      b->count = 0;
+      b->length = 0;
+      b->claimed = false;
+      b->formatted = false;
+      lock.lock();
+      blocks.push_back(b);
+    }
+  };
+  void submit(E57block* b)
+  {
+    if (threads.empty())
+    {
+      format(b);
+      fwrite(&b->text[0], 1, b->length, file);
+      written += b->length;
+      b->count = 0;
+      b->length = 0;
+      blocks.push_back(b);
+      return;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.push_back(b);
+    condition.notify_all();
+    flush(lock);
+    // a few more blocks than workers are in flight
+    while (queue.size() > threads.size() + 1)
+    {
+      condition.wait(lock, [this] { return queue.front()->formatted; });
+      flush(lock);
+    }
+  };
+  void work()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true)
+    {
+      E57block* b = 0;
+      condition.wait(lock, [this, &b]
+      {
+        for (size_t k = 0; k < queue.size(); k++)
+        {
+          if (!queue[k]->claimed)
+          {
+            b = queue[k];
+            return true;
+          }
+        }
+        return quit;
+      });
+      if (b == 0) return;
+      b->claimed = true;
+      lock.unlock();
+      format(b);
+      lock.lock();
+      b->formatted = true;
+      condition.notify_all();
+    }
+  };
+  FILE* file;
+  char* parse_string;
+  char separator;
+  int fields;
+  double scale[3];
+  double offset[3];
+  int decimals[3];
+  bool exact[3];
+  I64 offset_units[3];
+  I64 divisor[3];
+  E57block* block;
+  std::vector<E57block*> blocks;
+  std::deque<E57block*> queue;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool quit;
+  I64 written;
+};
+
+bool E57filesink::parse(int argc, char* argv[], int first)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (argv[i][0] == '\0')
+    {
+      continue;
+    }
+    else if ((strcmp(argv[i], "-oparse") == 0) && ((i + 1) < argc))
+    {
+      // remember the requested fields before the writer consumes '-oparse'
+      if (parse_string) free(parse_string);
+      parse_string = LASCopyString(argv[i + 1]);
+    }
+    else if ((strcmp(argv[i], "-osep") == 0) && ((i + 1) < argc))
+    {
+      // the fast text writer knows the common separators only
+      if (strcmp(argv[i + 1], "space") == 0) separator = ' ';
+      else if (strcmp(argv[i + 1], "tab") == 0) separator = '\t';
+      else if (strcmp(argv[i + 1], "comma") == 0) separator = ',';
+      else if (strcmp(argv[i + 1], "semicolon") == 0) separator = ';';
+      else separator = '\0';
+    }
+    else if (strcmp(argv[i], "-async_io") == 0)
+    {
+      async_io = true;
+      argv[i][0] = '\0';
+    }
+    else if ((i >= first) && (strcmp(argv[i], "-set_scale") == 0))
+    {
+      if ((i + 3) >= argc)
+      {
+        fprintf(stderr, "ERROR: '%s' needs 3 arguments: x_scale_factor y_scale_factor z_scale_factor\n", argv[i]);
+        return false;
+      }
+      argv[i][0] = '\0';
+      for (int j = 0; j < 3; j++)
+      {
+        i++;
+        scale_factor[j] = atof(argv[i]);
+        argv[i][0] = '\0';
+      }
+      has_scale_factor = true;
+    }
+  }
+  if (!lasfilter.parse(argc, argv)) return false;
+  if (!laswriteopener.parse(argc, argv)) return false;
+  return true;
+}
+
+void E57filesink::needs(bool& intensity, bool& color, bool& returns, bool& time) const
+{
+  if (laswriteopener.get_format() == LAS_TOOLS_FORMAT_TXT)
+  {
+    const char* fields = (parse_string ? parse_string : "xyz");
+    intensity = intensity || (strchr(fields, 'i') != 0);
+    color = color || (strchr(fields, 'R') != 0) || (strchr(fields, 'G') != 0) || (strchr(fields, 'B') != 0) || (strchr(fields, 'H') != 0);
+    returns = returns || (strchr(fields, 'r') != 0) || (strchr(fields, 'n') != 0);
+    time = time || (strchr(fields, 't') != 0);
+  }
+  else
+  {
+    intensity = color = returns = time = true;
+  }
+}
+
+void E57filesink::set_quantizer(const LASquantizer* quantizer)
+{
+  ratio[0] = quantizer->x_scale_factor / header.x_scale_factor;
+  ratio[1] = quantizer->y_scale_factor / header.y_scale_factor;
+  ratio[2] = quantizer->z_scale_factor / header.z_scale_factor;
+  requantize = (ratio[0] != 1.0) || (ratio[1] != 1.0) || (ratio[2] != 1.0);
+}
+
+bool E57filesink::fast_txt() const
+{
+  return (laswriteopener.get_format() == LAS_TOOLS_FORMAT_TXT) && !lasfilter.active() && E57txtwriter::supports((parse_string ? parse_string : "xyz"), separator);
+}
+
+bool E57filesink::begin_scan(const E57scan& scan)
+{
+  if (scan.first && !open(scan)) return false;
+  set_quantizer(&scan.quantizer);
+  return true;
+}
+
+// creates the file name (if needed), populates the LAS header, and opens the writer
+
+bool E57filesink::open(const E57scan& scan)
+{
+  const e57::Data3D& scanHeader = *scan.header;
+
+  if (scan.merged)
+  {
+    if (!laswriteopener.get_file_name())
+    {
+      laswriteopener.make_file_name(scan.file_name, -2);
+    }
+  }
+  else
+  {
+    if (file_name_in.compare(scan.file_name) != 0)
+    {
+      char* file_name_temp;
+      if (laswriteopener.get_file_name())
+      {
+        file_name_temp = LASCopyString(laswriteopener.get_file_name());
+      }
+      else
+      {
+        file_name_temp = LASCopyString(scan.file_name);
+      }
+      int len = strlen(file_name_temp);
+      if (file_name_out) free(file_name_out);
+      file_name_out = (char*)malloc(len + 10);
+      memset(file_name_out, 0, len + 10);
+      strcpy(file_name_out, file_name_temp);
+      while (len > 0 && file_name_temp[len] != '.')
+      {
+        file_name_out[len + 5] = file_name_temp[len];
+        len--;
+      }
+      free(file_name_temp);
+      file_name_out[len + 5] = '.';
+      file_name_out[len + 4] = '0';
+      file_name_out[len + 3] = '0';
+      file_name_out[len + 2] = '0';
+      file_name_out[len + 1] = '0';
+      file_name_out[len + 0] = '0';
+      file_name_in = scan.file_name;
+    }
+    laswriteopener.set_force(TRUE);
+    laswriteopener.make_file_name(file_name_out, scan.index);
+  }
+
+  // Populate the LAS header
+
+  header.clean();
+  lasfilter.reset();
+
+  // COPC is LAS 1.4 and its info VLR must be the first VLR
+
+  copc = LASwriterCOPC::is_copc(laswriteopener.get_file_name());
+  if (copc)
+  {
+    LASwriterCOPC::init_header(&header);
+  }
+
+  // info about me
+
+  strncpy_las(header.system_identifier, LAS_HEADER_CHAR_LEN, LAS_TOOLS_COPYRIGHT);
+  sprintf(header.generating_software, "e572las.exe (version %d)", LAS_TOOLS_VERSION);
+
+  // what date was the data created
+
+  int year;
+  int month;
+  int day;
+  int hour;
+  int minute;
+  float seconds;
+
+  scanHeader.acquisitionStart.GetUTCDateTime(year, month, day, hour, minute, seconds);
+
+  int startday[13] = { -1, 0, 31, 59, 90, 120, 151, 181, 212, 243, 273, 304, 334 };
+  header.file_creation_day = startday[month] + day;
+  if (((year % 4) == 0) && (month > 2)) header.file_creation_day++; // leap year handling
+  header.file_creation_year = year;
+
+  // any other information in the header
+
+  auto vlr_add = [&](std::string user_id, std::string str) -> void {
+    U32 length;
+    U8* data;
+    length = (U32)str.length();
+    if (length) {
+      length = (length < HEADER_CHAR_LEN_MAX ? length : HEADER_CHAR_LEN_MAX);
+      data = new U8[length + 1];
+      strncpy_las((CHAR*)data, length + 1, str.c_str(), length);
+      header.add_vlr(user_id.c_str(), 4711, length, data, TRUE, (CHAR*)data);
+    }
+  };
+
+  vlr_add("name", scanHeader.name);
+  vlr_add("guid", scanHeader.guid);
+  vlr_add("description", scanHeader.description);
+  vlr_add("sensorVendor", scanHeader.sensorVendor);
+  vlr_add("sensorModel", scanHeader.sensorModel);
+  vlr_add("sensorSerialNo", scanHeader.sensorSerialNumber);
+  vlr_add("sensorHwVersion", scanHeader.sensorHardwareVersion);
+  vlr_add("sensorSwVersion", scanHeader.sensorSoftwareVersion);
+  vlr_add("sensorFwVersion", scanHeader.sensorFirmwareVersion);
+
+  // reserve the statistics of all scans that go into this file. they
+  // are filled in once the file is closed. the converter gathers them
+  // before the filter of this sink, so a filtered file does not get any
+
+  statistics_reserved = false;
+  scan_statistics.clear();
+  if (statistics && lasfilter.active())
+  {
+    LASMessage(LAS_VERBOSE, "  no statistics are stored in filtered '%s'", laswriteopener.get_file_name());
+  }
+  else if (statistics && laswriteopener.get_file_name() && ((laswriteopener.get_format() == LAS_TOOLS_FORMAT_LAS) || (laswriteopener.get_format() == LAS_TOOLS_FORMAT_LAZ)))
+  {
+    for (size_t index = 0; index < scan.output_scans.size(); index++)
+    {
+      U8* data = new U8[sizeof(E57statisticsRecord)];
+      memset(data, 0, sizeof(E57statisticsRecord));
+      char description[32];
+      snprintf(description, 32, "statistics of scan %d", scan.output_scans[index] + 1);
+      header.add_vlr("scanStatistics", (U16)(scan.output_scans[index] + 1), (U16)sizeof(E57statisticsRecord), data, TRUE, description);
+    }
+    statistics_reserved = true;
+  }
+
+  // a merged LAZ file gets variable chunks that end with each scan and
+  // an index that says which chunks and points belong to which scan
+
+  scan_chunks = false;
+  scan_index.clear();
+  number_chunks = 0;
+  chunk_points = 0;
+  if (chunk_scans && scan.merged && !copc && laswriteopener.get_file_name() && (laswriteopener.get_format() == LAS_TOOLS_FORMAT_LAZ))
+  {
+    int number_scans = (int)scan.output_scans.size();
+    if (number_scans * sizeof(E57scanChunks) > U16_MAX)
+    {
+      LASMessage(LAS_WARNING, "too many scans for a scan chunk index in '%s'. ignoring '-chunk_scans' ...", laswriteopener.get_file_name());
+    }
+    else
+    {
+      U8* data = new U8[number_scans * sizeof(E57scanChunks)];
+      memset(data, 0, number_scans * sizeof(E57scanChunks));
+      header.add_vlr("scanChunkIndex", 1, (U16)(number_scans * sizeof(E57scanChunks)), data, TRUE, "chunks and points of each scan");
+      laswriteopener.set_chunk_size(U32_MAX);
+      scan_chunks = true;
+    }
+  }
+
+  if (copc)
+  {
+    // the point types of LAS 1.4 always have a time stamp
+    header.point_data_format = (scan.color ? 7 : 6);
+    header.point_data_record_length = (scan.color ? 36 : 30);
+  }
+  else
+  {
+    if (scan.time_stamp)
+    {
+      header.point_data_format += 1;
+      header.point_data_record_length += 8;
+    }
+
+    if (scan.color)
+    {
+      header.point_data_format += 2;
+      header.point_data_record_length += 6;
+    }
+  }
+
+  // all sinks share the offset of the converter
+
+  header.x_scale_factor = scale_factor[0];
+  header.y_scale_factor = scale_factor[1];
+  header.z_scale_factor = scale_factor[2];
+
+  header.x_offset = scan.quantizer.x_offset;
+  header.y_offset = scan.quantizer.y_offset;
+  header.z_offset = scan.quantizer.z_offset;
+
+  // georeference the output with the target (or else the source) projection
+
+  GeoProjectionConverter* geoprojectionconverter = scan.geoprojectionconverter;
+
+  if (copc)
+  {
+    // the point types of LAS 1.4 are georeferenced with OGC WKT. COPC requires
+    // it, so points without a known projection get the local (engineering)
+    // coordinate system of the scanner in meters
+    int len = 0;
+    char* ogc_wkt = 0;
+    if (geoprojectionconverter && geoprojectionconverter->get_ogc_wkt_from_projection(len, &ogc_wkt, !scan.reprojected))
+    {
+      header.set_geo_ogc_wkt(len, ogc_wkt);
+      free(ogc_wkt);
+    }
+    else
+    {
+      static const char local_wkt[] = "LOCAL_CS[\"scanner coordinates\",LOCAL_DATUM[\"unknown\",0],UNIT[\"metre\",1],AXIS[\"X\",OTHER],AXIS[\"Y\",OTHER],AXIS[\"Z\",UP]]";
+      header.set_geo_ogc_wkt((U32)sizeof(local_wkt), local_wkt);
+      LASMessage(LAS_VERBOSE, "  COPC output has no projection. writing a local coordinate system");
+    }
+    header.set_global_encoding_bit(LAS_TOOLS_GLOBAL_ENCODING_BIT_OGC_WKT_CRS);
+  }
+  else if (geoprojectionconverter)
+  {
+    int number_of_keys;
+    GeoProjectionGeoKeys* geo_keys = 0;
+    int num_geo_double_params;
+    double* geo_double_params = 0;
+    if (geoprojectionconverter->get_geo_keys_from_projection(number_of_keys, &geo_keys, num_geo_double_params, &geo_double_params, !scan.reprojected))
+    {
+      header.set_geo_keys(number_of_keys, (LASvlr_key_entry*)geo_keys);
+      free(geo_keys);
+      if (geo_double_params)
+      {
+        header.set_geo_double_params(num_geo_double_params, geo_double_params);
+        free(geo_double_params);
+      }
+      else
+      {
+        header.del_geo_double_params();
+      }
+      header.del_geo_ascii_params();
+    }
+  }
+
+  const char* all = (scan.merged && (scan.number_scans > 1) ? "all scans are" : "is");
+
+  if ((header.x_scale_factor == 0.001) && (header.y_scale_factor == 0.001) && (header.z_scale_factor == 0.001))
+  {
+    LASMessage(LAS_VERBOSE, "  %s written with millimeter resolution to '%s'", all, laswriteopener.get_file_name());
+  }
+  else if ((header.x_scale_factor == 0.01) && (header.y_scale_factor == 0.01) && (header.z_scale_factor == 0.01))
+  {
+    LASMessage(LAS_VERBOSE, "  %s written with centimeter resolution to '%s'", all, laswriteopener.get_file_name());
+  }
+  else if ((header.x_scale_factor == 0.1) && (header.y_scale_factor == 0.1) && (header.z_scale_factor == 0.1))
+  {
+    LASMessage(LAS_VERBOSE, "  %s written with decimeter resolution to '%s'", all, laswriteopener.get_file_name());
+  }
+  else if ((header.x_scale_factor == 0.0001) && (header.y_scale_factor == 0.0001) && (header.z_scale_factor == 0.0001))
+  {
+    LASMessage(LAS_VERBOSE, "  %s written with 0.1 mm resolution to '%s'", all, laswriteopener.get_file_name());
+  }
+  else if ((header.x_scale_factor == 0.00001) && (header.y_scale_factor == 0.00001) && (header.z_scale_factor == 0.00001))
+  {
+    LASMessage(LAS_VERBOSE, "  %s written with 0.01 mm resolution to '%s'", all, laswriteopener.get_file_name());
+  }
+  else if ((header.x_scale_factor == 0.000001) && (header.y_scale_factor == 0.000001) && (header.z_scale_factor == 0.000001))
+  {
+    LASMessage(LAS_VERBOSE, "  %s written with 0.001 mm resolution to '%s'", all, laswriteopener.get_file_name());
+  }
+  else
+  {
+    LASMessage(LAS_VERBOSE, "  %s written with resolution %g %g %g to '%s'", all, header.x_scale_factor, header.y_scale_factor, header.z_scale_factor, laswriteopener.get_file_name());
+  }
+
+  // Initialize the LAS point
+
+  point.init(&header, header.point_data_format, header.point_data_record_length, &header);
+
+  // Open the writer
+
+  if (copc)
+  {
+    LASwriterCOPC* laswritercopc = new LASwriterCOPC();
+    if (laswritercopc->open(laswriteopener.get_file_name(), &header, scan.cores))
+    {
+      laswriter = laswritercopc;
+    }
+    else
+    {
+      delete laswritercopc;
+    }
+  }
+  else if (fast_txt())
+  {
+    txtwriter = new E57txtwriter();
+    if (!txtwriter->open(laswriteopener.get_file_name(), &header, (parse_string ? parse_string : "xyz"), separator, scan.cores))
+    {
+      delete txtwriter;
+      txtwriter = 0;
+    }
+  }
+  else if (async_io && laswriteopener.get_file_name() && ((laswriteopener.get_format() == LAS_TOOLS_FORMAT_LAS) || (laswriteopener.get_format() == LAS_TOOLS_FORMAT_LAZ)))
+  {
+    laswriter = open_async();
+  }
+  else
+  {
+    laswriter = laswriteopener.open(&header);
+  }
+
+  if ((laswriter == 0) && (txtwriter == 0))
+  {
+    LASMessage(LAS_ERROR, "opening '%s'", laswriteopener.get_file_name());
+    return false;
+  }
+  return true;
+}
+
+// LAS and LAZ are written through large blocks that io_uring or a writer
+// thread put on disk so that the compression never waits for the disk
+
+LASwriter* E57filesink::open_async()
+{
+  FILE* file = LASfopen(laswriteopener.get_file_name(), "wb");
+  if (file == 0) return 0;
+  stream = new ByteStreamOutAsync();
+  if (!stream->open(file))
+  {
+    delete stream;
+    stream = 0;
+    return 0;
+  }
+  U32 compressor = LASZIP_COMPRESSOR_NONE;
+  if (laswriteopener.get_format() == LAS_TOOLS_FORMAT_LAZ)
+  {
+    compressor = (header.point_data_format > 5 ? LASZIP_COMPRESSOR_LAYERED_CHUNKED : LASZIP_COMPRESSOR_CHUNKED);
+  }
+  LASwriterLAS* laswriterlas = new LASwriterLAS();
+  if (!laswriterlas->open(stream, &header, compressor, 0, (I32)(scan_chunks ? U32_MAX : LASZIP_CHUNK_SIZE_DEFAULT)))
+  {
+    delete laswriterlas;
+    delete stream;
+    stream = 0;
+    return 0;
+  }
+  LASMessage(LAS_VERBOSE, "  output is written asynchronously with %s", (stream->uses_io_uring() ? "io_uring" : "a writer thread"));
+  return laswriterlas;
+}
+
+void E57filesink::write(const E57batch* batch)
+{
+  if (txtwriter)
+  {
+    txtwriter->write(batch, ratio, requantize, &header);
+    return;
+  }
+  point.set_point_source_ID(batch->point_source_ID);
+  for (unsigned int j = 0; j < batch->count; j++)
+  {
+    if (requantize && batch->x)
+    {
+      point.set_X(header.get_X(batch->x[j]));
+      point.set_Y(header.get_Y(batch->y[j]));
+      point.set_Z(header.get_Z(batch->z[j]));
+    }
+    else if (requantize)
+    {
+      point.set_X(I32_QUANTIZE(ratio[0] * batch->X[j]));
+      point.set_Y(I32_QUANTIZE(ratio[1] * batch->Y[j]));
+      point.set_Z(I32_QUANTIZE(ratio[2] * batch->Z[j]));
+    }
+    else
+    {
+      point.set_X(batch->X[j]);
+      point.set_Y(batch->Y[j]);
+      point.set_Z(batch->Z[j]);
+    }
+
+    if (batch->intensity)
+    {
+      point.intensity = batch->intensity[j];
+    }
+
+    if (batch->red)
+    {
+      point.rgb[0] = batch->red[j];
+      point.rgb[1] = batch->green[j];
+      point.rgb[2] = batch->blue[j];
+    }
+
+    if (batch->return_number)
+    {
+      point.return_number = batch->return_number[j] & 7;
+      point.extended_return_number = batch->return_number[j] & 15;
+    }
+
+    if (batch->number_of_returns)
+    {
+      point.number_of_returns = batch->number_of_returns[j] & 7;
+      point.extended_number_of_returns = batch->number_of_returns[j] & 15;
+    }
+
+    if (batch->gps_time)
+    {
+      point.gps_time = batch->gps_time[j];
+    }
+
+    if (lasfilter.active() && lasfilter.filter(&point))
+    {
+      continue;
+    }
+
+    laswriter->write_point(&point);
+    laswriter->update_inventory(&point);
+
+    // with variable chunks the chunks are ended here
+    if (scan_chunks && (++chunk_points == LASZIP_CHUNK_SIZE_DEFAULT))
+    {
+      laswriter->chunk();
+      number_chunks++;
+      chunk_points = 0;
+    }
+  }
+}
+
+// ends the chunk of the last points of a scan and notes where the scan is.
+// the converter only calls this once the thread of the sink is done with the
+// scan. the last scan of a file closes it and fills in the reserved VLRs
+
+bool E57filesink::end_scan(const E57scan& scan)
+{
+  if (scan_chunks && laswriter)
+  {
+    if (chunk_points)
+    {
+      laswriter->chunk();
+      number_chunks++;
+      chunk_points = 0;
+    }
+    E57scanChunks entry;
+    entry.scan = (U32)(scan.index + 1);
+    entry.first_chunk = (scan_index.size() ? scan_index.back().first_chunk + scan_index.back().number_chunks : 0);
+    entry.number_chunks = number_chunks - entry.first_chunk;
+    entry.reserved = 0;
+    entry.first_point = (scan_index.size() ? scan_index.back().first_point + scan_index.back().number_points : 0);
+    entry.number_points = laswriter->p_count - entry.first_point;
+    scan_index.push_back(entry);
+  }
+
+  // a coarser resolution rounds the bounds just like it rounds the points
+
+  if (statistics_reserved && scan.statistics)
+  {
+    E57statisticsRecord record = *scan.statistics;
+    if (requantize)
+    {
+      record.min[0] = header.get_x(header.get_X(record.min[0]));
+      record.min[1] = header.get_y(header.get_Y(record.min[1]));
+      record.min[2] = header.get_z(header.get_Z(record.min[2]));
+      record.max[0] = header.get_x(header.get_X(record.max[0]));
+      record.max[1] = header.get_y(header.get_Y(record.max[1]));
+      record.max[2] = header.get_z(header.get_Z(record.max[2]));
+    }
+    scan_statistics.push_back(record);
+  }
+
+  if (!scan.last) return true;
+
+  std::string name = (laswriteopener.get_file_name() ? laswriteopener.get_file_name() : "");
+  close();
+
+  for (size_t t = 0; t < scan_statistics.size(); t++)
+  {
+    if (!e57_patch_vlr(name.c_str(), "scanStatistics", (U16)scan_statistics[t].scan, &scan_statistics[t], (U16)sizeof(E57statisticsRecord)))
+    {
+      LASMessage(LAS_WARNING, "could not store the statistics of scan %u in '%s'", scan_statistics[t].scan, name.c_str());
+    }
+  }
+  scan_statistics.clear();
+
+  if (scan_chunks)
+  {
+    if (!e57_patch_vlr(name.c_str(), "scanChunkIndex", 1, scan_index.data(), (U16)(scan_index.size() * sizeof(E57scanChunks))))
+    {
+      LASMessage(LAS_WARNING, "could not store the scan chunk index in '%s'", name.c_str());
+    }
+    else
+    {
+      LASMessage(LAS_VERBOSE, "  %d scans are in %u chunks of '%s'", (int)scan_index.size(), number_chunks, name.c_str());
+    }
+    scan_index.clear();
+    number_chunks = 0;
+    chunk_points = 0;
+  }
+  return true;
+}
+
+void E57filesink::close()
+{
+  if (laswriter)
+  {
+    laswriter->update_header(&header, TRUE);
+    laswriter->close();
+    delete laswriter;
+    laswriter = 0;
+  }
+  if (stream)
+  {
+    // the writer does not own the stream
+    if (!stream->close()) LASMessage(LAS_ERROR, "writing '%s'", laswriteopener.get_file_name());
+    delete stream;
+    stream = 0;
+  }
+  if (txtwriter)
+  {
+    txtwriter->close();
+    delete txtwriter;
+    txtwriter = 0;
+  }
+  laswriteopener.set_file_name(0);
+}
+
+E57filesink::E57filesink()
+{
+  parse_string = 0;
+  scale_factor[0] = scale_factor[1] = scale_factor[2] = 0.001;
+  has_scale_factor = false;
+  statistics = false;
+  chunk_scans = false;
+  async_io = false;
+  copc = false;
+  statistics_reserved = false;
+  scan_chunks = false;
+  number_chunks = 0;
+  chunk_points = 0;
+  file_name_out = 0;
+  laswriter = 0;
+  stream = 0;
+  txtwriter = 0;
+  separator = ' ';
+  ratio[0] = ratio[1] = ratio[2] = 1.0;
+  requantize = false;
+}
+
+E57filesink::~E57filesink()
+{
+  // the thread must not call write() once this part of the sink is gone
+  stop();
+  if (laswriter)
+  {
+    laswriter->close();
+    delete laswriter;
+  }
+  if (stream) delete stream;
+  if (txtwriter) delete txtwriter;
+  if (parse_string) free(parse_string);
+  if (file_name_out) free(file_name_out);
+}
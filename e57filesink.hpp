@@ -0,0 +1,87 @@
+// e57filesink.hpp : writes the converted batches into LAS, LAZ, COPC, or text files.
+
+#ifndef E57_FILE_SINK_HPP
+#define E57_FILE_SINK_HPP
+
+#include "e57tolasconverter.hpp"
+
+#include "laswriter.hpp"
+#include "lasfilter.hpp"
+
+#include <string>
+#include <vector>
+
+class E57txtwriter;
+class ByteStreamOutAsync;
+
+// where the points of one scan are in a merged LAZ file with '-chunk_scans'.
+// each scan starts a new chunk so that a reader can find the byte offset of
+// 'first_chunk' in the chunk table and decompress this scan only. the array
+// of these records is stored in the "scanChunkIndex" VLR
+
+struct E57scanChunks {
+  U32 scan;
+  U32 first_chunk;
+  U32 number_chunks;
+  U32 reserved;
+  I64 first_point;
+  I64 number_points;
+};
+
+// one output of the conversion. every '-o' on the command line starts a sink
+// with its own writer, scale, filter, and '-oparse'. merged scans go into one
+// file and split scans into one numbered file each
+
+class E57filesink : public E57sink {
+public:
+  // parses the output options. a '-set_scale' is only taken from 'first' on
+  // as the options in front of it are shared by all sinks
+  bool parse(int argc, char* argv[], int first);
+  // adds the fields that this sink writes
+  void needs(bool& intensity, bool& color, bool& returns, bool& time) const;
+  const F64* get_scale_factor() const { return scale_factor; };
+  bool begin_scan(const E57scan& scan);
+  void write(const E57batch* batch);
+  bool end_scan(const E57scan& scan);
+  E57filesink();
+  ~E57filesink();
+  LASwriteOpener laswriteopener;
+  LASfilter lasfilter;
+  char* parse_string;
+  double scale_factor[3];
+  bool has_scale_factor;
+  // reserve VLRs for the statistics that the converter gathers
+  bool statistics;
+  // end a chunk of merged LAZ files with each scan
+  bool chunk_scans;
+  // write LAS and LAZ without waiting for the disk
+  bool async_io;
+private:
+  bool open(const E57scan& scan);
+  LASwriter* open_async();
+  void close();
+  // the shared batch is quantized with this (finer) resolution
+  void set_quantizer(const LASquantizer* quantizer);
+  // text without filters goes through the fast text writer
+  bool fast_txt() const;
+  bool copc;
+  bool statistics_reserved;
+  bool scan_chunks;
+  U32 number_chunks;
+  U32 chunk_points;
+  std::vector<E57scanChunks> scan_index;
+  std::vector<E57statisticsRecord> scan_statistics;
+  // split scans are numbered from this name that is derived once per E57 file
+  std::string file_name_in;
+  char* file_name_out;
+  LASheader header;
+  LASpoint point;
+  LASwriter* laswriter;
+  ByteStreamOutAsync* stream;
+  E57txtwriter* txtwriter;
+  char separator;
+  double ratio[3];
+  bool requantize;
+};
+
+#endif
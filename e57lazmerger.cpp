@@ -0,0 +1,444 @@
+// e57lazmerger.cpp : merges LAZ files chunk by chunk without recompressing any point.
+
+#include "e57lazmerger.hpp"
+
+#include <cstring>
+#include <algorithm>
+
+#include "bytestreamin_file.hpp"
+#include "bytestreamout_file.hpp"
+#include "laschunktable.hpp"
+
+#define E57_LAZ_COPY_BLOCK 4194304
+
+static bool e57_vlr_is(const U8* vlr_header, const char* user_id, I32 record_id = -1)
+{
+  U16 vlr_record_id;
+  memcpy(&vlr_record_id, vlr_header + 18, 2);
+  return (strncmp((const char*)(vlr_header + 2), user_id, 16) == 0) && ((record_id < 0) || (vlr_record_id == record_id));
+}
+
+// reads the header, the VLRs, and the chunk table of a LAZ file
+
+bool E57lazmerger::read(E57lazinput& input)
+{
+  const char* file_name = input.file_name.c_str();
+  FILE* file = LASfopen(file_name, "rb");
+  if (file == 0)
+  {
+    LASMessage(LAS_ERROR, "cannot open '%s'", file_name);
+    return false;
+  }
+  ByteStreamInFileLE* stream = new ByteStreamInFileLE(file);
+  bool success = false;
+
+  try
+  {
+    U8 start[227];
+    stream->getBytes(start, 227);
+    U16 header_size;
+    memcpy(&header_size, start + 94, 2);
+    if ((strncmp((const char*)start, "LASF", 4) != 0) || (header_size < 227))
+    {
+      LASMessage(LAS_ERROR, "'%s' is not a LAS file", file_name);
+      throw 1;
+    }
+    input.header.assign(start, start + 227);
+    if (header_size > 227)
+    {
+      input.header.resize(header_size);
+      stream->getBytes(input.header.data() + 227, header_size - 227);
+    }
+    const U8* header = input.header.data();
+
+    U8 version_minor = header[25];
+    U32 number_of_variable_length_records;
+    U8 point_data_format = header[104];
+    memcpy(&input.offset_to_point_data, header + 96, 4);
+    memcpy(&number_of_variable_length_records, header + 100, 4);
+    memcpy(input.bounds, header + 179, 48);
+
+    if ((point_data_format & 0xC0) == 0)
+    {
+      LASMessage(LAS_ERROR, "'%s' is not compressed. only LAZ files are merged chunk by chunk", file_name);
+      throw 1;
+    }
+
+    U32 legacy_number_of_point_records;
+    U32 legacy_number_of_points_by_return[5];
+    memcpy(&legacy_number_of_point_records, header + 107, 4);
+    memcpy(legacy_number_of_points_by_return, header + 111, 20);
+    input.number_points = legacy_number_of_point_records;
+    for (int r = 0; r < 15; r++) input.number_of_points_by_return[r] = (r < 5 ? legacy_number_of_points_by_return[r] : 0);
+    if ((version_minor >= 4) && (header_size >= 375))
+    {
+      U32 number_of_extended_variable_length_records;
+      U64 extended_number_of_point_records;
+      memcpy(&number_of_extended_variable_length_records, header + 243, 4);
+      memcpy(&extended_number_of_point_records, header + 247, 8);
+      memcpy(input.number_of_points_by_return, header + 255, 120);
+      if (number_of_extended_variable_length_records)
+      {
+        LASMessage(LAS_ERROR, "'%s' has EVLRs (is it COPC?). cannot merge it chunk by chunk", file_name);
+        throw 1;
+      }
+      input.number_points = (I64)extended_number_of_point_records;
+    }
+
+    // the VLRs. the LASzip VLR says how the points are compressed
+
+    input.vlrs.resize(number_of_variable_length_records);
+    input.chunk_size = 0;
+    bool laszip = false;
+    for (U32 v = 0; v < number_of_variable_length_records; v++)
+    {
+      E57lazvlr& vlr = input.vlrs[v];
+      stream->getBytes(vlr.header, 54);
+      U16 record_length_after_header;
+      memcpy(&record_length_after_header, vlr.header + 20, 2);
+      vlr.data.resize(record_length_after_header);
+      if (record_length_after_header) stream->getBytes(vlr.data.data(), record_length_after_header);
+      if (e57_vlr_is(vlr.header, "laszip encoded", 22204) && (record_length_after_header >= 34))
+      {
+        U16 compressor;
+        memcpy(&compressor, vlr.data.data(), 2);
+        memcpy(&input.chunk_size, vlr.data.data() + 12, 4);
+        if ((compressor != LASZIP_COMPRESSOR_POINTWISE_CHUNKED) && (compressor != LASZIP_COMPRESSOR_LAYERED_CHUNKED))
+        {
+          LASMessage(LAS_ERROR, "the points of '%s' are not compressed in chunks", file_name);
+          throw 1;
+        }
+        laszip = true;
+      }
+      else if (e57_vlr_is(vlr.header, "scanChunkIndex", 1))
+      {
+        input.scan_index.resize(record_length_after_header / sizeof(E57scanChunks));
+        if (input.scan_index.size()) memcpy(input.scan_index.data(), vlr.data.data(), input.scan_index.size() * sizeof(E57scanChunks));
+      }
+    }
+    if (!laszip)
+    {
+      LASMessage(LAS_ERROR, "'%s' has no LASzip VLR", file_name);
+      throw 1;
+    }
+
+    // the chunk table must account for every point
+
+    LASchunktable table;
+    if (!table.read(stream, input.offset_to_point_data, input.chunk_size, input.number_points))
+    {
+      LASMessage(LAS_ERROR, "cannot read the chunk table of '%s'", file_name);
+      throw 1;
+    }
+    I64 points = 0;
+    for (U32 c = 0; c < table.number_chunks; c++) points += table.chunk_sizes[c];
+    if (points != input.number_points)
+    {
+      LASMessage(LAS_ERROR, "the chunks of '%s' have %lld instead of %lld points", file_name, points, input.number_points);
+      throw 1;
+    }
+    input.chunk_start = table.chunk_start;
+    input.chunk_sizes.assign(table.chunk_sizes, table.chunk_sizes + table.number_chunks);
+    input.chunk_bytes.assign(table.chunk_bytes, table.chunk_bytes + table.number_chunks);
+    success = true;
+  }
+  catch (...)
+  {
+    if (!success) LASMessage(LAS_ERROR, "cannot merge '%s'", file_name);
+  }
+
+  delete stream;
+  fclose(file);
+  return success;
+}
+
+bool E57lazmerger::add(const char* file_name)
+{
+  E57lazinput input;
+  input.file_name = file_name;
+  if (!read(input)) return false;
+
+  // the chunks of all files must decompress with the same header. the
+  // LASzip VLRs may differ in the LASzip version and the chunk size
+
+  if (inputs.size())
+  {
+    const E57lazinput& first = inputs[0];
+    const U8* a = first.header.data();
+    const U8* b = input.header.data();
+    if ((a[25] != b[25]) || (a[104] != b[104]) || (memcmp(a + 105, b + 105, 2) != 0))
+    {
+      LASMessage(LAS_ERROR, "'%s' has another version or point type than '%s'. use lasmerge", file_name, first.file_name.c_str());
+      return false;
+    }
+    if (memcmp(a + 131, b + 131, 48) != 0)
+    {
+      LASMessage(LAS_ERROR, "'%s' has another scale or offset than '%s'. convert the pieces with the same '-set_scale' and '-set_offset' or use lasmerge", file_name, first.file_name.c_str());
+      return false;
+    }
+    const std::vector<U8>* laszip[2] = { NULL, NULL };
+    for (int k = 0; k < 2; k++)
+    {
+      const E57lazinput& in = (k ? input : first);
+      for (size_t v = 0; v < in.vlrs.size(); v++)
+      {
+        if (e57_vlr_is(in.vlrs[v].header, "laszip encoded", 22204)) laszip[k] = &in.vlrs[v].data;
+      }
+    }
+    const std::vector<U8>& c = *laszip[0];
+    const std::vector<U8>& d = *laszip[1];
+    if ((c.size() != d.size()) || (memcmp(c.data(), d.data(), 4) != 0) || (memcmp(c.data() + 8, d.data() + 8, 4) != 0) || (memcmp(c.data() + 32, d.data() + 32, c.size() - 32) != 0))
+    {
+      LASMessage(LAS_ERROR, "the points of '%s' are compressed differently than those of '%s'. use lasmerge", file_name, first.file_name.c_str());
+      return false;
+    }
+  }
+
+  // a file without scan chunk index is one scan. its number is that of its
+  // statistics if it has any and otherwise the number of the file
+
+  if (input.scan_index.empty())
+  {
+    E57scanChunks entry;
+    entry.scan = (U32)(inputs.size() + 1);
+    for (size_t v = 0; v < input.vlrs.size(); v++)
+    {
+      if (e57_vlr_is(input.vlrs[v].header, "scanStatistics"))
+      {
+        U16 record_id;
+        memcpy(&record_id, input.vlrs[v].header + 18, 2);
+        entry.scan = record_id;
+        break;
+      }
+    }
+    entry.first_chunk = 0;
+    entry.number_chunks = (U32)input.chunk_sizes.size();
+    entry.reserved = 0;
+    entry.first_point = 0;
+    entry.number_points = input.number_points;
+    input.scan_index.push_back(entry);
+  }
+
+  number_points += input.number_points;
+  number_chunks += (U32)input.chunk_sizes.size();
+  inputs.push_back(input);
+  LASMessage(LAS_VERBOSE, "  '%s' has %lld points in %u chunks", file_name, input.number_points, (U32)input.chunk_sizes.size());
+  return true;
+}
+
+bool E57lazmerger::merge(const char* file_name)
+{
+  if (inputs.empty())
+  {
+    LASMessage(LAS_ERROR, "no LAZ files to merge");
+    return false;
+  }
+
+  const E57lazinput& first = inputs[0];
+  std::vector<U8> header = first.header;
+  U8 version_minor = header[25];
+  U8 point_type = (header[104] & 0x3F);
+
+  if ((version_minor < 4) && (number_points > U32_MAX))
+  {
+    LASMessage(LAS_ERROR, "%lld points are too many for LAS 1.%d", number_points, version_minor);
+    return false;
+  }
+
+  // the VLRs of the first file without its statistics and scan chunk index,
+  // then the statistics of all files and the new scan chunk index
+
+  std::vector<const E57lazvlr*> vlrs;
+  E57lazvlr laszip;
+  for (size_t v = 0; v < first.vlrs.size(); v++)
+  {
+    const E57lazvlr& vlr = first.vlrs[v];
+    if (e57_vlr_is(vlr.header, "scanStatistics") || e57_vlr_is(vlr.header, "scanChunkIndex")) continue;
+    if (e57_vlr_is(vlr.header, "laszip encoded", 22204))
+    {
+      laszip = vlr;
+      U32 variable = U32_MAX;
+      memcpy(laszip.data.data() + 12, &variable, 4);
+      vlrs.push_back(&laszip);
+    }
+    else
+    {
+      vlrs.push_back(&vlr);
+    }
+  }
+  for (size_t f = 0; f < inputs.size(); f++)
+  {
+    for (size_t v = 0; v < inputs[f].vlrs.size(); v++)
+    {
+      if (e57_vlr_is(inputs[f].vlrs[v].header, "scanStatistics")) vlrs.push_back(&inputs[f].vlrs[v]);
+    }
+  }
+
+  std::vector<E57scanChunks> scan_index;
+  U32 chunks_before = 0;
+  I64 points_before = 0;
+  for (size_t f = 0; f < inputs.size(); f++)
+  {
+    for (size_t e = 0; e < inputs[f].scan_index.size(); e++)
+    {
+      E57scanChunks entry = inputs[f].scan_index[e];
+      entry.first_chunk += chunks_before;
+      entry.first_point += points_before;
+      scan_index.push_back(entry);
+    }
+    chunks_before += (U32)inputs[f].chunk_sizes.size();
+    points_before += inputs[f].number_points;
+  }
+  E57lazvlr index;
+  if (scan_index.size() * sizeof(E57scanChunks) > U16_MAX)
+  {
+    LASMessage(LAS_WARNING, "too many scans for a scan chunk index in '%s'. omitting it ...", file_name);
+  }
+  else
+  {
+    U16 record_id = 1;
+    U16 record_length_after_header = (U16)(scan_index.size() * sizeof(E57scanChunks));
+    memset(index.header, 0, 54);
+    strncpy((char*)index.header + 2, "scanChunkIndex", 16);
+    memcpy(index.header + 18, &record_id, 2);
+    memcpy(index.header + 20, &record_length_after_header, 2);
+    strncpy((char*)index.header + 22, "chunks and points of each scan", 32);
+    index.data.resize(record_length_after_header);
+    if (record_length_after_header) memcpy(index.data.data(), scan_index.data(), record_length_after_header);
+    vlrs.push_back(&index);
+  }
+
+  // patch the header. the legacy counts are zero for the point types of LAS 1.4
+
+  U32 offset_to_point_data = (U32)header.size();
+  for (size_t v = 0; v < vlrs.size(); v++) offset_to_point_data += 54 + (U32)vlrs[v]->data.size();
+  U32 number_of_variable_length_records = (U32)vlrs.size();
+  memcpy(header.data() + 96, &offset_to_point_data, 4);
+  memcpy(header.data() + 100, &number_of_variable_length_records, 4);
+
+  U64 number_of_points_by_return[15];
+  memset(number_of_points_by_return, 0, sizeof(number_of_points_by_return));
+  F64 bounds[6];
+  memcpy(bounds, first.bounds, 48);
+  bool bounded = false;
+  for (size_t f = 0; f < inputs.size(); f++)
+  {
+    for (int r = 0; r < 15; r++) number_of_points_by_return[r] += inputs[f].number_of_points_by_return[r];
+    if (inputs[f].number_points == 0) continue;
+    if (!bounded)
+    {
+      memcpy(bounds, inputs[f].bounds, 48);
+      bounded = true;
+    }
+    // max_x min_x max_y min_y max_z min_z
+    for (int i = 0; i < 6; i += 2)
+    {
+      bounds[i] = std::max(bounds[i], inputs[f].bounds[i]);
+      bounds[i + 1] = std::min(bounds[i + 1], inputs[f].bounds[i + 1]);
+    }
+  }
+  memcpy(header.data() + 179, bounds, 48);
+
+  bool legacy = (point_type <= 5) && (number_points <= U32_MAX);
+  U32 legacy_number_of_point_records = (legacy ? (U32)number_points : 0);
+  memcpy(header.data() + 107, &legacy_number_of_point_records, 4);
+  for (int r = 0; r < 5; r++)
+  {
+    U32 legacy_number_of_points_by_return = ((legacy && (number_of_points_by_return[r] <= U32_MAX)) ? (U32)number_of_points_by_return[r] : 0);
+    memcpy(header.data() + 111 + 4 * r, &legacy_number_of_points_by_return, 4);
+  }
+  if ((version_minor >= 4) && (header.size() >= 375))
+  {
+    U64 start_of_first_extended_variable_length_record = 0;
+    U32 number_of_extended_variable_length_records = 0;
+    U64 extended_number_of_point_records = (U64)number_points;
+    memcpy(header.data() + 235, &start_of_first_extended_variable_length_record, 8);
+    memcpy(header.data() + 243, &number_of_extended_variable_length_records, 4);
+    memcpy(header.data() + 247, &extended_number_of_point_records, 8);
+    memcpy(header.data() + 255, number_of_points_by_return, 120);
+  }
+
+  FILE* file = LASfopen(file_name, "wb");
+  if (file == 0)
+  {
+    LASMessage(LAS_ERROR, "cannot open '%s'", file_name);
+    return false;
+  }
+  ByteStreamOutFileLE* stream = new ByteStreamOutFileLE(file);
+
+  bool success = (stream->putBytes(header.data(), (U32)header.size()) == TRUE);
+  for (size_t v = 0; (v < vlrs.size()) && success; v++)
+  {
+    success = stream->putBytes(vlrs[v]->header, 54) && (vlrs[v]->data.empty() || stream->putBytes(vlrs[v]->data.data(), (U32)vlrs[v]->data.size()));
+  }
+  I64 chunk_table_pointer = stream->tell();
+  I64 placeholder = -1;
+  if (success) success = (stream->put64bitsLE((const U8*)&placeholder) == TRUE);
+
+  // the compressed bytes of all chunks of a file are copied in large blocks
+
+  LASchunktable table;
+  std::vector<U8> buffer(E57_LAZ_COPY_BLOCK);
+  for (size_t f = 0; (f < inputs.size()) && success; f++)
+  {
+    const E57lazinput& input = inputs[f];
+    FILE* in_file = LASfopen(input.file_name.c_str(), "rb");
+    if (in_file == 0)
+    {
+      LASMessage(LAS_ERROR, "cannot reopen '%s'", input.file_name.c_str());
+      success = false;
+      break;
+    }
+    ByteStreamInFileLE* in = new ByteStreamInFileLE(in_file);
+    I64 bytes = 0;
+    for (size_t c = 0; c < input.chunk_sizes.size(); c++)
+    {
+      bytes += input.chunk_bytes[c];
+      table.add(input.chunk_sizes[c], input.chunk_bytes[c]);
+    }
+    try
+    {
+      success = (in->seek(input.chunk_start) == TRUE);
+      while (success && (bytes > 0))
+      {
+        U32 number = (U32)std::min(bytes, (I64)E57_LAZ_COPY_BLOCK);
+        in->getBytes(buffer.data(), number);
+        success = (stream->putBytes(buffer.data(), number) == TRUE);
+        bytes -= number;
+      }
+    }
+    catch (...)
+    {
+      LASMessage(LAS_ERROR, "'%s' ends before its last chunk", input.file_name.c_str());
+      success = false;
+    }
+    delete in;
+    fclose(in_file);
+  }
+
+  if (success)
+  {
+    success = (table.write(stream, chunk_table_pointer, TRUE) == TRUE);
+  }
+
+  delete stream;
+  if (fclose(file) != 0) success = false;
+  if (!success)
+  {
+    LASMessage(LAS_ERROR, "cannot write '%s'", file_name);
+    remove(file_name);
+    return false;
+  }
+  LASMessage(LAS_VERBOSE, "merged %lld points in %u chunks of %d files into '%s'", number_points, number_chunks, (int)inputs.size(), file_name);
+  return true;
+}
+
+E57lazmerger::E57lazmerger()
+{
+  number_points = 0;
+  number_chunks = 0;
+}
+
+E57lazmerger::~E57lazmerger()
+{
+}
@@ -0,0 +1,60 @@
+// e57lazmerger.hpp : merges LAZ files chunk by chunk without recompressing any point.
+
+#ifndef E57_LAZ_MERGER_HPP
+#define E57_LAZ_MERGER_HPP
+
+#include "e57filesink.hpp"
+
+#include <vector>
+
+// when big E57 files are converted in pieces (e.g. '-scan 1 2 3' and '-scan
+// 4 5 6' with '-split_scans' on different machines) the pieces are LAZ files
+// with the same point format, scale, and offset. as every LAZ chunk is
+// compressed on its own their chunks are simply copied one after the other
+// into the merged file. only the header, the VLRs, the chunk table pointer,
+// and the chunk table are written new. the merged file has variable chunks.
+// it keeps the VLRs of the first file, collects the "scanStatistics" VLRs of
+// all files, and gets a "scanChunkIndex" VLR that says which chunks hold the
+// points of which scan (so each file or scan can still be read on its own)
+
+class E57lazmerger
+{
+public:
+  // reads the header and the VLRs of the next file and checks that its chunks
+  // can be appended to those of the earlier files
+  bool add(const char* file_name);
+  // writes the merged file. returns false after an error
+  bool merge(const char* file_name);
+  I64 get_number_points() const { return number_points; };
+  U32 get_number_chunks() const { return number_chunks; };
+  E57lazmerger();
+  ~E57lazmerger();
+private:
+  struct E57lazvlr
+  {
+    U8 header[54];
+    std::vector<U8> data;
+  };
+  struct E57lazinput
+  {
+    std::string file_name;
+    std::vector<U8> header;
+    std::vector<E57lazvlr> vlrs;
+    std::vector<E57scanChunks> scan_index;
+    U32 offset_to_point_data;
+    U32 chunk_size;
+    I64 number_points;
+    U64 number_of_points_by_return[15];
+    F64 bounds[6];
+    // the chunks are copied from 'chunk_start' on
+    I64 chunk_start;
+    std::vector<U32> chunk_sizes;
+    std::vector<U32> chunk_bytes;
+  };
+  bool read(E57lazinput& input);
+  std::vector<E57lazinput> inputs;
+  I64 number_points;
+  U32 number_chunks;
+};
+
+#endif
@@ -0,0 +1,572 @@
+// e57packets.cpp : decodes any range of the points of a scan straight from its data packets.
+
+#include "e57packets.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <type_traits>
+
+#include <xercesc/dom/DOM.hpp>
+#include <xercesc/framework/MemBufInputSource.hpp>
+#include <xercesc/parsers/XercesDOMParser.hpp>
+#include <xercesc/util/XMLString.hpp>
+
+#undef min
+#undef max
+
+#define E57_FILE_HEADER_SIZE 48
+#define E57_SECTION_HEADER_SIZE 32
+#define E57_DATA_PACKET 1
+#define E57_EMPTY_PACKET 2
+
+static bool e57_seek(FILE* file, I64 position)
+{
+#ifdef _WIN32
+  return (_fseeki64(file, position, SEEK_SET) == 0);
+#else
+  return (fseeko(file, (off_t)position, SEEK_SET) == 0);
+#endif
+}
+
+// CRC-32C (Castagnoli) as used for the pages of an E57 file
+
+static U32 e57_crc32c(const U8* bytes, I64 count)
+{
+  static const std::vector<U32> table = []
+  {
+    std::vector<U32> table(256);
+    for (U32 n = 0; n < 256; n++)
+    {
+      U32 c = n;
+      for (int k = 0; k < 8; k++) c = ((c & 1) ? ((c >> 1) ^ 0x82F63B78) : (c >> 1));
+      table[n] = c;
+    }
+    return table;
+  }();
+  U32 crc = 0xFFFFFFFF;
+  for (I64 i = 0; i < count; i++) crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+// 'bits' bits of a bytestream from bit 'bit' on. the values are packed with
+// their least significant bit first and the buffer is padded by 16 bytes
+
+static inline U64 e57_bits(const U8* bytes, U64 bit, U32 bits)
+{
+  U64 word;
+  memcpy(&word, bytes + (bit >> 3), 8);
+  U32 shift = (U32)(bit & 7);
+  U64 value = word >> shift;
+  if (shift + bits > 64) value |= ((U64)bytes[(bit >> 3) + 8]) << (64 - shift);
+  return (bits == 64 ? value : (value & ((((U64)1) << bits) - 1)));
+}
+
+// converts the values like libE57 does for a SourceDestBuffer. ScaledIntegers
+// become the raw integers in integer buffers and are scaled in floating point ones
+
+template<typename T>
+static void e57_unpack(int type, U32 bits, I64 minimum, F64 scale, F64 offset, const U8* bytes, U64 bit, U32 count, T* values)
+{
+  if (type == e57::E57_FLOAT)
+  {
+    if (bits == 32)
+    {
+      for (U32 i = 0; i < count; i++, bit += 32)
+      {
+        U32 raw = (U32)e57_bits(bytes, bit, 32);
+        float value;
+        memcpy(&value, &raw, 4);
+        values[i] = (T)value;
+      }
+    }
+    else
+    {
+      for (U32 i = 0; i < count; i++, bit += 64)
+      {
+        U64 raw = e57_bits(bytes, bit, 64);
+        double value;
+        memcpy(&value, &raw, 8);
+        values[i] = (T)value;
+      }
+    }
+  }
+  else if ((type == e57::E57_SCALED_INTEGER) && std::is_floating_point<T>::value)
+  {
+    for (U32 i = 0; i < count; i++, bit += bits)
+    {
+      values[i] = (T)(((I64)e57_bits(bytes, bit, bits) + minimum) * scale + offset);
+    }
+  }
+  else
+  {
+    for (U32 i = 0; i < count; i++, bit += bits)
+    {
+      values[i] = (T)((I64)e57_bits(bytes, bit, bits) + minimum);
+    }
+  }
+}
+
+// the number of bits the bitpack codec uses for the integers [minimum, maximum]
+
+static U32 e57_bits_needed(I64 minimum, I64 maximum)
+{
+  U64 range = (U64)maximum - (U64)minimum;
+  U32 bits = 0;
+  while (range)
+  {
+    bits++;
+    range >>= 1;
+  }
+  return bits;
+}
+
+// whether a field decodes into a buffer of this type without libE57 having
+// to throw because a value does not fit
+
+static bool e57_decodes(int type, I64 minimum, I64 maximum, U32 column_type)
+{
+  if (type == e57::E57_STRING) return false;
+  if ((column_type == E57_COLUMN_FLOAT) || (column_type == E57_COLUMN_DOUBLE)) return true;
+  if (type == e57::E57_FLOAT) return false;
+  switch (column_type)
+  {
+  case E57_COLUMN_INT8:
+    return (minimum >= -128) && (maximum <= 127);
+  case E57_COLUMN_UINT16:
+    return (minimum >= 0) && (maximum <= 65535);
+  case E57_COLUMN_INT32:
+    return (minimum >= I32_MIN) && (maximum <= I32_MAX);
+  }
+  return false;
+}
+
+static std::string e57_string(const XMLCh* text)
+{
+  if (text == 0) return std::string();
+  char* chars = xercesc::XMLString::transcode(text);
+  std::string string = (chars ? chars : "");
+  xercesc::XMLString::release(&chars);
+  return string;
+}
+
+// the 'number'-th child element of 'parent' named 'name' (or with any name).
+// comments and text between the elements are skipped
+
+static xercesc::DOMElement* e57_child(const xercesc::DOMElement* parent, const char* name, int number = 0)
+{
+  if (parent == 0) return 0;
+  for (xercesc::DOMNode* node = parent->getFirstChild(); node; node = node->getNextSibling())
+  {
+    if (node->getNodeType() != xercesc::DOMNode::ELEMENT_NODE) continue;
+    if (name && (e57_string(node->getNodeName()) != name)) continue;
+    if (number-- == 0) return (xercesc::DOMElement*)node;
+  }
+  return 0;
+}
+
+static std::string e57_attribute(const xercesc::DOMElement* element, const char* name)
+{
+  XMLCh* attribute = xercesc::XMLString::transcode(name);
+  std::string value = e57_string(element->getAttribute(attribute));
+  xercesc::XMLString::release(&attribute);
+  return value;
+}
+
+static bool e57_attribute(const xercesc::DOMElement* element, const char* name, I64& value)
+{
+  std::string text = e57_attribute(element, name);
+  char* end = 0;
+  value = strtoll(text.c_str(), &end, 10);
+  return (text.size() != 0) && (end != text.c_str()) && (*end == '\0');
+}
+
+bool E57pages::open(const char* file_name)
+{
+  close();
+  file = LASfopen(file_name, "rb");
+  if (file == 0) return false;
+  U8 header[E57_FILE_HEADER_SIZE];
+  if ((fread(header, 1, E57_FILE_HEADER_SIZE, file) != E57_FILE_HEADER_SIZE) || (memcmp(header, "ASTM-E57", 8) != 0))
+  {
+    close();
+    return false;
+  }
+  memcpy(&file_size, header + 16, 8);
+  memcpy(&xml_offset, header + 24, 8);
+  memcpy(&xml_length, header + 32, 8);
+  memcpy(&page_size, header + 40, 8);
+  if ((page_size <= 4) || (page_size > 1048576) || (xml_length < 0))
+  {
+    close();
+    return false;
+  }
+  xml_offset = logical(xml_offset);
+  return true;
+}
+
+bool E57pages::read(I64 offset, I64 count, U8* bytes)
+{
+  if (count <= 0) return true;
+  I64 payload = page_size - 4;
+  I64 first = offset / payload;
+  I64 last = (offset + count - 1) / payload;
+  size_t number = (size_t)(last - first + 1);
+  if ((offset < 0) || ((last + 1) * page_size > file_size)) return false;
+  pages.resize(number * (size_t)page_size);
+  if (!e57_seek(file, first * page_size) || (fread(pages.data(), (size_t)page_size, number, file) != number)) return false;
+  for (size_t p = 0; p < number; p++)
+  {
+    const U8* page = pages.data() + p * page_size;
+    // libE57 stores the checksum big-endian. some writers store it little-endian
+    U32 crc = e57_crc32c(page, payload);
+    const U8* stored = page + payload;
+    U32 big = ((U32)stored[0] << 24) | ((U32)stored[1] << 16) | ((U32)stored[2] << 8) | (U32)stored[3];
+    U32 little = ((U32)stored[3] << 24) | ((U32)stored[2] << 16) | ((U32)stored[1] << 8) | (U32)stored[0];
+    if ((crc != big) && (crc != little)) return false;
+    I64 begin = (p == 0 ? offset - first * payload : 0);
+    I64 end = (p == number - 1 ? offset + count - last * payload : payload);
+    memcpy(bytes, page + begin, (size_t)(end - begin));
+    bytes += end - begin;
+  }
+  return true;
+}
+
+void E57pages::close()
+{
+  if (file) fclose(file);
+  file = 0;
+  pages.clear();
+}
+
+E57pages::E57pages()
+{
+  file = 0;
+  page_size = 1024;
+  file_size = 0;
+  xml_offset = 0;
+  xml_length = 0;
+}
+
+E57pages::~E57pages()
+{
+  close();
+}
+
+bool E57packetindex::open(const char* file_name, e57::ImageFile& imf, int index, const std::vector<E57cachecolumn>& columns)
+{
+  close();
+
+  // the bytestreams are the fields of the prototype in their order
+
+  e57::VectorNode data3D(imf.root().get("/data3D"));
+  e57::StructureNode scan(data3D.get(index));
+  e57::CompressedVectorNode points(scan.get("points"));
+  if (points.codecs().childCount() != 0) return false;
+  e57::StructureNode proto(points.prototype());
+  number_records = points.childCount();
+
+  size_t found = 0;
+  std::vector<std::string> names;
+  for (I64 i = 0; i < proto.childCount(); i++)
+  {
+    e57::Node node = proto.get(i);
+    names.push_back(node.elementName());
+    E57stream stream;
+    stream.type = node.type();
+    stream.bits = 0;
+    stream.minimum = 0;
+    stream.scale = 1.0;
+    stream.offset = 0.0;
+    stream.column = -1;
+    stream.column_type = 0;
+    I64 maximum = 0;
+    if (stream.type == e57::E57_INTEGER)
+    {
+      e57::IntegerNode integer(node);
+      stream.minimum = integer.minimum();
+      maximum = integer.maximum();
+      stream.bits = e57_bits_needed(stream.minimum, maximum);
+    }
+    else if (stream.type == e57::E57_SCALED_INTEGER)
+    {
+      e57::ScaledIntegerNode scaled(node);
+      stream.minimum = scaled.minimum();
+      maximum = scaled.maximum();
+      stream.scale = scaled.scale();
+      stream.offset = scaled.offset();
+      stream.bits = e57_bits_needed(stream.minimum, maximum);
+    }
+    else if (stream.type == e57::E57_FLOAT)
+    {
+      stream.bits = (e57::FloatNode(node).precision() == e57::E57_SINGLE ? 32 : 64);
+    }
+    else if (stream.type != e57::E57_STRING)
+    {
+      // the bytestreams of nested fields are not counted here
+      return false;
+    }
+    for (size_t c = 0; c < columns.size(); c++)
+    {
+      if (node.elementName() != columns[c].name) continue;
+      if (!e57_decodes(stream.type, stream.minimum, maximum, columns[c].type)) return false;
+      stream.column = (int)c;
+      stream.column_type = columns[c].type;
+      found++;
+    }
+    streams.push_back(stream);
+  }
+  if (found != columns.size()) return false;
+
+  // the binary section of the points is found in the XML section
+
+  E57pages pages;
+  if (!pages.open(file_name)) return false;
+  I64 section_offset;
+  I64 record_count;
+  if (!find_section(pages, index, names, section_offset, record_count) || (record_count != number_records)) return false;
+  if (!walk(pages, pages.logical(section_offset)) || packet_offsets.empty()) return false;
+
+  // every bytestream holds all records and not more. the bitpack codec pads
+  // the end of a bytestream to a whole word at most
+
+  I64 number_packets = (I64)packet_offsets.size();
+  for (size_t s = 0; s < streams.size(); s++)
+  {
+    if (streams[s].type == e57::E57_STRING) continue;
+    I64 needed = (number_records * streams[s].bits + 7) / 8;
+    I64 total = get_start(number_packets, (int)s);
+    if ((total < needed) || (total > needed + 8)) return false;
+  }
+  this->file_name = file_name;
+  return true;
+}
+
+// the binary section of the 'points' of scan 'index' that the XML section
+// names. the XML is parsed with Xerces, which libE57 keeps initialized as
+// long as the ImageFile is open. the fields of the prototype there must be
+// the ones that libE57 reported
+
+bool E57packetindex::find_section(E57pages& pages, int index, const std::vector<std::string>& names, I64& section_offset, I64& record_count)
+{
+  std::vector<U8> xml((size_t)pages.xml_length);
+  if (!pages.read(pages.xml_offset, pages.xml_length, xml.data())) return false;
+  xercesc::MemBufInputSource source(xml.data(), (XMLSize_t)xml.size(), "E57 XML section");
+  xercesc::XercesDOMParser parser;
+  parser.setValidationScheme(xercesc::XercesDOMParser::Val_Never);
+  parser.setDoNamespaces(false);
+  parser.setLoadExternalDTD(false);
+  try
+  {
+    parser.parse(source);
+  }
+  catch (...)
+  {
+    return false;
+  }
+  xercesc::DOMDocument* document = parser.getDocument();
+  if ((parser.getErrorCount() != 0) || (document == 0)) return false;
+
+  xercesc::DOMElement* data3D = e57_child(document->getDocumentElement(), "data3D");
+  xercesc::DOMElement* scan = e57_child(data3D, 0, index);
+  xercesc::DOMElement* points = e57_child(scan, "points");
+  if ((points == 0) || (e57_attribute(points, "type") != "CompressedVector")) return false;
+  xercesc::DOMElement* prototype = e57_child(points, "prototype");
+  if ((prototype == 0) || e57_child(prototype, 0, (int)names.size())) return false;
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    xercesc::DOMElement* field = e57_child(prototype, 0, (int)i);
+    if ((field == 0) || (e57_string(field->getNodeName()) != names[i])) return false;
+  }
+  return e57_attribute(points, "fileOffset", section_offset) && e57_attribute(points, "recordCount", record_count);
+}
+
+// the section header is followed by the packets. data packets are
+//
+// type (1) | flags | length - 1 | number of bytestreams | length of each buffer | buffers
+//
+// with all numbers little-endian. index and empty packets are skipped
+
+bool E57packetindex::walk(E57pages& pages, I64 section_offset)
+{
+  U8 header[E57_SECTION_HEADER_SIZE];
+  if (!pages.read(section_offset, E57_SECTION_HEADER_SIZE, header) || (header[0] != 1)) return false;
+  I64 section_length;
+  I64 data_offset;
+  memcpy(&section_length, header + 8, 8);
+  memcpy(&data_offset, header + 16, 8);
+  I64 end = section_offset + section_length;
+  I64 offset = pages.logical(data_offset);
+
+  size_t number_streams = streams.size();
+  std::vector<U8> packet(6 + 2 * number_streams);
+  std::vector<I64> sums(number_streams, 0);
+  starts.assign(sums.begin(), sums.end());
+  while (offset < end)
+  {
+    if (!pages.read(offset, 4, packet.data())) return false;
+    U32 length = ((U32)packet[2] | ((U32)packet[3] << 8)) + 1;
+    if (packet[0] == E57_DATA_PACKET)
+    {
+      if (!pages.read(offset, (I64)packet.size(), packet.data())) return false;
+      if (((size_t)packet[4] | ((size_t)packet[5] << 8)) != number_streams) return false;
+      U32 used = (U32)packet.size();
+      for (size_t s = 0; s < number_streams; s++)
+      {
+        U32 bytes = (U32)packet[6 + 2 * s] | ((U32)packet[7 + 2 * s] << 8);
+        sums[s] += bytes;
+        used += bytes;
+      }
+      if (used > length) return false;
+      packet_offsets.push_back(offset);
+      packet_lengths.push_back(length);
+      starts.insert(starts.end(), sums.begin(), sums.end());
+    }
+    else if (packet[0] > E57_EMPTY_PACKET)
+    {
+      return false;
+    }
+    offset += length;
+  }
+  return true;
+}
+
+I64 E57packetindex::find_packet(int stream, I64 position) const
+{
+  I64 low = 0;
+  I64 high = (I64)packet_offsets.size() - 1;
+  while (low < high)
+  {
+    I64 middle = (low + high + 1) / 2;
+    if (get_start(middle, stream) <= position)
+      low = middle;
+    else
+      high = middle - 1;
+  }
+  return low;
+}
+
+void E57packetindex::close()
+{
+  file_name.clear();
+  number_records = 0;
+  streams.clear();
+  packet_offsets.clear();
+  packet_lengths.clear();
+  starts.clear();
+}
+
+E57packetindex::E57packetindex()
+{
+  number_records = 0;
+}
+
+bool E57packetdecoder::open(const E57packetindex* index)
+{
+  this->index = index;
+  bytes.resize(index->streams.size());
+  positions.assign(index->streams.size(), 0);
+  if (!pages.open(index->file_name.c_str()))
+  {
+    error = "cannot open '" + index->file_name + "'";
+    return false;
+  }
+  return true;
+}
+
+bool E57packetdecoder::load(I64 first, I64 count)
+{
+  // the packets that hold the bytes of all decoded bytestreams. the packets
+  // at both ends are shared with the neighbouring ranges
+
+  I64 first_packet = (I64)index->packet_offsets.size();
+  I64 last_packet = -1;
+  for (size_t s = 0; s < index->streams.size(); s++)
+  {
+    const E57packetindex::E57stream& stream = index->streams[s];
+    if ((stream.column < 0) || (stream.bits == 0)) continue;
+    I64 begin = (first * stream.bits) / 8;
+    I64 end = ((first + count) * stream.bits + 7) / 8;
+    first_packet = std::min(first_packet, index->find_packet((int)s, begin));
+    last_packet = std::max(last_packet, index->find_packet((int)s, end - 1));
+  }
+  if (last_packet < 0) return true;
+
+  I64 base = index->packet_offsets[first_packet];
+  I64 length = index->packet_offsets[last_packet] + index->packet_lengths[last_packet] - base;
+  packets.resize((size_t)length);
+  if (!pages.read(base, length, packets.data()))
+  {
+    error = "cannot read the data packets of '" + index->file_name + "' (checksum error)";
+    return false;
+  }
+
+  // the bytes of each bytestream are copied together from the packets
+
+  I64 header = 6 + 2 * (I64)index->streams.size();
+  for (size_t s = 0; s < index->streams.size(); s++)
+  {
+    const E57packetindex::E57stream& stream = index->streams[s];
+    if ((stream.column < 0) || (stream.bits == 0)) continue;
+    I64 begin = (first * stream.bits) / 8;
+    I64 end = ((first + count) * stream.bits + 7) / 8;
+    bytes[s].assign((size_t)(end - begin + 16), 0);
+    positions[s] = begin;
+    I64 last = index->find_packet((int)s, end - 1);
+    for (I64 p = index->find_packet((int)s, begin); p <= last; p++)
+    {
+      I64 buffer = index->packet_offsets[p] - base + header;
+      for (size_t t = 0; t < s; t++) buffer += index->get_start(p + 1, (int)t) - index->get_start(p, (int)t);
+      I64 start = index->get_start(p, (int)s);
+      I64 from = std::max(begin, start);
+      I64 to = std::min(end, index->get_start(p + 1, (int)s));
+      if (to > from) memcpy(bytes[s].data() + (from - begin), packets.data() + buffer + (from - start), (size_t)(to - from));
+    }
+  }
+  return true;
+}
+
+void E57packetdecoder::decode(I64 first, U32 count, const std::vector<void*>& values) const
+{
+  static const U8 zeros[16] = { 0 };
+  for (size_t s = 0; s < index->streams.size(); s++)
+  {
+    const E57packetindex::E57stream& stream = index->streams[s];
+    if (stream.column < 0) continue;
+    // constant fields have no bytes
+    const U8* data = (stream.bits ? bytes[s].data() : zeros);
+    U64 bit = (stream.bits ? (U64)(first * stream.bits - positions[s] * 8) : 0);
+    void* buffer = values[stream.column];
+    switch (stream.column_type)
+    {
+    case E57_COLUMN_INT8:
+      e57_unpack(stream.type, stream.bits, stream.minimum, stream.scale, stream.offset, data, bit, count, (int8_t*)buffer);
+      break;
+    case E57_COLUMN_INT32:
+      e57_unpack(stream.type, stream.bits, stream.minimum, stream.scale, stream.offset, data, bit, count, (I32*)buffer);
+      break;
+    case E57_COLUMN_UINT16:
+      e57_unpack(stream.type, stream.bits, stream.minimum, stream.scale, stream.offset, data, bit, count, (U16*)buffer);
+      break;
+    case E57_COLUMN_FLOAT:
+      e57_unpack(stream.type, stream.bits, stream.minimum, stream.scale, stream.offset, data, bit, count, (float*)buffer);
+      break;
+    case E57_COLUMN_DOUBLE:
+      e57_unpack(stream.type, stream.bits, stream.minimum, stream.scale, stream.offset, data, bit, count, (double*)buffer);
+      break;
+    }
+  }
+}
+
+void E57packetdecoder::close()
+{
+  pages.close();
+  packets.clear();
+  bytes.clear();
+  positions.clear();
+}
+
+E57packetdecoder::E57packetdecoder()
+{
+  index = NULL;
+}
@@ -0,0 +1,109 @@
+// e57packets.hpp : decodes any range of the points of a scan straight from its data packets.
+
+#ifndef E57_PACKETS_HPP
+#define E57_PACKETS_HPP
+
+#include <E57Foundation.h>
+
+#include "e57scancache.hpp"
+
+#include <string>
+#include <vector>
+
+// the points of a scan are a compressed vector whose binary section is a
+// sequence of data packets. each packet carries the next bytes of every
+// bytestream (one per field of the prototype) and the bitpacked values of
+// a field run on from one packet into the next. libE57 can only decode the
+// section from its start. the index walks the headers of the packets once
+// and sums up where the bytes of each bytestream are. the decoders then read
+// just the packets that hold a range of records, so that several of them
+// decode disjoint ranges of the same scan, each with its own file handle and
+// each checking only the pages it reads. only Integer, ScaledInteger and
+// Float fields with the default bitpack codec are decoded this way. all
+// other scans are left to libE57
+
+// the pages of the E57 file without their checksums
+
+class E57pages
+{
+public:
+  bool open(const char* file_name);
+  // reads 'count' bytes from a logical offset and checks the CRC of every page
+  bool read(I64 offset, I64 count, U8* bytes);
+  I64 logical(I64 physical) const { return (physical / page_size) * (page_size - 4) + (physical % page_size); };
+  void close();
+  I64 xml_offset;
+  I64 xml_length;
+  E57pages();
+  ~E57pages();
+private:
+  FILE* file;
+  I64 page_size;
+  I64 file_size;
+  std::vector<U8> pages;
+};
+
+class E57packetindex
+{
+public:
+  // indexes the data packets of the points of scan 'index' for the fields of
+  // 'columns' (typed like the columns of the cache). returns false if these
+  // fields cannot be decoded from the packets
+  bool open(const char* file_name, e57::ImageFile& imf, int index, const std::vector<E57cachecolumn>& columns);
+  I64 get_number_records() const { return number_records; };
+  I64 get_number_packets() const { return (I64)packet_offsets.size(); };
+  void close();
+  E57packetindex();
+private:
+  friend class E57packetdecoder;
+  struct E57stream
+  {
+    // E57_INTEGER, E57_SCALED_INTEGER, or E57_FLOAT
+    int type;
+    U32 bits;
+    I64 minimum;
+    F64 scale;
+    F64 offset;
+    // the column it is decoded into or -1
+    int column;
+    U32 column_type;
+  };
+  bool find_section(E57pages& pages, int index, const std::vector<std::string>& names, I64& section_offset, I64& record_count);
+  bool walk(E57pages& pages, I64 section_offset);
+  I64 get_start(I64 packet, int stream) const { return starts[packet * streams.size() + stream]; };
+  // the packet that holds byte 'position' of a bytestream
+  I64 find_packet(int stream, I64 position) const;
+  std::string file_name;
+  I64 number_records;
+  std::vector<E57stream> streams;
+  // logical offset and length of each data packet
+  std::vector<I64> packet_offsets;
+  std::vector<U32> packet_lengths;
+  // the bytes of each bytestream before each packet (one more row for the end)
+  std::vector<I64> starts;
+};
+
+// one per thread
+
+class E57packetdecoder
+{
+public:
+  bool open(const E57packetindex* index);
+  // reads the packets that hold the records [first, first + count)
+  bool load(I64 first, I64 count);
+  // decodes 'count' of the loaded records into one buffer per column
+  void decode(I64 first, U32 count, const std::vector<void*>& values) const;
+  void close();
+  const char* get_error() const { return error.c_str(); };
+  E57packetdecoder();
+private:
+  const E57packetindex* index;
+  E57pages pages;
+  std::vector<U8> packets;
+  // the loaded bytes of each bytestream and the position of the first one
+  std::vector<std::vector<U8> > bytes;
+  std::vector<I64> positions;
+  std::string error;
+};
+
+#endif
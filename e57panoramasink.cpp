@@ -0,0 +1,508 @@
+// e57panoramasink.cpp : writes range, intensity, and color images of structured scans.
+
+#include "e57panoramasink.hpp"
+
+#include <cmath>
+#include <cfloat>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+
+#define E57_PANORAMA_TILE 256
+#define E57_PANORAMA_BAND 4194304
+
+// the images are written without compression so that no zlib is needed. a
+// TIFF is cut into tiles and a PNG into bands of rows that are filled by one
+// thread per core. the PNG rows go into stored deflate blocks
+
+static U32 e57_crc32(U32 crc, const U8* data, size_t size)
+{
+  static const std::vector<U32> table = []
+  {
+    std::vector<U32> t(256);
+    for (U32 n = 0; n < 256; n++)
+    {
+      U32 c = n;
+      for (int k = 0; k < 8; k++) c = (c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1);
+      t[n] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+static U32 e57_adler32(U32 adler, const U8* data, size_t size)
+{
+  U32 a = adler & 0xFFFF;
+  U32 b = adler >> 16;
+  while (size > 0)
+  {
+    // 5552 is the most bytes before 'b' can overflow
+    size_t number = std::min(size, (size_t)5552);
+    for (size_t i = 0; i < number; i++)
+    {
+      a += data[i];
+      b += a;
+    }
+    a %= 65521;
+    b %= 65521;
+    data += number;
+    size -= number;
+  }
+  return (b << 16) | a;
+}
+
+static void e57_put16(std::vector<U8>& bytes, U16 value)
+{
+  bytes.push_back((U8)(value & 0xFF));
+  bytes.push_back((U8)(value >> 8));
+}
+
+static void e57_put32(std::vector<U8>& bytes, U32 value)
+{
+  e57_put16(bytes, (U16)(value & 0xFFFF));
+  e57_put16(bytes, (U16)(value >> 16));
+}
+
+static void e57_put32BE(std::vector<U8>& bytes, U32 value)
+{
+  bytes.push_back((U8)(value >> 24));
+  bytes.push_back((U8)(value >> 16));
+  bytes.push_back((U8)(value >> 8));
+  bytes.push_back((U8)(value & 0xFF));
+}
+
+static bool e57_png_chunk(FILE* file, const char* type, const std::vector<U8>& data)
+{
+  std::vector<U8> bytes;
+  bytes.reserve(data.size() + 12);
+  e57_put32BE(bytes, (U32)data.size());
+  bytes.insert(bytes.end(), type, type + 4);
+  bytes.insert(bytes.end(), data.begin(), data.end());
+  e57_put32BE(bytes, e57_crc32(0, bytes.data() + 4, data.size() + 4));
+  return (fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size());
+}
+
+// runs 'work(t)' for t in [0..number-1] on up to 'cores' threads
+
+static void e57_parallel(int cores, U32 number, const std::function<void(U32)>& work)
+{
+  U32 number_threads = (U32)std::max(1, std::min(cores, (int)number));
+  if (number_threads == 1)
+  {
+    for (U32 t = 0; t < number; t++) work(t);
+    return;
+  }
+  std::vector<std::thread> threads;
+  for (U32 k = 0; k < number_threads; k++)
+  {
+    threads.push_back(std::thread([&work, k, number, number_threads]
+    {
+      for (U32 t = k; t < number; t += number_threads) work(t);
+    }));
+  }
+  for (U32 k = 0; k < number_threads; k++) threads[k].join();
+}
+
+void E57panoramasink::needs(bool& intensity, bool& color, bool& returns, bool& time) const
+{
+  intensity = true;
+  color = true;
+}
+
+bool E57panoramasink::begin_scan(const E57scan& scan)
+{
+  clean();
+
+  if (!scan.grid)
+  {
+    LASMessage(LAS_WARNING, "scan %d has no row and column indices. no panorama for it ...", scan.index);
+    return true;
+  }
+
+  // the index bounds are optional. without them the grid starts at 0 and
+  // ends with the largest index that the fields can hold
+
+  const e57::Data3D& scanHeader = *scan.header;
+  I64 row_max;
+  I64 column_max;
+  if ((scanHeader.indexBounds.rowMaximum > scanHeader.indexBounds.rowMinimum) && (scanHeader.indexBounds.columnMaximum > scanHeader.indexBounds.columnMinimum))
+  {
+    row_min = scanHeader.indexBounds.rowMinimum;
+    row_max = scanHeader.indexBounds.rowMaximum;
+    column_min = scanHeader.indexBounds.columnMinimum;
+    column_max = scanHeader.indexBounds.columnMaximum;
+  }
+  else
+  {
+    row_min = 0;
+    row_max = scanHeader.pointFields.rowIndexMaximum;
+    column_min = 0;
+    column_max = scanHeader.pointFields.columnIndexMaximum;
+  }
+  if ((row_max < row_min) || (column_max < column_min) || ((row_max - row_min) >= U16_MAX * 16) || ((column_max - column_min) >= U16_MAX * 16))
+  {
+    LASMessage(LAS_WARNING, "scan %d has a grid of unusable size. no panorama for it ...", scan.index);
+    return true;
+  }
+  height = (U32)(row_max - row_min + 1);
+  width = (U32)(column_max - column_min + 1);
+
+  size_t size = (size_t)width * (size_t)height;
+  range.assign(size, 0.0f);
+  if (scan.intensity) intensity.assign(size, 0);
+  if (scan.color) rgb.assign(3 * size, 0);
+
+  // the images are named after the E57 file and the scan
+
+  file_name_base = scan.file_name;
+  size_t dot = file_name_base.find_last_of('.');
+  size_t slash = file_name_base.find_last_of("/\\");
+  if ((dot != std::string::npos) && ((slash == std::string::npos) || (dot > slash))) file_name_base.resize(dot);
+
+  index = scan.index;
+  cores = scan.cores;
+  quantizer = scan.quantizer;
+  origin[0] = scan.origin[0];
+  origin[1] = scan.origin[1];
+  origin[2] = scan.origin[2];
+  outside = 0;
+  active = true;
+  LASMessage(LAS_VERBOSE, "  panorama of scan %d has %u rows and %u columns", scan.index, height, width);
+  return true;
+}
+
+void E57panoramasink::write(const E57batch* batch)
+{
+  if (!active) return;
+
+  // the nearest point wins where several (returns) fall into the same cell
+
+  for (unsigned int j = 0; j < batch->count; j++)
+  {
+    I64 row = batch->row[j] - row_min;
+    I64 column = batch->column[j] - column_min;
+    if ((row < 0) || (row >= height) || (column < 0) || (column >= width))
+    {
+      outside++;
+      continue;
+    }
+    double dx = quantizer.get_x(batch->X[j]) - origin[0];
+    double dy = quantizer.get_y(batch->Y[j]) - origin[1];
+    double dz = quantizer.get_z(batch->Z[j]) - origin[2];
+    F32 distance = (F32)sqrt(dx * dx + dy * dy + dz * dz);
+    size_t cell = (size_t)row * width + (size_t)column;
+    if ((range[cell] != 0.0f) && (range[cell] <= distance)) continue;
+    range[cell] = std::max(distance, FLT_MIN);
+    if (batch->intensity && !intensity.empty())
+    {
+      intensity[cell] = batch->intensity[j];
+    }
+    if (batch->red && !rgb.empty())
+    {
+      rgb[3 * cell] = batch->red[j];
+      rgb[3 * cell + 1] = batch->green[j];
+      rgb[3 * cell + 2] = batch->blue[j];
+    }
+  }
+}
+
+bool E57panoramasink::end_scan(const E57scan& scan)
+{
+  if (!active) return true;
+
+  if (outside)
+  {
+    LASMessage(LAS_WARNING, "%lld points of scan %d are outside of the index bounds. not in the panorama ...", outside, index);
+  }
+
+  // the finest unit with which the farthest point still fits into 16 bits
+
+  F32 range_max = 0.0f;
+  for (size_t cell = 0; cell < range.size(); cell++) range_max = std::max(range_max, range[cell]);
+  double unit = 0.001;
+  while ((range_max / unit > U16_MAX) && (unit < 1.0)) unit *= 10;
+
+  char description[256];
+  snprintf(description, 256, "range in units of %g m from the scanner at %.3f %.3f %.3f", unit, origin[0], origin[1], origin[2]);
+  bool success = write_image("range", 1, description, [this, unit](U32 row, U32 column, U32 number, U16* samples)
+  {
+    const F32* cells = range.data() + (size_t)row * width + column;
+    for (U32 i = 0; i < number; i++)
+    {
+      double value = cells[i] / unit + 0.5;
+      samples[i] = (cells[i] == 0.0f ? 0 : (U16)std::max(1.0, std::min(value, (double)U16_MAX)));
+    }
+  });
+
+  if (success && !intensity.empty())
+  {
+    success = write_image("intensity", 1, "intensity", [this](U32 row, U32 column, U32 number, U16* samples)
+    {
+      memcpy(samples, intensity.data() + (size_t)row * width + column, number * sizeof(U16));
+    });
+  }
+
+  if (success && !rgb.empty())
+  {
+    success = write_image("rgb", 3, "RGB", [this](U32 row, U32 column, U32 number, U16* samples)
+    {
+      memcpy(samples, rgb.data() + 3 * ((size_t)row * width + column), 3 * number * sizeof(U16));
+    });
+  }
+
+  clean();
+  return success;
+}
+
+bool E57panoramasink::write_image(const char* suffix, U32 samples_per_pixel, const char* description, const E57pixels& pixels) const
+{
+  char number[32];
+  snprintf(number, 32, "_%05d_", index);
+  std::string file_name = file_name_base + number + suffix + (png ? ".png" : ".tif");
+
+  FILE* file = LASfopen(file_name.c_str(), "wb");
+  if (file == 0)
+  {
+    LASMessage(LAS_ERROR, "cannot open '%s' for write", file_name.c_str());
+    return false;
+  }
+  bool success = (png ? write_png(file, samples_per_pixel, description, pixels) : write_tif(file, samples_per_pixel, description, pixels));
+  if (fclose(file) != 0) success = false;
+  if (!success)
+  {
+    LASMessage(LAS_ERROR, "cannot write '%s'", file_name.c_str());
+    return false;
+  }
+  LASMessage(LAS_VERBOSE, "  %s written to '%s'", suffix, file_name.c_str());
+  return true;
+}
+
+// a little endian TIFF with one IFD in front of the tiles. the size of every
+// tile is the same so all offsets are known before the first tile is written
+
+bool E57panoramasink::write_tif(FILE* file, U32 samples_per_pixel, const char* description, const E57pixels& pixels) const
+{
+  U32 tiles_across = (width + E57_PANORAMA_TILE - 1) / E57_PANORAMA_TILE;
+  U32 tiles_down = (height + E57_PANORAMA_TILE - 1) / E57_PANORAMA_TILE;
+  U32 number_tiles = tiles_across * tiles_down;
+  U32 tile_bytes = E57_PANORAMA_TILE * E57_PANORAMA_TILE * samples_per_pixel * 2;
+
+  U32 number_entries = 12;
+  U32 description_bytes = (U32)strlen(description) + 1;
+  U32 offset = 8 + 2 + 12 * number_entries + 4;
+  U32 bits_offset = offset;
+  if (samples_per_pixel > 2) offset += 2 * samples_per_pixel;
+  U32 tile_offsets_offset = offset;
+  if (number_tiles > 1) offset += 4 * number_tiles;
+  U32 tile_bytes_offset = offset;
+  if (number_tiles > 1) offset += 4 * number_tiles;
+  U32 description_offset = offset;
+  if (description_bytes > 4) offset += description_bytes;
+  offset += (offset & 1);
+  if ((U64)offset + (U64)number_tiles * tile_bytes > U32_MAX)
+  {
+    LASMessage(LAS_ERROR, "panorama of %u by %u pixels is too large for a TIFF", width, height);
+    return false;
+  }
+
+  std::vector<U8> bytes;
+  bytes.push_back('I');
+  bytes.push_back('I');
+  e57_put16(bytes, 42);
+  e57_put32(bytes, 8);
+
+  // the entries of the IFD are sorted by tag. values of up to 4 bytes are
+  // stored in the entry and all others at an offset
+
+  auto entry = [&bytes](U16 tag, U16 type, U32 count, U32 value)
+  {
+    e57_put16(bytes, tag);
+    e57_put16(bytes, type);
+    e57_put32(bytes, count);
+    if ((type == 3) && (count == 1))
+    {
+      e57_put16(bytes, (U16)value);
+      e57_put16(bytes, 0);
+    }
+    else
+    {
+      e57_put32(bytes, value);
+    }
+  };
+  auto entry_values = [&bytes, &entry](U16 tag, U16 type, U32 count, const std::vector<U8>& values, U32 value_offset)
+  {
+    if (values.size() > 4)
+    {
+      entry(tag, type, count, value_offset);
+      return;
+    }
+    e57_put16(bytes, tag);
+    e57_put16(bytes, type);
+    e57_put32(bytes, count);
+    for (size_t i = 0; i < 4; i++) bytes.push_back(i < values.size() ? values[i] : 0);
+  };
+  std::vector<U8> bits_per_sample;
+  for (U32 s = 0; s < samples_per_pixel; s++) e57_put16(bits_per_sample, 16);
+  std::vector<U8> description_values(description, description + description_bytes);
+  e57_put16(bytes, (U16)number_entries);
+  entry(256, 4, 1, width);
+  entry(257, 4, 1, height);
+  entry_values(258, 3, samples_per_pixel, bits_per_sample, bits_offset);
+  entry(259, 3, 1, 1);
+  entry(262, 3, 1, (samples_per_pixel == 3 ? 2 : 1));
+  entry_values(270, 2, description_bytes, description_values, description_offset);
+  entry(277, 3, 1, samples_per_pixel);
+  entry(284, 3, 1, 1);
+  entry(322, 3, 1, E57_PANORAMA_TILE);
+  entry(323, 3, 1, E57_PANORAMA_TILE);
+  entry(324, 4, number_tiles, (number_tiles > 1 ? tile_offsets_offset : offset));
+  entry(325, 4, number_tiles, (number_tiles > 1 ? tile_bytes_offset : tile_bytes));
+  e57_put32(bytes, 0);
+
+  if (bits_per_sample.size() > 4)
+  {
+    bytes.insert(bytes.end(), bits_per_sample.begin(), bits_per_sample.end());
+  }
+  if (number_tiles > 1)
+  {
+    for (U32 t = 0; t < number_tiles; t++) e57_put32(bytes, offset + t * tile_bytes);
+    for (U32 t = 0; t < number_tiles; t++) e57_put32(bytes, tile_bytes);
+  }
+  if (description_values.size() > 4)
+  {
+    bytes.insert(bytes.end(), description_values.begin(), description_values.end());
+  }
+  if (bytes.size() & 1) bytes.push_back(0);
+  if (fwrite(bytes.data(), 1, bytes.size(), file) != bytes.size()) return false;
+
+  // the tiles of one row of tiles are filled in parallel and then written.
+  // the tiles on the right and bottom border are padded with zeros
+
+  std::vector<U16> tiles((size_t)tiles_across * tile_bytes / 2);
+  for (U32 tile_row = 0; tile_row < tiles_down; tile_row++)
+  {
+    e57_parallel(cores, tiles_across, [&](U32 tile_column)
+    {
+      U16* tile = tiles.data() + (size_t)tile_column * tile_bytes / 2;
+      memset(tile, 0, tile_bytes);
+      U32 column = tile_column * E57_PANORAMA_TILE;
+      U32 number = std::min((U32)E57_PANORAMA_TILE, width - column);
+      for (U32 y = 0; y < E57_PANORAMA_TILE; y++)
+      {
+        U32 row = tile_row * E57_PANORAMA_TILE + y;
+        if (row >= height) break;
+        pixels(row, column, number, tile + (size_t)y * E57_PANORAMA_TILE * samples_per_pixel);
+      }
+    });
+    if (fwrite(tiles.data(), 2, tiles.size(), file) != tiles.size()) return false;
+  }
+  return true;
+}
+
+// a 16 bit PNG (grayscale or RGB) whose rows are unfiltered and go into stored
+// deflate blocks. every band of rows is one IDAT chunk
+
+bool E57panoramasink::write_png(FILE* file, U32 samples_per_pixel, const char* description, const E57pixels& pixels) const
+{
+  static const U8 signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+  if (fwrite(signature, 1, 8, file) != 8) return false;
+
+  std::vector<U8> data;
+  e57_put32BE(data, width);
+  e57_put32BE(data, height);
+  data.push_back(16);
+  data.push_back(samples_per_pixel == 3 ? 2 : 0);
+  data.push_back(0);
+  data.push_back(0);
+  data.push_back(0);
+  if (!e57_png_chunk(file, "IHDR", data)) return false;
+
+  data.clear();
+  const char* keyword = "Description";
+  data.insert(data.end(), keyword, keyword + strlen(keyword) + 1);
+  data.insert(data.end(), description, description + strlen(description));
+  if (!e57_png_chunk(file, "tEXt", data)) return false;
+
+  size_t row_bytes = 1 + (size_t)width * samples_per_pixel * 2;
+  U32 band_rows = (U32)std::max((size_t)1, E57_PANORAMA_BAND / row_bytes);
+  std::vector<U8> band((size_t)std::min(band_rows, height) * row_bytes);
+  U32 adler = 1;
+
+  for (U32 first = 0; first < height; first += band_rows)
+  {
+    U32 number_rows = std::min(band_rows, height - first);
+
+    // each thread fills whole rows and stores the samples big endian
+
+    e57_parallel(cores, number_rows, [&](U32 r)
+    {
+      U8* row = band.data() + (size_t)r * row_bytes;
+      row[0] = 0;
+      std::vector<U16> samples((size_t)width * samples_per_pixel);
+      pixels(first + r, 0, width, samples.data());
+      for (size_t i = 0; i < samples.size(); i++)
+      {
+        U16 sample = samples[i];
+        row[1 + 2 * i] = (U8)(sample >> 8);
+        row[2 + 2 * i] = (U8)(sample & 0xFF);
+      }
+    });
+
+    size_t size = (size_t)number_rows * row_bytes;
+    adler = e57_adler32(adler, band.data(), size);
+    bool last = (first + number_rows == height);
+
+    data.clear();
+    if (first == 0)
+    {
+      data.push_back(0x78);
+      data.push_back(0x01);
+    }
+    for (size_t done = 0; done < size; done += 65535)
+    {
+      U16 length = (U16)std::min(size - done, (size_t)65535);
+      data.push_back((last && (done + length == size)) ? 1 : 0);
+      data.push_back((U8)(length & 0xFF));
+      data.push_back((U8)(length >> 8));
+      data.push_back((U8)(~length & 0xFF));
+      data.push_back((U8)((~length >> 8) & 0xFF));
+      data.insert(data.end(), band.data() + done, band.data() + done + length);
+    }
+    if (last)
+    {
+      e57_put32BE(data, adler);
+    }
+    if (!e57_png_chunk(file, "IDAT", data)) return false;
+  }
+
+  data.clear();
+  return e57_png_chunk(file, "IEND", data);
+}
+
+void E57panoramasink::clean()
+{
+  active = false;
+  width = height = 0;
+  row_min = column_min = 0;
+  outside = 0;
+  std::vector<F32>().swap(range);
+  std::vector<U16>().swap(intensity);
+  std::vector<U16>().swap(rgb);
+}
+
+E57panoramasink::E57panoramasink()
+{
+  png = false;
+  index = 0;
+  cores = 1;
+  origin[0] = origin[1] = origin[2] = 0.0;
+  clean();
+}
+
+E57panoramasink::~E57panoramasink()
+{
+  stop();
+}
@@ -0,0 +1,56 @@
+// e57panoramasink.hpp : writes range, intensity, and color images of structured scans.
+
+#ifndef E57_PANORAMA_SINK_HPP
+#define E57_PANORAMA_SINK_HPP
+
+#include "e57tolasconverter.hpp"
+
+#include <string>
+#include <vector>
+#include <functional>
+
+// the points of a structured scan have a row and a column index that place
+// them into the grid in which the scanner sampled them. this sink scatters
+// the points of each scan into that grid and writes a 16 bit range image, a
+// 16 bit intensity image (if the scan has intensities), and a 16 bit RGB
+// image (if the scan has colors) next to the E57 file. the range is measured
+// from the scanner position and stored in the unit given in the description
+// of the image. cells without a point are 0. scans without row and column
+// indices are skipped
+
+class E57panoramasink : public E57sink {
+public:
+  void needs(bool& intensity, bool& color, bool& returns, bool& time) const;
+  bool needs_grid() const { return true; };
+  bool begin_scan(const E57scan& scan);
+  void write(const E57batch* batch);
+  bool end_scan(const E57scan& scan);
+  E57panoramasink();
+  ~E57panoramasink();
+  // PNG instead of tiled TIFF
+  bool png;
+private:
+  // fills the samples of 'number' pixels of an image row starting at 'column'
+  typedef std::function<void(U32 row, U32 column, U32 number, U16* samples)> E57pixels;
+  bool write_image(const char* suffix, U32 samples_per_pixel, const char* description, const E57pixels& pixels) const;
+  bool write_tif(FILE* file, U32 samples_per_pixel, const char* description, const E57pixels& pixels) const;
+  bool write_png(FILE* file, U32 samples_per_pixel, const char* description, const E57pixels& pixels) const;
+  void clean();
+  bool active;
+  std::string file_name_base;
+  int index;
+  int cores;
+  I64 row_min;
+  I64 column_min;
+  U32 width;
+  U32 height;
+  // the range is computed from the quantized coordinates
+  LASquantizer quantizer;
+  F64 origin[3];
+  I64 outside;
+  std::vector<F32> range;
+  std::vector<U16> intensity;
+  std::vector<U16> rgb;
+};
+
+#endif
@@ -0,0 +1,470 @@
+// e57scancache.cpp : keeps the decoded fields of the scans in a memory-mapped sidecar file.
+
+#include "e57scancache.hpp"
+
+#include <cstring>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <cerrno>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#endif
+
+#define E57_CACHE_VERSION 1
+#define E57_CACHE_GUID_LENGTH 64
+#define E57_CACHE_ALIGNMENT 64
+#define E57_CACHE_HEADER_SIZE (8 + 4 + 4 + 8 + 8 + E57_CACHE_GUID_LENGTH)
+
+static bool e57_seek(FILE* file, I64 position)
+{
+#ifdef _WIN32
+  return (_fseeki64(file, position, SEEK_SET) == 0);
+#else
+  return (fseeko(file, (off_t)position, SEEK_SET) == 0);
+#endif
+}
+
+static I64 e57_tell(FILE* file)
+{
+#ifdef _WIN32
+  return _ftelli64(file);
+#else
+  return (I64)ftello(file);
+#endif
+}
+
+static I64 e57_align(I64 position)
+{
+  return (position + E57_CACHE_ALIGNMENT - 1) & ~((I64)E57_CACHE_ALIGNMENT - 1);
+}
+
+static bool e57_truncate(FILE* file)
+{
+  if (fflush(file) != 0) return false;
+#ifdef _WIN32
+  return (_chsize_s(_fileno(file), 0) == 0);
+#else
+  return (ftruncate(fileno(file), 0) == 0);
+#endif
+}
+
+// conversions of the same E57 file (like the pieces of '-merge_laz') share
+// its sidecar. whoever checks the header or appends a scan holds an advisory
+// lock on the whole sidecar. on Windows that is a byte far behind its end so
+// that the lock does not keep the others from reading the mapped scans
+
+bool E57scancache::lock()
+{
+  if (locked) return true;
+#ifdef _WIN32
+  OVERLAPPED overlapped;
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.OffsetHigh = 0x40000000;
+  locked = (LockFileEx((HANDLE)_get_osfhandle(_fileno(file)), LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &overlapped) != 0);
+#else
+  int result;
+  do
+  {
+    result = flock(fileno(file), LOCK_EX);
+  } while ((result != 0) && (errno == EINTR));
+  locked = (result == 0);
+#endif
+  if (!locked) LASMessage(LAS_WARNING, "cannot lock cache '%s'", cache_file_name.c_str());
+  return locked;
+}
+
+void E57scancache::unlock()
+{
+  if (!locked) return;
+  fflush(file);
+#ifdef _WIN32
+  OVERLAPPED overlapped;
+  memset(&overlapped, 0, sizeof(overlapped));
+  overlapped.OffsetHigh = 0x40000000;
+  UnlockFileEx((HANDLE)_get_osfhandle(_fileno(file)), 0, 1, 0, &overlapped);
+#else
+  flock(fileno(file), LOCK_UN);
+#endif
+  locked = false;
+}
+
+// the offsets of the scans as the other conversions left them
+
+bool E57scancache::read_offsets()
+{
+  U32 number = (U32)scan_offsets.size();
+  if (!e57_seek(file, E57_CACHE_HEADER_SIZE)) return false;
+  return (number == 0) || (fread(scan_offsets.data(), 8, number, file) == number);
+}
+
+U32 E57scancache::get_size(U32 type)
+{
+  switch (type)
+  {
+  case E57_COLUMN_INT8:
+    return 1;
+  case E57_COLUMN_UINT16:
+    return 2;
+  case E57_COLUMN_INT32:
+  case E57_COLUMN_FLOAT:
+    return 4;
+  case E57_COLUMN_DOUBLE:
+    return 8;
+  }
+  return 0;
+}
+
+bool E57scancache::open(const char* file_name, const char* directory, const char* guid, I32 number_scans)
+{
+  close();
+
+  // the sidecar belongs to this very version of the E57 file
+
+#ifdef _WIN32
+  struct _stat64 status;
+  if (_stat64(file_name, &status) != 0) return false;
+#else
+  struct stat status;
+  if (stat(file_name, &status) != 0) return false;
+#endif
+  modification_time = (I64)status.st_mtime;
+  file_size = (I64)status.st_size;
+  this->guid = (guid ? guid : "");
+  if (this->guid.size() >= E57_CACHE_GUID_LENGTH) this->guid.resize(E57_CACHE_GUID_LENGTH - 1);
+  scan_offsets.assign(number_scans, 0);
+
+  // "scans/campus.e57" is cached in "scans/campus.e57cache" or "directory/campus.e57cache"
+
+  std::string name = file_name;
+  size_t slash = name.find_last_of("/\\");
+  size_t dot = name.find_last_of('.');
+  if ((dot != std::string::npos) && ((slash == std::string::npos) || (dot > slash))) name.resize(dot);
+  if (directory && directory[0])
+  {
+    std::string base = (slash == std::string::npos ? name : name.substr(slash + 1));
+    name = directory;
+    if ((name.back() != '/') && (name.back() != '\\')) name += '/';
+    name += base;
+  }
+  cache_file_name = name + ".e57cache";
+
+  // another conversion may be creating the sidecar at the same time. so it
+  // is never truncated before it is locked
+
+  file = LASfopen(cache_file_name.c_str(), "r+b");
+  if (file == 0)
+  {
+    FILE* created = LASfopen(cache_file_name.c_str(), "ab");
+    if (created) fclose(created);
+    file = LASfopen(cache_file_name.c_str(), "r+b");
+  }
+  if (file == 0)
+  {
+    LASMessage(LAS_WARNING, "cannot create cache '%s'", cache_file_name.c_str());
+    return false;
+  }
+  if (!lock())
+  {
+    close();
+    return false;
+  }
+  char magic[8];
+  U32 version = 0;
+  U32 number = 0;
+  I64 time = 0;
+  I64 size = 0;
+  char id[E57_CACHE_GUID_LENGTH];
+  bool valid = (fread(magic, 8, 1, file) == 1) && (memcmp(magic, "E57CACHE", 8) == 0);
+  valid = valid && (fread(&version, 4, 1, file) == 1) && (version == E57_CACHE_VERSION);
+  valid = valid && (fread(&number, 4, 1, file) == 1) && (number == (U32)number_scans);
+  valid = valid && (fread(&time, 8, 1, file) == 1) && (time == modification_time);
+  valid = valid && (fread(&size, 8, 1, file) == 1) && (size == file_size);
+  valid = valid && (fread(id, E57_CACHE_GUID_LENGTH, 1, file) == 1) && (strncmp(id, this->guid.c_str(), E57_CACHE_GUID_LENGTH) == 0);
+  valid = valid && ((number == 0) || (fread(scan_offsets.data(), 8, number, file) == number));
+  if (valid)
+  {
+    I32 cached = 0;
+    for (I32 s = 0; s < number_scans; s++) cached += (scan_offsets[s] != 0);
+    LASMessage(LAS_VERBOSE, "%d of %d scans are cached in '%s'", cached, number_scans, cache_file_name.c_str());
+    unlock();
+    return true;
+  }
+  scan_offsets.assign(number_scans, 0);
+  if ((fseek(file, 0, SEEK_END) == 0) && (e57_tell(file) > 0)) LASMessage(LAS_VERBOSE, "'%s' belongs to another version of '%s'. starting it over ...", cache_file_name.c_str(), file_name);
+  bool created = create();
+  unlock();
+  if (!created) close();
+  return created;
+}
+
+// starts the locked sidecar over in place
+
+bool E57scancache::create()
+{
+  if (!e57_truncate(file) || !e57_seek(file, 0))
+  {
+    LASMessage(LAS_WARNING, "cannot create cache '%s'", cache_file_name.c_str());
+    return false;
+  }
+  U32 version = E57_CACHE_VERSION;
+  U32 number = (U32)scan_offsets.size();
+  char id[E57_CACHE_GUID_LENGTH];
+  memset(id, 0, E57_CACHE_GUID_LENGTH);
+  strncpy(id, guid.c_str(), E57_CACHE_GUID_LENGTH - 1);
+  bool written = (fwrite("E57CACHE", 8, 1, file) == 1);
+  written = written && (fwrite(&version, 4, 1, file) == 1);
+  written = written && (fwrite(&number, 4, 1, file) == 1);
+  written = written && (fwrite(&modification_time, 8, 1, file) == 1);
+  written = written && (fwrite(&file_size, 8, 1, file) == 1);
+  written = written && (fwrite(id, E57_CACHE_GUID_LENGTH, 1, file) == 1);
+  written = written && ((number == 0) || (fwrite(scan_offsets.data(), 8, number, file) == number));
+  if (!written || (fflush(file) != 0))
+  {
+    LASMessage(LAS_WARNING, "cannot write cache '%s'", cache_file_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool E57scancache::has_scan(I32 index) const
+{
+  return file && (index >= 0) && (index < (I32)scan_offsets.size()) && (scan_offsets[index] != 0);
+}
+
+bool E57scancache::begin_scan(I32 index, I64 number_points, const std::vector<E57cachecolumn>& columns)
+{
+  if ((file == 0) || (index < 0) || (index >= (I32)scan_offsets.size())) return false;
+  unmap();
+
+  // the lock is held until the scan is finished or abandoned. meanwhile
+  // another conversion may have cached the very same scan
+
+  if (!lock()) return false;
+  if (!read_offsets())
+  {
+    unlock();
+    return false;
+  }
+  if (scan_offsets[index] != 0)
+  {
+    LASMessage(LAS_VERBOSE, "  scan %d was cached by another conversion", index + 1);
+    unlock();
+    return false;
+  }
+
+  // the scan goes behind everything else. a scan that was not finished
+  // before is simply left behind as garbage
+
+  if (fseek(file, 0, SEEK_END) != 0)
+  {
+    unlock();
+    return false;
+  }
+  scan_offset = e57_align(e57_tell(file));
+  this->columns = columns;
+  this->number_points = number_points;
+  I64 start = e57_align(scan_offset + 16 + (I64)(columns.size() * sizeof(E57cachecolumn)));
+  for (size_t c = 0; c < this->columns.size(); c++)
+  {
+    this->columns[c].start = start;
+    start = e57_align(start + number_points * get_size(this->columns[c].type));
+  }
+
+  U32 number_columns = (U32)columns.size();
+  U32 reserved = 0;
+  bool written = e57_seek(file, scan_offset);
+  written = written && (fwrite(&number_points, 8, 1, file) == 1);
+  written = written && (fwrite(&number_columns, 4, 1, file) == 1);
+  written = written && (fwrite(&reserved, 4, 1, file) == 1);
+  written = written && ((number_columns == 0) || (fwrite(this->columns.data(), sizeof(E57cachecolumn), number_columns, file) == number_columns));
+  if (!written)
+  {
+    unlock();
+    return false;
+  }
+  scan = index;
+  return true;
+}
+
+bool E57scancache::write(U32 column, I64 first, U32 count, const void* values)
+{
+  if ((file == 0) || (scan < 0) || (column >= columns.size()) || (first + count > number_points)) return false;
+  U32 size = get_size(columns[column].type);
+  if (!e57_seek(file, columns[column].start + first * size)) return false;
+  return (fwrite(values, size, count, file) == count);
+}
+
+// the scan becomes visible only once all of its columns are on disk
+
+bool E57scancache::end_scan()
+{
+  if ((file == 0) || (scan < 0)) return false;
+  bool written = (fflush(file) == 0);
+  written = written && e57_seek(file, E57_CACHE_HEADER_SIZE + 8 * (I64)scan);
+  written = written && (fwrite(&scan_offset, 8, 1, file) == 1);
+  written = written && (fflush(file) == 0);
+  if (written)
+  {
+    scan_offsets[scan] = scan_offset;
+    LASMessage(LAS_VERBOSE, "  %lld points of scan %d cached in '%s'", number_points, scan + 1, cache_file_name.c_str());
+  }
+  unlock();
+  scan = -1;
+  columns.clear();
+  number_points = 0;
+  return written;
+}
+
+bool E57scancache::map_scan(I32 index)
+{
+  // a scan whose writing failed is abandoned
+
+  if (scan >= 0)
+  {
+    unlock();
+    scan = -1;
+  }
+  if (!has_scan(index)) return false;
+  unmap();
+  if (fflush(file) != 0) return false;
+
+#ifdef _WIN32
+  HANDLE handle = CreateFileA(cache_file_name.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (handle == INVALID_HANDLE_VALUE) return false;
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(handle, &size))
+  {
+    CloseHandle(handle);
+    return false;
+  }
+  mapped_size = (I64)size.QuadPart;
+  mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+  CloseHandle(handle);
+  if (mapping == NULL) return false;
+  mapped = (U8*)MapViewOfFile((HANDLE)mapping, FILE_MAP_READ, 0, 0, 0);
+  if (mapped == NULL)
+  {
+    CloseHandle((HANDLE)mapping);
+    mapping = NULL;
+    return false;
+  }
+#else
+  int descriptor = ::open(cache_file_name.c_str(), O_RDONLY);
+  if (descriptor < 0) return false;
+  struct stat status;
+  if (fstat(descriptor, &status) != 0)
+  {
+    ::close(descriptor);
+    return false;
+  }
+  mapped_size = (I64)status.st_size;
+  void* address = mmap(NULL, (size_t)mapped_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+  ::close(descriptor);
+  if (address == MAP_FAILED) return false;
+  mapped = (U8*)address;
+  madvise(mapped, (size_t)mapped_size, MADV_SEQUENTIAL);
+#endif
+
+  // the descriptors of the columns must point into the file
+
+  I64 offset = scan_offsets[index];
+  U32 number_columns = 0;
+  bool valid = (offset + 16 <= mapped_size);
+  if (valid)
+  {
+    memcpy(&number_points, mapped + offset, 8);
+    memcpy(&number_columns, mapped + offset + 8, 4);
+    valid = (number_points >= 0) && (offset + 16 + (I64)(number_columns * sizeof(E57cachecolumn)) <= mapped_size);
+  }
+  if (valid)
+  {
+    columns.resize(number_columns);
+    if (number_columns) memcpy(columns.data(), mapped + offset + 16, number_columns * sizeof(E57cachecolumn));
+    for (U32 c = 0; (c < number_columns) && valid; c++)
+    {
+      columns[c].name[E57_COLUMN_NAME_LENGTH - 1] = '\0';
+      valid = (get_size(columns[c].type) != 0) && (columns[c].start + number_points * get_size(columns[c].type) <= mapped_size);
+    }
+  }
+  if (!valid)
+  {
+    LASMessage(LAS_WARNING, "scan %d in cache '%s' is damaged", index + 1, cache_file_name.c_str());
+    unmap();
+    return false;
+  }
+  return true;
+}
+
+const E57cachecolumn* E57scancache::find(const char* name) const
+{
+  for (size_t c = 0; c < columns.size(); c++)
+  {
+    if (strncmp(columns[c].name, name, E57_COLUMN_NAME_LENGTH) == 0) return &columns[c];
+  }
+  return 0;
+}
+
+const void* E57scancache::get_values(const E57cachecolumn* column) const
+{
+  return (mapped ? mapped + column->start : 0);
+}
+
+void E57scancache::unmap()
+{
+  if (mapped)
+  {
+#ifdef _WIN32
+    UnmapViewOfFile(mapped);
+    CloseHandle((HANDLE)mapping);
+    mapping = NULL;
+#else
+    munmap(mapped, (size_t)mapped_size);
+#endif
+  }
+  mapped = 0;
+  mapped_size = 0;
+  columns.clear();
+  number_points = 0;
+}
+
+void E57scancache::close()
+{
+  unmap();
+  if (file)
+  {
+    unlock();
+    fclose(file);
+  }
+  file = 0;
+  scan = -1;
+  scan_offsets.clear();
+}
+
+E57scancache::E57scancache()
+{
+  file = 0;
+  locked = false;
+  scan = -1;
+  number_points = 0;
+  scan_offset = 0;
+  modification_time = 0;
+  file_size = 0;
+  mapped = 0;
+  mapped_size = 0;
+#ifdef _WIN32
+  mapping = NULL;
+#endif
+}
+
+E57scancache::~E57scancache()
+{
+  close();
+}
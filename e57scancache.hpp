@@ -0,0 +1,97 @@
+// e57scancache.hpp : keeps the decoded fields of the scans in a memory-mapped sidecar file.
+
+#ifndef E57_SCAN_CACHE_HPP
+#define E57_SCAN_CACHE_HPP
+
+#include "mydefs.hpp"
+
+#include <string>
+#include <vector>
+
+// decoding the compressed vectors of an E57 file (plus checking all of its
+// CRCs) costs more than anything else of a conversion. with '-cache' the
+// decoded fields of every scan are stored once in a sidecar file with one
+// contiguous column per field. later conversions of the same E57 file (with
+// other scales, poses, filters, or outputs) map the columns into memory and
+// do not decode anything. the sidecar belongs to the E57 file with the guid,
+// the size, and the modification time in its header and is started over if
+// any of them differs. scans are appended as they are converted the first
+// time and only become visible once all of their columns are written.
+// concurrent conversions of the same E57 file take turns with an advisory
+// lock on the sidecar and a scan that one of them cached is not decoded again
+//
+// "E57CACHE" | version | number of scans | modification time | file size |
+// guid | offset of each scan (0 if not cached) | scans
+//
+// a scan is its number of points, its number of columns, the descriptors of
+// the columns, and then the columns. all columns start 64 byte aligned
+
+#define E57_COLUMN_INT8 1
+#define E57_COLUMN_INT32 2
+#define E57_COLUMN_UINT16 3
+#define E57_COLUMN_FLOAT 4
+#define E57_COLUMN_DOUBLE 5
+
+#define E57_COLUMN_NAME_LENGTH 32
+
+struct E57cachecolumn {
+  // the name of the E57 field
+  char name[E57_COLUMN_NAME_LENGTH];
+  U32 type;
+  U32 reserved;
+  // the values of INT32 columns of ScaledInteger fields are the raw integers
+  F64 scale;
+  F64 offset;
+  // file position of the first value
+  I64 start;
+};
+
+class E57scancache
+{
+public:
+  // opens the sidecar (next to the E57 file or in 'directory') and starts it
+  // over when it is missing, damaged, or belongs to another E57 file
+  bool open(const char* file_name, const char* directory, const char* guid, I32 number_scans);
+  bool has_scan(I32 index) const;
+  // appends the columns of a scan. the values of a column are written in
+  // batches in the order of the points
+  bool begin_scan(I32 index, I64 number_points, const std::vector<E57cachecolumn>& columns);
+  bool write(U32 column, I64 first, U32 count, const void* values);
+  bool end_scan();
+  // maps the columns of a cached scan into memory
+  bool map_scan(I32 index);
+  I64 get_number_points() const { return number_points; };
+  const E57cachecolumn* find(const char* name) const;
+  const void* get_values(const E57cachecolumn* column) const;
+  void unmap();
+  void close();
+  const char* get_file_name() const { return cache_file_name.c_str(); };
+  static U32 get_size(U32 type);
+  E57scancache();
+  ~E57scancache();
+private:
+  bool create();
+  bool lock();
+  void unlock();
+  bool read_offsets();
+  std::string cache_file_name;
+  std::string guid;
+  I64 modification_time;
+  I64 file_size;
+  FILE* file;
+  bool locked;
+  std::vector<I64> scan_offsets;
+  // the scan that is written or mapped
+  I32 scan;
+  I64 number_points;
+  I64 scan_offset;
+  std::vector<E57cachecolumn> columns;
+  // the mapping of the whole sidecar
+  U8* mapped;
+  I64 mapped_size;
+#ifdef _WIN32
+  void* mapping;
+#endif
+};
+
+#endif
@@ -0,0 +1,2667 @@
+// e57tolasconverter.cpp : converts the scans of an E57 file into batches of LAS points.
+
+#include "e57tolasconverter.hpp"
+
+#include <E57Foundation.h>
+#include <cmath>
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <memory>
+#include <type_traits>
+
+#include "lasduplicates.hpp"
+#include "geoprojectionconverter.hpp"
+#include "e57scancache.hpp"
+#include "e57packets.hpp"
+
+#undef min
+#undef max
+
+class LASquaternion {
+public:
+  LASquaternion operator + (const LASquaternion& q) const
+  {
+    return LASquaternion(w + q.w, x + q.x, y + q.y, z + q.z);
+  };
+  LASquaternion operator - (const LASquaternion& q) const
+  {
+    return LASquaternion(w - q.w, x - q.x, y - q.y, z - q.z);
+  };
+  LASquaternion operator * (const LASquaternion& q) const
+  {
+    double w_val = w * q.w - x * q.x - y * q.y - z * q.z;
+    double x_val = w * q.x + x * q.w + y * q.z - z * q.y;
+    double y_val = w * q.y + y * q.w + z * q.x - x * q.z;
+    double z_val = w * q.z + z * q.w + x * q.y - y * q.x;
+    return LASquaternion(w_val, x_val, y_val, z_val);
+  };
+  LASquaternion operator / (LASquaternion& q) const
+  {
+    return ((*this) * (q.inverse()));
+  };
+  LASquaternion& operator += (const LASquaternion& q)
+  {
+    w += q.w;
+    x += q.x;
+    y += q.y;
+    z += q.z;
+    return (*this);
+  };
+  LASquaternion& operator -= (const LASquaternion& q)
+  {
+    w -= q.w;
+    x -= q.x;
+    y -= q.y;
+    z -= q.z;
+    return (*this);
+  };
+  LASquaternion& operator *= (const LASquaternion& q)
+  {
+    double w_val = w * q.w - x * q.x - y * q.y - z * q.z;
+    double x_val = w * q.x + x * q.w + y * q.z - z * q.y;
+    double y_val = w * q.y + y * q.w + z * q.x - x * q.z;
+    double z_val = w * q.z + z * q.w + x * q.y - y * q.x;
+    w = w_val;
+    x = x_val;
+    y = y_val;
+    z = z_val;
+    return (*this);
+  };
+  LASquaternion& operator /= (LASquaternion& q)
+  {
+    (*this) = (*this) * q.inverse();
+    return (*this);
+  };
+  bool operator != (const LASquaternion& q) const
+  {
+    return ((w != q.w) || (x != q.x) || (y != q.y) || (z != q.z)) ? true : false;
+  };
+  bool operator == (const LASquaternion& q) const
+  {
+    return ((w == q.w) && (x == q.x) && (y == q.y) && (z == q.z)) ? true : false;
+  };
+  double norm() const
+  {
+    return (w * w + x * x + y * y + z * z);
+  };
+  double magnitude() const
+  {
+    return std::sqrt(norm());
+  };
+  LASquaternion conjugate() const
+  {
+    return LASquaternion(w, -x, -y, -z);
+  };
+  LASquaternion scale(double s) const
+  {
+    return LASquaternion(w * s, x * s, y * s, z * s);
+  };
+  LASquaternion inverse() const
+  {
+    return conjugate().scale(1 / norm());
+  };
+  void rotate(double& v0, double& v1, double& v2) const
+  {
+    LASquaternion qv(0, v0, v1, v2);
+    LASquaternion qm = ((*this) * qv) * (*this).inverse();
+    v0 = qm.x;
+    v1 = qm.y;
+    v2 = qm.z;
+  };
+  LASquaternion UnitQuaternion() const
+  {
+    return (*this).scale(1 / (*this).magnitude());
+  };
+  LASquaternion()
+  {
+    w = 1;
+    x = y = z = 0;
+  };
+  LASquaternion(double w, double x, double y, double z)
+  {
+    this->w = w;
+    this->x = x;
+    this->y = y;
+    this->z = z;
+  };
+  void get_rotation_matrix(double* r) const
+  {
+    LASquaternion q = UnitQuaternion();
+    r[0] = 1 - 2 * (q.y * q.y + q.z * q.z);
+    r[1] = 2 * (q.x * q.y - q.w * q.z);
+    r[2] = 2 * (q.x * q.z + q.w * q.y);
+    r[3] = 2 * (q.x * q.y + q.w * q.z);
+    r[4] = 1 - 2 * (q.x * q.x + q.z * q.z);
+    r[5] = 2 * (q.y * q.z - q.w * q.x);
+    r[6] = 2 * (q.x * q.z - q.w * q.y);
+    r[7] = 2 * (q.y * q.z + q.w * q.x);
+    r[8] = 1 - 2 * (q.x * q.x + q.y * q.y);
+  };
+  double w, x, y, z;
+};
+
+// affine transform (3x3 matrix plus translation) into which the scan pose and
+// the global '-transform_matrix' are composed so that each point is touched once
+
+class LASaffine {
+public:
+  LASaffine operator * (const LASaffine& a) const
+  {
+    // result applies 'a' first and then 'this'
+    LASaffine m;
+    for (int row = 0; row < 3; row++)
+    {
+      for (int col = 0; col < 3; col++)
+      {
+        m.r[3 * row + col] = r[3 * row] * a.r[col] + r[3 * row + 1] * a.r[3 + col] + r[3 * row + 2] * a.r[6 + col];
+      }
+      m.t[row] = r[3 * row] * a.t[0] + r[3 * row + 1] * a.t[1] + r[3 * row + 2] * a.t[2] + t[row];
+    }
+    return m;
+  };
+  void set_rotation(const LASquaternion& q)
+  {
+    q.get_rotation_matrix(r);
+  };
+  void set_translation(double x, double y, double z)
+  {
+    t[0] = x;
+    t[1] = y;
+    t[2] = z;
+  };
+  bool has_rotation() const
+  {
+    return (r[0] != 1) || (r[1] != 0) || (r[2] != 0) || (r[3] != 0) || (r[4] != 1) || (r[5] != 0) || (r[6] != 0) || (r[7] != 0) || (r[8] != 1);
+  };
+  bool has_translation() const
+  {
+    return (t[0] != 0) || (t[1] != 0) || (t[2] != 0);
+  };
+  bool is_identity() const
+  {
+    return !has_rotation() && !has_translation();
+  };
+  void transform(double& x, double& y, double& z) const
+  {
+    double x_val = r[0] * x + r[1] * y + r[2] * z + t[0];
+    double y_val = r[3] * x + r[4] * y + r[5] * z + t[1];
+    double z_val = r[6] * x + r[7] * y + r[8] * z + t[2];
+    x = x_val;
+    y = y_val;
+    z = z_val;
+  };
+  // SoA batch kernels. the coordinates come in the precision they were decoded
+  // with (float or double lanes) but are always transformed in double
+
+  template<typename T>
+  void transform(unsigned int n, const T* x, const T* y, const T* z, double* x_out, double* y_out, double* z_out) const
+  {
+    for (unsigned int i = 0; i < n; i++)
+    {
+      double x_in = x[i];
+      double y_in = y[i];
+      double z_in = z[i];
+      x_out[i] = r[0] * x_in + r[1] * y_in + r[2] * z_in + t[0];
+      y_out[i] = r[3] * x_in + r[4] * y_in + r[5] * z_in + t[1];
+      z_out[i] = r[6] * x_in + r[7] * y_in + r[8] * z_in + t[2];
+    }
+  };
+  template<typename T>
+  void transform_quantize(unsigned int n, const T* x, const T* y, const T* z, const LASquantizer* quantizer, I32* X, I32* Y, I32* Z) const
+  {
+    for (unsigned int i = 0; i < n; i++)
+    {
+      double x_in = x[i];
+      double y_in = y[i];
+      double z_in = z[i];
+      double x_val = (r[0] * x_in + r[1] * y_in + r[2] * z_in + t[0] - quantizer->x_offset) / quantizer->x_scale_factor;
+      double y_val = (r[3] * x_in + r[4] * y_in + r[5] * z_in + t[1] - quantizer->y_offset) / quantizer->y_scale_factor;
+      double z_val = (r[6] * x_in + r[7] * y_in + r[8] * z_in + t[2] - quantizer->z_offset) / quantizer->z_scale_factor;
+      X[i] = I32_QUANTIZE(x_val);
+      Y[i] = I32_QUANTIZE(y_val);
+      Z[i] = I32_QUANTIZE(z_val);
+    }
+  };
+  LASaffine()
+  {
+    r[0] = 1; r[1] = 0; r[2] = 0;
+    r[3] = 0; r[4] = 1; r[5] = 0;
+    r[6] = 0; r[7] = 0; r[8] = 1;
+    t[0] = t[1] = t[2] = 0;
+  };
+  double r[9];
+  double t[3];
+};
+
+// the coordinate buffers of one scan in the precision they are decoded with.
+// spherical scans are converted into the cartesian buffers which then hold
+// the batch of points that survive the invalid check
+
+template<typename T>
+class E57coordinates {
+public:
+  void alloc(unsigned int size, bool spherical)
+  {
+    x = new T[size];
+    y = new T[size];
+    z = new T[size];
+    if (spherical)
+    {
+      range = new T[size];
+      azimuth = new T[size];
+      elevation = new T[size];
+    }
+  };
+  void add_buffers(e57::ImageFile& imf, std::vector<e57::SourceDestBuffer>& sdbufs, unsigned int size)
+  {
+    if (range)
+    {
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "sphericalRange", range, size, true, true));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "sphericalAzimuth", azimuth, size, true, true));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "sphericalElevation", elevation, size, true, true));
+    }
+    else
+    {
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "cartesianX", x, size, true, true));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "cartesianY", y, size, true, true));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "cartesianZ", z, size, true, true));
+    }
+  };
+  // picks the variant of the loop for the invalid field and the coordinates
+  unsigned int gather(unsigned int size, const int8_t* isInvalidData, bool include_invalid, unsigned int* batchIndex, unsigned int& number_invalid_points)
+  {
+    if (range)
+    {
+      if (isInvalidData == NULL) return gather<true, false, false>(size, isInvalidData, batchIndex, number_invalid_points);
+      if (include_invalid) return gather<true, true, false>(size, isInvalidData, batchIndex, number_invalid_points);
+      return gather<true, true, true>(size, isInvalidData, batchIndex, number_invalid_points);
+    }
+    if (isInvalidData == NULL) return gather<false, false, false>(size, isInvalidData, batchIndex, number_invalid_points);
+    if (include_invalid) return gather<false, true, false>(size, isInvalidData, batchIndex, number_invalid_points);
+    return gather<false, true, true>(size, isInvalidData, batchIndex, number_invalid_points);
+  };
+  template<bool SPHERICAL, bool INVALID, bool SKIP>
+  unsigned int gather(unsigned int size, const int8_t* isInvalidData, unsigned int* batchIndex, unsigned int& number_invalid_points)
+  {
+    if (!SKIP)
+    {
+      // all points stay where they are
+      if (INVALID)
+      {
+        unsigned int number_invalid = 0;
+        for (unsigned int i = 0; i < size; i++) number_invalid += (isInvalidData[i] != 0);
+        number_invalid_points += number_invalid;
+      }
+      for (unsigned int i = 0; i < size; i++) batchIndex[i] = i;
+      if (SPHERICAL) convert(size);
+      return size;
+    }
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < size; i++)
+    {
+      if (isInvalidData[i])
+      {
+        number_invalid_points++;
+        continue;
+      }
+      if (SPHERICAL)
+      {
+        double sinElevation = std::sin((double)elevation[i]);
+        double cosElevation = std::cos((double)elevation[i]);
+        double sinAzimuth = std::sin((double)azimuth[i]);
+        double cosAzimuth = std::cos((double)azimuth[i]);
+        x[count] = (T)(range[i] * cosElevation * cosAzimuth);
+        y[count] = (T)(range[i] * cosElevation * sinAzimuth);
+        z[count] = (T)(range[i] * sinElevation);
+      }
+      else
+      {
+        x[count] = x[i];
+        y[count] = y[i];
+        z[count] = z[i];
+      }
+      batchIndex[count] = i;
+      count++;
+    }
+    return count;
+  };
+  // the spherical coordinates of the first 'size' points into cartesian ones
+  void convert(unsigned int size)
+  {
+    for (unsigned int i = 0; i < size; i++)
+    {
+      double sinElevation = std::sin((double)elevation[i]);
+      double cosElevation = std::cos((double)elevation[i]);
+      double sinAzimuth = std::sin((double)azimuth[i]);
+      double cosAzimuth = std::cos((double)azimuth[i]);
+      x[i] = (T)(range[i] * cosElevation * cosAzimuth);
+      y[i] = (T)(range[i] * cosElevation * sinAzimuth);
+      z[i] = (T)(range[i] * sinElevation);
+    }
+  };
+  void clean()
+  {
+    delete[] x;
+    delete[] y;
+    delete[] z;
+    if (range) delete[] range;
+    if (azimuth) delete[] azimuth;
+    if (elevation) delete[] elevation;
+    x = y = z = range = azimuth = elevation = NULL;
+  };
+  E57coordinates()
+  {
+    x = y = z = range = azimuth = elevation = NULL;
+  };
+  T* x;
+  T* y;
+  T* z;
+  T* range;
+  T* azimuth;
+  T* elevation;
+};
+
+// float lanes are only used for a field whose values a float holds exactly: a
+// single precision Float or a ScaledInteger with a power of two scale, an offset
+// on its grid, and at most 24 bits of scaled values. everything done with the
+// values is done in double, so the float lanes give the same LAS integers
+
+static bool e57_field_decodes_float(const e57::StructureNode& proto, const char* name)
+{
+  if (!proto.isDefined(name)) return false;
+  e57::Node node = proto.get(name);
+  if (node.type() == e57::E57_FLOAT)
+  {
+    return (e57::FloatNode(node).precision() == e57::E57_SINGLE);
+  }
+  if (node.type() != e57::E57_SCALED_INTEGER) return false;
+  e57::ScaledIntegerNode scaled_node(node);
+  double scale = scaled_node.scale();
+  double offset = scaled_node.offset();
+  int exponent;
+  if ((scale < FLT_MIN) || (frexp(scale, &exponent) != 0.5)) return false;
+  if (fmod(offset, scale) != 0.0) return false;
+  double steps = std::max(fabs(scaled_node.minimum() + offset / scale), fabs(scaled_node.maximum() + offset / scale));
+  return (steps <= 16777216.0);
+}
+
+static double e57_field_max_abs(const e57::StructureNode& proto, const char* name)
+{
+  if (!proto.isDefined(name)) return DBL_MAX;
+  e57::Node node = proto.get(name);
+  if (node.type() == e57::E57_FLOAT)
+  {
+    e57::FloatNode float_node(node);
+    return std::max(fabs(float_node.minimum()), fabs(float_node.maximum()));
+  }
+  else if (node.type() == e57::E57_SCALED_INTEGER)
+  {
+    e57::ScaledIntegerNode scaled_node(node);
+    return std::max(fabs(scaled_node.minimum() * scaled_node.scale() + scaled_node.offset()), fabs(scaled_node.maximum() * scaled_node.scale() + scaled_node.offset()));
+  }
+  return DBL_MAX;
+}
+
+// ScaledInteger coordinates are mapped straight onto the LAS integers with
+// X = raw * multiplier + addend. this is exact when the E57 scale is an integer
+// multiple of the LAS scale and when the E57 offset plus the translation of the
+// pose fall onto the LAS grid. the pose must not rotate
+
+class E57passthrough {
+public:
+  bool setup(const e57::StructureNode& proto, const LASaffine& affine, const LASquantizer* quantizer)
+  {
+    static const char* names[3] = { "cartesianX", "cartesianY", "cartesianZ" };
+    const double las_scale[3] = { quantizer->x_scale_factor, quantizer->y_scale_factor, quantizer->z_scale_factor };
+    const double las_offset[3] = { quantizer->x_offset, quantizer->y_offset, quantizer->z_offset };
+
+    if (affine.has_rotation()) return false;
+
+    for (int axis = 0; axis < 3; axis++)
+    {
+      if (!proto.isDefined(names[axis])) return false;
+      e57::Node node = proto.get(names[axis]);
+      if (node.type() != e57::E57_SCALED_INTEGER) return false;
+      e57::ScaledIntegerNode scaled_node(node);
+
+      double ratio = scaled_node.scale() / las_scale[axis];
+      multiplier[axis] = (I64)(ratio + 0.5);
+      if ((multiplier[axis] < 1) || (fabs(ratio - multiplier[axis]) > 1e-9 * ratio)) return false;
+
+      double shift = (scaled_node.offset() + affine.t[axis] - las_offset[axis]) / las_scale[axis];
+      addend[axis] = I64_QUANTIZE(shift);
+      if (fabs(shift - addend[axis]) > 1e-6) return false;
+
+      // the raw integers are decoded into I32 and must map into I32 as well
+      if ((scaled_node.minimum() < I32_MIN) || (scaled_node.maximum() > I32_MAX)) return false;
+      if ((scaled_node.minimum() * multiplier[axis] + addend[axis]) < I32_MIN) return false;
+      if ((scaled_node.maximum() * multiplier[axis] + addend[axis]) > I32_MAX) return false;
+    }
+    return true;
+  };
+  unsigned int map(unsigned int size, const int8_t* isInvalidData, bool include_invalid, const I32* rawX, const I32* rawY, const I32* rawZ, unsigned int* batchIndex, unsigned int& number_invalid_points, I32* X, I32* Y, I32* Z) const
+  {
+    unsigned int count = 0;
+    if (isInvalidData)
+    {
+      for (unsigned int i = 0; i < size; i++)
+      {
+        if (isInvalidData[i])
+        {
+          number_invalid_points++;
+          if (!include_invalid) continue;
+        }
+        batchIndex[count] = i;
+        count++;
+      }
+    }
+    else
+    {
+      for (unsigned int i = 0; i < size; i++) batchIndex[i] = i;
+      count = size;
+    }
+    // integer multiply-add without any floating-point round trip
+    for (unsigned int j = 0; j < count; j++)
+    {
+      X[j] = (I32)(rawX[batchIndex[j]] * multiplier[0] + addend[0]);
+      Y[j] = (I32)(rawY[batchIndex[j]] * multiplier[1] + addend[1]);
+      Z[j] = (I32)(rawZ[batchIndex[j]] * multiplier[2] + addend[2]);
+    }
+    return count;
+  };
+  I64 multiplier[3];
+  I64 addend[3];
+};
+
+#define E57_COORDINATES_DOUBLE 0
+#define E57_COORDINATES_FLOAT 1
+#define E57_COORDINATES_INTEGER 2
+
+// the coordinates are cached in the type that every later conversion can get
+// its values from exactly as if they were decoded. raw ScaledIntegers give the
+// integers, floats, and doubles, single precision Floats give floats and doubles
+
+static int e57_cache_coordinates(const e57::StructureNode& proto, bool spherical)
+{
+  static const char* cartesian[3] = { "cartesianX", "cartesianY", "cartesianZ" };
+  static const char* polar[3] = { "sphericalRange", "sphericalAzimuth", "sphericalElevation" };
+  const char** names = (spherical ? polar : cartesian);
+  bool scaled = !spherical;
+  bool single = true;
+  for (int axis = 0; axis < 3; axis++)
+  {
+    if (!proto.isDefined(names[axis])) return E57_COORDINATES_DOUBLE;
+    e57::Node node = proto.get(names[axis]);
+    if (node.type() == e57::E57_SCALED_INTEGER)
+    {
+      e57::ScaledIntegerNode scaled_node(node);
+      if ((scaled_node.minimum() < I32_MIN) || (scaled_node.maximum() > I32_MAX)) scaled = false;
+      single = false;
+    }
+    else
+    {
+      scaled = false;
+      if ((node.type() != e57::E57_FLOAT) || (e57::FloatNode(node).precision() != e57::E57_SINGLE)) single = false;
+    }
+  }
+  if (scaled) return E57_COORDINATES_INTEGER;
+  if (single) return E57_COORDINATES_FLOAT;
+  return E57_COORDINATES_DOUBLE;
+}
+
+static void e57_add_column(std::vector<E57cachecolumn>& columns, std::vector<void*>& values, const char* name, U32 type, void* data, double scale = 1.0, double offset = 0.0)
+{
+  E57cachecolumn column;
+  memset(&column, 0, sizeof(E57cachecolumn));
+  strncpy(column.name, name, E57_COLUMN_NAME_LENGTH - 1);
+  column.type = type;
+  column.scale = scale;
+  column.offset = offset;
+  columns.push_back(column);
+  values.push_back(data);
+}
+
+// copies 'count' values of a mapped column (or just those in 'index') into a
+// decode buffer. integers get the raw values and floating-point numbers the
+// scaled ones (like libE57 does)
+
+template<typename T, typename V>
+static void e57_cached_values(const V* values, unsigned int count, const unsigned int* index, double scale, double offset, T* out)
+{
+  if (index)
+  {
+    for (unsigned int i = 0; i < count; i++) out[i] = (T)(values[index[i]] * scale + offset);
+  }
+  else
+  {
+    for (unsigned int i = 0; i < count; i++) out[i] = (T)(values[i] * scale + offset);
+  }
+}
+
+template<typename T, typename V>
+static void e57_cached_values(const V* values, unsigned int count, const unsigned int* index, T* out)
+{
+  if (index)
+  {
+    for (unsigned int i = 0; i < count; i++) out[i] = (T)values[index[i]];
+  }
+  else
+  {
+    for (unsigned int i = 0; i < count; i++) out[i] = (T)values[i];
+  }
+}
+
+template<typename T>
+static void e57_cached_column(const E57scancache& cache, const char* name, I64 first, unsigned int count, T* out, const unsigned int* index = NULL)
+{
+  const E57cachecolumn* column = cache.find(name);
+  if (column == NULL)
+  {
+    throw std::runtime_error(std::string("field '") + name + "' is not in the cache");
+  }
+  const U8* values = (const U8*)cache.get_values(column) + first * E57scancache::get_size(column->type);
+  if constexpr (std::is_integral<T>::value)
+  {
+    if ((column->type == E57_COLUMN_FLOAT) || (column->type == E57_COLUMN_DOUBLE))
+    {
+      throw std::runtime_error(std::string("field '") + name + "' is not cached as integers");
+    }
+  }
+  switch (column->type)
+  {
+  case E57_COLUMN_INT8:
+    e57_cached_values((const int8_t*)values, count, index, out);
+    break;
+  case E57_COLUMN_INT32:
+    if constexpr (std::is_integral<T>::value)
+      e57_cached_values((const I32*)values, count, index, out);
+    else
+      e57_cached_values((const I32*)values, count, index, column->scale, column->offset, out);
+    break;
+  case E57_COLUMN_UINT16:
+    e57_cached_values((const U16*)values, count, index, out);
+    break;
+  case E57_COLUMN_FLOAT:
+    e57_cached_values((const F32*)values, count, index, out);
+    break;
+  case E57_COLUMN_DOUBLE:
+    e57_cached_values((const F64*)values, count, index, out);
+    break;
+  }
+}
+
+// moves the values in 'index' to the front. as index[j] >= j nothing that is
+// still needed is overwritten
+
+template<typename T>
+static void e57_compact(T* values, unsigned int count, const unsigned int* index)
+{
+  if (values == NULL) return;
+  for (unsigned int j = 0; j < count; j++) values[j] = values[index[j]];
+}
+
+// the decode buffers for one batch of points plus the flags that say which
+// fields are decoded. the reader copies the flags into each of its slots and
+// allocates the buffers there
+
+class E57fields {
+public:
+  void alloc(unsigned int size)
+  {
+    this->size = size;
+    if (coordinates == E57_COORDINATES_INTEGER)
+    {
+      rawX = new I32[size];
+      rawY = new I32[size];
+      rawZ = new I32[size];
+    }
+    else if (coordinates == E57_COORDINATES_FLOAT)
+    {
+      coordinatesF.alloc(size, spherical);
+    }
+    else
+    {
+      coordinatesD.alloc(size, spherical);
+    }
+    if (invalid_state) isInvalidData = new int8_t[size];
+    if (intensity) intData = new double[size];
+    if (color)
+    {
+      redData = new uint16_t[size];
+      greenData = new uint16_t[size];
+      blueData = new uint16_t[size];
+    }
+    if (return_index) returnIndex = new int8_t[size];
+    if (return_count) returnCount = new int8_t[size];
+    if (time_stamp) timeStamp = new double[size];
+    if (row_column)
+    {
+      rowIndex = new int32_t[size];
+      columnIndex = new int32_t[size];
+    }
+  };
+  void add_buffers(e57::ImageFile& imf, std::vector<e57::SourceDestBuffer>& sdbufs)
+  {
+    if (coordinates == E57_COORDINATES_INTEGER)
+    {
+      // doScaling=false hands out the raw integers
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "cartesianX", rawX, size, true, false));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "cartesianY", rawY, size, true, false));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "cartesianZ", rawZ, size, true, false));
+    }
+    else if (coordinates == E57_COORDINATES_FLOAT)
+    {
+      coordinatesF.add_buffers(imf, sdbufs, size);
+    }
+    else
+    {
+      coordinatesD.add_buffers(imf, sdbufs, size);
+    }
+    if (invalid_state)
+      sdbufs.push_back(e57::SourceDestBuffer(imf, (spherical ? "sphericalInvalidState" : "cartesianInvalidState"), isInvalidData, size, true));
+    if (intensity)
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "intensity", intData, size, true, true));
+    if (color)
+    {
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "colorRed", redData, size, true));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "colorGreen", greenData, size, true));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "colorBlue", blueData, size, true));
+    }
+    if (return_index)
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "returnIndex", returnIndex, size, true));
+    if (return_count)
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "returnCount", returnCount, size, true));
+    if (time_stamp)
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "timeStamp", timeStamp, size, true, true));
+    if (row_column)
+    {
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "rowIndex", rowIndex, size, true));
+      sdbufs.push_back(e57::SourceDestBuffer(imf, "columnIndex", columnIndex, size, true));
+    }
+  };
+  // the same fields as the columns of a cached scan
+  void add_columns(const e57::StructureNode& proto, std::vector<E57cachecolumn>& columns, std::vector<void*>& values) const
+  {
+    if (coordinates == E57_COORDINATES_INTEGER)
+    {
+      e57::ScaledIntegerNode nodeX(proto.get("cartesianX"));
+      e57::ScaledIntegerNode nodeY(proto.get("cartesianY"));
+      e57::ScaledIntegerNode nodeZ(proto.get("cartesianZ"));
+      e57_add_column(columns, values, "cartesianX", E57_COLUMN_INT32, rawX, nodeX.scale(), nodeX.offset());
+      e57_add_column(columns, values, "cartesianY", E57_COLUMN_INT32, rawY, nodeY.scale(), nodeY.offset());
+      e57_add_column(columns, values, "cartesianZ", E57_COLUMN_INT32, rawZ, nodeZ.scale(), nodeZ.offset());
+    }
+    else if (coordinates == E57_COORDINATES_FLOAT)
+    {
+      e57_add_column(columns, values, (spherical ? "sphericalRange" : "cartesianX"), E57_COLUMN_FLOAT, (spherical ? coordinatesF.range : coordinatesF.x));
+      e57_add_column(columns, values, (spherical ? "sphericalAzimuth" : "cartesianY"), E57_COLUMN_FLOAT, (spherical ? coordinatesF.azimuth : coordinatesF.y));
+      e57_add_column(columns, values, (spherical ? "sphericalElevation" : "cartesianZ"), E57_COLUMN_FLOAT, (spherical ? coordinatesF.elevation : coordinatesF.z));
+    }
+    else
+    {
+      e57_add_column(columns, values, (spherical ? "sphericalRange" : "cartesianX"), E57_COLUMN_DOUBLE, (spherical ? coordinatesD.range : coordinatesD.x));
+      e57_add_column(columns, values, (spherical ? "sphericalAzimuth" : "cartesianY"), E57_COLUMN_DOUBLE, (spherical ? coordinatesD.azimuth : coordinatesD.y));
+      e57_add_column(columns, values, (spherical ? "sphericalElevation" : "cartesianZ"), E57_COLUMN_DOUBLE, (spherical ? coordinatesD.elevation : coordinatesD.z));
+    }
+    if (invalid_state)
+      e57_add_column(columns, values, (spherical ? "sphericalInvalidState" : "cartesianInvalidState"), E57_COLUMN_INT8, isInvalidData);
+    if (intensity)
+      e57_add_column(columns, values, "intensity", E57_COLUMN_DOUBLE, intData);
+    if (color)
+    {
+      e57_add_column(columns, values, "colorRed", E57_COLUMN_UINT16, redData);
+      e57_add_column(columns, values, "colorGreen", E57_COLUMN_UINT16, greenData);
+      e57_add_column(columns, values, "colorBlue", E57_COLUMN_UINT16, blueData);
+    }
+    if (return_index)
+      e57_add_column(columns, values, "returnIndex", E57_COLUMN_INT8, returnIndex);
+    if (return_count)
+      e57_add_column(columns, values, "returnCount", E57_COLUMN_INT8, returnCount);
+    if (time_stamp)
+      e57_add_column(columns, values, "timeStamp", E57_COLUMN_DOUBLE, timeStamp);
+    if (row_column)
+    {
+      e57_add_column(columns, values, "rowIndex", E57_COLUMN_INT32, rowIndex);
+      e57_add_column(columns, values, "columnIndex", E57_COLUMN_INT32, columnIndex);
+    }
+  };
+  // copies the next 'count' points (or those in 'index' from 'first' on) from
+  // the mapped columns of a cached scan
+  void fill(const E57scancache& cache, I64 first, unsigned int count, const unsigned int* index = NULL)
+  {
+    if (coordinates == E57_COORDINATES_INTEGER)
+    {
+      e57_cached_column(cache, "cartesianX", first, count, rawX, index);
+      e57_cached_column(cache, "cartesianY", first, count, rawY, index);
+      e57_cached_column(cache, "cartesianZ", first, count, rawZ, index);
+    }
+    else if (coordinates == E57_COORDINATES_FLOAT)
+    {
+      e57_cached_column(cache, (spherical ? "sphericalRange" : "cartesianX"), first, count, (spherical ? coordinatesF.range : coordinatesF.x), index);
+      e57_cached_column(cache, (spherical ? "sphericalAzimuth" : "cartesianY"), first, count, (spherical ? coordinatesF.azimuth : coordinatesF.y), index);
+      e57_cached_column(cache, (spherical ? "sphericalElevation" : "cartesianZ"), first, count, (spherical ? coordinatesF.elevation : coordinatesF.z), index);
+    }
+    else
+    {
+      e57_cached_column(cache, (spherical ? "sphericalRange" : "cartesianX"), first, count, (spherical ? coordinatesD.range : coordinatesD.x), index);
+      e57_cached_column(cache, (spherical ? "sphericalAzimuth" : "cartesianY"), first, count, (spherical ? coordinatesD.azimuth : coordinatesD.y), index);
+      e57_cached_column(cache, (spherical ? "sphericalElevation" : "cartesianZ"), first, count, (spherical ? coordinatesD.elevation : coordinatesD.z), index);
+    }
+    if (invalid_state)
+      e57_cached_column(cache, (spherical ? "sphericalInvalidState" : "cartesianInvalidState"), first, count, isInvalidData, index);
+    if (intensity)
+      e57_cached_column(cache, "intensity", first, count, intData, index);
+    if (color)
+    {
+      e57_cached_column(cache, "colorRed", first, count, redData, index);
+      e57_cached_column(cache, "colorGreen", first, count, greenData, index);
+      e57_cached_column(cache, "colorBlue", first, count, blueData, index);
+    }
+    if (return_index)
+      e57_cached_column(cache, "returnIndex", first, count, returnIndex, index);
+    if (return_count)
+      e57_cached_column(cache, "returnCount", first, count, returnCount, index);
+    if (time_stamp)
+      e57_cached_column(cache, "timeStamp", first, count, timeStamp, index);
+    if (row_column)
+    {
+      e57_cached_column(cache, "rowIndex", first, count, rowIndex, index);
+      e57_cached_column(cache, "columnIndex", first, count, columnIndex, index);
+    }
+  };
+  // the points on every 'step'th row and column of the scanner grid
+  unsigned int select(unsigned int size, int step, I64 row_min, I64 column_min, unsigned int* index) const
+  {
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < size; i++)
+    {
+      index[count] = i;
+      count += ((((rowIndex[i] - row_min) % step) == 0) && (((columnIndex[i] - column_min) % step) == 0));
+    }
+    return count;
+  };
+  // drops all other points before any coordinate is touched
+  void compact(unsigned int count, const unsigned int* index)
+  {
+    e57_compact(rawX, count, index);
+    e57_compact(rawY, count, index);
+    e57_compact(rawZ, count, index);
+    e57_compact(coordinatesF.range ? coordinatesF.range : coordinatesF.x, count, index);
+    e57_compact(coordinatesF.range ? coordinatesF.azimuth : coordinatesF.y, count, index);
+    e57_compact(coordinatesF.range ? coordinatesF.elevation : coordinatesF.z, count, index);
+    e57_compact(coordinatesD.range ? coordinatesD.range : coordinatesD.x, count, index);
+    e57_compact(coordinatesD.range ? coordinatesD.azimuth : coordinatesD.y, count, index);
+    e57_compact(coordinatesD.range ? coordinatesD.elevation : coordinatesD.z, count, index);
+    e57_compact(isInvalidData, count, index);
+    e57_compact(intData, count, index);
+    e57_compact(redData, count, index);
+    e57_compact(greenData, count, index);
+    e57_compact(blueData, count, index);
+    e57_compact(returnIndex, count, index);
+    e57_compact(returnCount, count, index);
+    e57_compact(timeStamp, count, index);
+    e57_compact(rowIndex, count, index);
+    e57_compact(columnIndex, count, index);
+  };
+  void clean()
+  {
+    coordinatesF.clean();
+    coordinatesD.clean();
+    if (rawX) delete[] rawX;
+    if (rawY) delete[] rawY;
+    if (rawZ) delete[] rawZ;
+    if (isInvalidData) delete[] isInvalidData;
+    if (intData) delete[] intData;
+    if (redData) delete[] redData;
+    if (greenData) delete[] greenData;
+    if (blueData) delete[] blueData;
+    if (returnIndex) delete[] returnIndex;
+    if (returnCount) delete[] returnCount;
+    if (timeStamp) delete[] timeStamp;
+    if (rowIndex) delete[] rowIndex;
+    if (columnIndex) delete[] columnIndex;
+    rawX = rawY = rawZ = NULL;
+    isInvalidData = returnIndex = returnCount = NULL;
+    intData = timeStamp = NULL;
+    redData = greenData = blueData = NULL;
+    rowIndex = columnIndex = NULL;
+    size = 0;
+  };
+  E57fields()
+  {
+    spherical = false;
+    coordinates = E57_COORDINATES_DOUBLE;
+    invalid_state = intensity = color = return_index = return_count = time_stamp = row_column = false;
+    size = 0;
+    rawX = rawY = rawZ = NULL;
+    isInvalidData = returnIndex = returnCount = NULL;
+    intData = timeStamp = NULL;
+    redData = greenData = blueData = NULL;
+    rowIndex = columnIndex = NULL;
+  };
+  // what is decoded
+  bool spherical;
+  int coordinates;
+  bool invalid_state;
+  bool intensity;
+  bool color;
+  bool return_index;
+  bool return_count;
+  bool time_stamp;
+  bool row_column;
+  // the buffers
+  unsigned int size;
+  E57coordinates<float> coordinatesF;
+  E57coordinates<double> coordinatesD;
+  I32* rawX;
+  I32* rawY;
+  I32* rawZ;
+  int8_t* isInvalidData;
+  double* intData;
+  uint16_t* redData;
+  uint16_t* greenData;
+  uint16_t* blueData;
+  int8_t* returnIndex;
+  int8_t* returnCount;
+  double* timeStamp;
+  int32_t* rowIndex;
+  int32_t* columnIndex;
+};
+
+// converts the decoded fields of the points that survived into the batch.
+// each field has its own loop that is picked once per batch so that the loops
+// are free of branches and vectorize. only whether the points were compacted
+// (and need the index) is a template parameter
+
+class E57attributes {
+public:
+  void setup(const E57fields& layout, double intOffset, double intRange, const double* colorOffset, const double* colorRange)
+  {
+    intensity = layout.intensity;
+    intensity_scaled = ((intRange != 255) && (intRange != 65535));
+    color = layout.color;
+    return_index = layout.return_index;
+    return_count = layout.return_count;
+    time_stamp = layout.time_stamp;
+    this->intOffset = intOffset;
+    this->intRange = intRange;
+    for (int k = 0; k < 3; k++)
+    {
+      this->colorOffset[k] = colorOffset[k];
+      this->colorRange[k] = colorRange[k];
+    }
+  };
+  // 'size' points were decoded and 'count' of them survived. if all of them
+  // survived they are still in place and the index is not needed
+  void convert(unsigned int size, unsigned int count, const unsigned int* batchIndex, const E57fields& fields, E57batch& batch) const
+  {
+    if (count == size)
+      convert<false>(count, batchIndex, fields, batch);
+    else
+      convert<true>(count, batchIndex, fields, batch);
+  };
+  E57attributes()
+  {
+    intensity = intensity_scaled = color = return_index = return_count = time_stamp = false;
+    intOffset = 0.0;
+    intRange = 0.0;
+    colorOffset[0] = colorOffset[1] = colorOffset[2] = 0.0;
+    colorRange[0] = colorRange[1] = colorRange[2] = 1.0;
+  };
+private:
+  template<bool INDEXED>
+  void convert(unsigned int count, const unsigned int* batchIndex, const E57fields& fields, E57batch& batch) const
+  {
+    unsigned int j;
+
+    if (intensity && intensity_scaled)
+    {
+      for (j = 0; j < count; j++) batch.intensity[j] = ((int)(0.5 + (((fields.intData[INDEXED ? batchIndex[j] : j] - intOffset) * 255) / intRange))) << 8;
+    }
+    else if (intensity)
+    {
+      for (j = 0; j < count; j++) batch.intensity[j] = (U16)(fields.intData[INDEXED ? batchIndex[j] : j] - intOffset);
+    }
+
+    if (color)
+    {
+      for (j = 0; j < count; j++) batch.red[j] = ((int)(0.5 + (((fields.redData[INDEXED ? batchIndex[j] : j] - colorOffset[0]) * 255) / colorRange[0]))) << 8;
+      for (j = 0; j < count; j++) batch.green[j] = ((int)(0.5 + (((fields.greenData[INDEXED ? batchIndex[j] : j] - colorOffset[1]) * 255) / colorRange[1]))) << 8;
+      for (j = 0; j < count; j++) batch.blue[j] = ((int)(0.5 + (((fields.blueData[INDEXED ? batchIndex[j] : j] - colorOffset[2]) * 255) / colorRange[2]))) << 8;
+    }
+
+    if (return_index)
+    {
+      for (j = 0; j < count; j++) batch.return_number[j] = (U8)(fields.returnIndex[INDEXED ? batchIndex[j] : j] + 1);
+    }
+
+    if (return_count)
+    {
+      for (j = 0; j < count; j++) batch.number_of_returns[j] = (U8)(fields.returnCount[INDEXED ? batchIndex[j] : j] + 1);
+    }
+
+    if (time_stamp)
+    {
+      for (j = 0; j < count; j++) batch.gps_time[j] = fields.timeStamp[INDEXED ? batchIndex[j] : j];
+    }
+  };
+  bool intensity;
+  bool intensity_scaled;
+  bool color;
+  bool return_index;
+  bool return_count;
+  bool time_stamp;
+  double intOffset;
+  double intRange;
+  double colorOffset[3];
+  double colorRange[3];
+};
+
+// reads the points of one scan in batches. on several cores the scan is split
+// into units of consecutive batches that the decoders take in turns. each one
+// reads just the data packets of its unit with its own file handle (see
+// e57packets.hpp) while the batches before it are converted and written. a
+// scan that cannot be decoded from its packets is decoded by libE57 on one
+// thread ahead of the conversion. the batches are handed out strictly in
+// order. the points of a cached scan are copied from its mapped columns instead
+
+#define E57_UNIT_POINTS 32768
+
+class E57reader {
+public:
+  int open(const E57scancache* cache, const E57fields& layout, unsigned int size, int step, I64 row_min, I64 column_min)
+  {
+    slots.resize(1);
+    slots[0].fields = layout;
+    slots[0].fields.alloc(size);
+    this->cache = cache;
+    cache_next = 0;
+    cache_step = step;
+    cache_row_min = row_min;
+    cache_column_min = column_min;
+    if (step > 1) cache_index.resize(size);
+    current = 0;
+    handed_out = false;
+    return 1;
+  };
+  int open(const char* file_name, e57::ImageFile& imf, int scanIndex, const E57fields& layout, unsigned int size, int cores, int step = 1, const e57::IndexBounds* bounds = NULL)
+  {
+    e57::VectorNode data3D(imf.root().get("/data3D"));
+    e57::StructureNode scan(data3D.get(scanIndex));
+    e57::CompressedVectorNode points(scan.get("points"));
+    e57::StructureNode proto(points.prototype());
+    this->size = size;
+    number_points = points.childCount();
+
+    // the decoders need the fields as typed columns
+
+    int number_decoders = 0;
+    if ((cores > 1) || (step > 1))
+    {
+      std::vector<E57cachecolumn> columns;
+      std::vector<void*> values;
+      layout.add_columns(proto, columns, values);
+      if (index.open(file_name, imf, scanIndex, columns))
+      {
+        number_decoders = cores;
+        LASMessage(LAS_VERY_VERBOSE, "  indexed %lld data packets", index.get_number_packets());
+      }
+      else
+      {
+        LASMessage(LAS_VERBOSE, "  scan cannot be decoded from its data packets. libE57 decodes it on one thread");
+      }
+    }
+
+    unit = (number_decoders ? std::max(1u, E57_UNIT_POINTS / size) : 1);
+    number_batches = (number_decoders ? (number_points + size - 1) / size : -1);
+    slots.resize(number_decoders ? 2 * number_decoders * unit : (cores > 1 ? 2 : 1));
+    for (size_t s = 0; s < slots.size(); s++)
+    {
+      E57slot& slot = slots[s];
+      slot.fields = layout;
+      slot.fields.alloc(size);
+      if (number_decoders)
+      {
+        std::vector<E57cachecolumn> columns;
+        slot.fields.add_columns(proto, columns, slot.values);
+        value_sizes.resize(columns.size());
+        for (size_t c = 0; c < columns.size(); c++) value_sizes[c] = E57scancache::get_size(columns[c].type);
+      }
+      else
+      {
+        slot.fields.add_buffers(imf, slot.sdbufs);
+      }
+      slot.count = 0;
+      slot.filled = false;
+    }
+
+    decoders.resize(number_decoders);
+    for (int d = 0; d < number_decoders; d++)
+    {
+      if (!decoders[d].open(&index))
+      {
+        throw std::runtime_error(decoders[d].get_error());
+      }
+    }
+    if (number_decoders == 0)
+    {
+      reader = new e57::CompressedVectorReader(points.reader(slots[0].sdbufs));
+    }
+    else if ((step > 1) && bounds && find_lines(step, *bounds))
+    {
+      LASMessage(LAS_VERBOSE, "  only %lld of %lld %s are decoded", (I64)lines.size(), number_points / line_length, (line_by_column ? "columns" : "rows"));
+      number_points = (I64)lines.size() * line_length;
+      number_batches = (number_points + size - 1) / size;
+    }
+
+    current = 0;
+    batch = 0;
+    handed_out = false;
+    stop = false;
+    error.clear();
+
+    for (int d = 0; d < number_decoders; d++)
+    {
+      threads.push_back(std::thread(&E57reader::decode_packets, this, d));
+    }
+    if ((number_decoders == 0) && (slots.size() > 1))
+    {
+      threads.push_back(std::thread(&E57reader::decode, this));
+    }
+    return number_decoders;
+  };
+  unsigned int read()
+  {
+    if (cache && (cache_step > 1))
+    {
+      // only the rows and columns are copied to find the points on the grid
+      // step. the other fields are only copied for these
+      while (cache_next < cache->get_number_points())
+      {
+        E57fields& fields = slots[0].fields;
+        unsigned int size = (unsigned int)std::min((I64)fields.size, cache->get_number_points() - cache_next);
+        e57_cached_column(*cache, "rowIndex", cache_next, size, fields.rowIndex);
+        e57_cached_column(*cache, "columnIndex", cache_next, size, fields.columnIndex);
+        unsigned int count = fields.select(size, cache_step, cache_row_min, cache_column_min, cache_index.data());
+        fields.fill(*cache, cache_next, count, cache_index.data());
+        cache_next += size;
+        if (count) return count;
+      }
+      return 0;
+    }
+    if (cache)
+    {
+      unsigned int size = (unsigned int)std::min((I64)slots[0].fields.size, cache->get_number_points() - cache_next);
+      slots[0].fields.fill(*cache, cache_next, size);
+      cache_next += size;
+      return size;
+    }
+    if (threads.empty())
+    {
+      return reader->read();
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (handed_out)
+    {
+      // the slot that was converted can be refilled
+      slots[current].filled = false;
+      batch++;
+      current = (int)(batch % (I64)slots.size());
+      handed_out = false;
+      condition.notify_all();
+    }
+    if ((number_batches >= 0) && (batch >= number_batches))
+    {
+      return 0;
+    }
+    condition.wait(lock, [this] { return !error.empty() || slots[current].filled; });
+    if (!error.empty())
+    {
+      throw std::runtime_error(error);
+    }
+    handed_out = true;
+    return slots[current].count;
+  };
+  E57fields& front()
+  {
+    return slots[current].fields;
+  };
+  void close()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    condition.notify_all();
+    for (size_t k = 0; k < threads.size(); k++)
+    {
+      threads[k].join();
+    }
+    threads.clear();
+    if (reader)
+    {
+      reader->close();
+      delete reader;
+      reader = NULL;
+    }
+    for (size_t d = 0; d < decoders.size(); d++)
+    {
+      decoders[d].close();
+    }
+    decoders.clear();
+    index.close();
+    lines.clear();
+    for (size_t s = 0; s < slots.size(); s++)
+    {
+      slots[s].fields.clean();
+    }
+    slots.clear();
+    cache = NULL;
+  };
+  E57reader()
+  {
+    reader = NULL;
+    size = 0;
+    number_points = 0;
+    number_batches = -1;
+    unit = 1;
+    current = 0;
+    batch = 0;
+    handed_out = false;
+    stop = false;
+    cache = NULL;
+    cache_next = 0;
+    cache_step = 1;
+    cache_row_min = cache_column_min = 0;
+    line_length = 0;
+    line_by_column = false;
+    line_first = 0;
+    line_step = 0;
+  };
+  ~E57reader()
+  {
+    if (slots.size()) close();
+  };
+private:
+  struct E57slot {
+    E57fields fields;
+    // where libE57 or the packet decoders put the fields
+    std::vector<e57::SourceDestBuffer> sdbufs;
+    std::vector<void*> values;
+    unsigned int count;
+    bool filled;
+  };
+  // libE57 decodes one batch after the other
+  void decode()
+  {
+    try
+    {
+      for (I64 b = 0; ; b++)
+      {
+        E57slot& slot = slots[b % (I64)slots.size()];
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          condition.wait(lock, [&] { return stop || !slot.filled; });
+          if (stop) return;
+        }
+        unsigned int count = reader->read(slot.sdbufs);
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          slot.count = count;
+          slot.filled = true;
+        }
+        condition.notify_all();
+        if (count == 0) return;
+      }
+    }
+    catch (std::exception& e)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (error.empty()) error = e.what();
+      condition.notify_all();
+    }
+  };
+  // decoder 'd' takes every d-th unit. the two units of a decoder use their
+  // own slots so that it fills the next while the batches of one are converted
+  void decode_packets(int d)
+  {
+    E57packetdecoder& decoder = decoders[d];
+    try
+    {
+      for (I64 first_batch = (I64)d * unit; first_batch < number_batches; first_batch += (I64)decoders.size() * unit)
+      {
+        I64 last_batch = std::min(first_batch + (I64)unit, number_batches);
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          condition.wait(lock, [&]
+          {
+            if (stop) return true;
+            for (I64 b = first_batch; b < last_batch; b++)
+            {
+              if (slots[b % (I64)slots.size()].filled) return false;
+            }
+            return true;
+          });
+          if (stop) return;
+        }
+        I64 first = first_batch * size;
+        if (lines.empty() && !decoder.load(first, std::min(last_batch * size, number_points) - first))
+        {
+          throw std::runtime_error(decoder.get_error());
+        }
+        for (I64 b = first_batch; b < last_batch; b++)
+        {
+          E57slot& slot = slots[b % (I64)slots.size()];
+          unsigned int count = (unsigned int)std::min((I64)size, number_points - b * size);
+          if (lines.empty())
+          {
+            decoder.decode(b * size, count, slot.values);
+          }
+          else
+          {
+            decode_lines(decoder, b * size, count, slot);
+          }
+          {
+            std::lock_guard<std::mutex> lock(mutex);
+            slot.count = count;
+            slot.filled = true;
+          }
+          condition.notify_all();
+        }
+      }
+    }
+    catch (std::exception& e)
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (error.empty()) error = e.what();
+      condition.notify_all();
+    }
+  };
+  // decodes the row and the column of one record before the threads start
+  bool probe(I64 record, I32& row, I32& column)
+  {
+    E57slot& slot = slots[0];
+    if (!decoders[0].load(record, 1)) return false;
+    decoders[0].decode(record, 1, slot.values);
+    row = slot.fields.rowIndex[0];
+    column = slot.fields.columnIndex[0];
+    return true;
+  };
+  // a complete structured scan is usually stored line by line, one column
+  // (or row) after the other. if its first, second, and last line say so,
+  // only the lines on the grid step are decoded. select() still drops the
+  // other points of these lines
+  bool find_lines(int step, const e57::IndexBounds& bounds)
+  {
+    I64 rows = bounds.rowMaximum - bounds.rowMinimum + 1;
+    I64 columns = bounds.columnMaximum - bounds.columnMinimum + 1;
+    if ((rows < 2) || (columns < 2) || (rows * columns != number_points)) return false;
+    I32 row0, column0, row1, column1;
+    if (!probe(0, row0, column0) || !probe(1, row1, column1)) return false;
+    if ((row0 == row1) == (column0 == column1)) return false;
+    line_by_column = (column0 == column1);
+    line_length = (line_by_column ? rows : columns);
+    I64 number_lines = number_points / line_length;
+    I64 minimum = (line_by_column ? bounds.columnMinimum : bounds.rowMinimum);
+    I64 inner_minimum = (line_by_column ? bounds.rowMinimum : bounds.columnMinimum);
+    const I64 checked[3] = { 0, 1, number_lines - 1 };
+    I32 value[3];
+    for (int k = 0; k < 3; k++)
+    {
+      I32 row_first, column_first, row_last, column_last;
+      if (!probe(checked[k] * line_length, row_first, column_first) || !probe((checked[k] + 1) * line_length - 1, row_last, column_last)) return false;
+      I32 first = (line_by_column ? row_first : column_first);
+      I32 last = (line_by_column ? row_last : column_last);
+      value[k] = (line_by_column ? column_first : row_first);
+      if (value[k] != (line_by_column ? column_last : row_last)) return false;
+      if ((std::min(first, last) != inner_minimum) || ((I64)std::max(first, last) - std::min(first, last) + 1 != line_length)) return false;
+    }
+    line_first = value[0];
+    line_step = value[1] - value[0];
+    if (((line_step != 1) && (line_step != -1)) || (value[2] != line_first + (number_lines - 1) * line_step)) return false;
+    for (I64 line = 0; line < number_lines; line++)
+    {
+      if (((line_first + line * line_step - minimum) % step) == 0) lines.push_back(line);
+    }
+    return true;
+  };
+  // decodes the records [first, first + count) of the kept lines piece by
+  // piece. each piece is checked to lie on the line it was expected on
+  void decode_lines(E57packetdecoder& decoder, I64 first, unsigned int count, E57slot& slot)
+  {
+    std::vector<void*> values(slot.values.size());
+    unsigned int done = 0;
+    while (done < count)
+    {
+      I64 line = (first + done) / line_length;
+      I64 offset = (first + done) % line_length;
+      unsigned int piece = (unsigned int)std::min((I64)(count - done), line_length - offset);
+      I64 record = lines[line] * line_length + offset;
+      if (!decoder.load(record, piece))
+      {
+        throw std::runtime_error(decoder.get_error());
+      }
+      for (size_t c = 0; c < values.size(); c++) values[c] = (U8*)slot.values[c] + (size_t)done * value_sizes[c];
+      decoder.decode(record, piece, values);
+      const int32_t* indices = (line_by_column ? slot.fields.columnIndex : slot.fields.rowIndex);
+      I32 expected = (I32)(line_first + lines[line] * line_step);
+      if ((indices[done] != expected) || (indices[done + piece - 1] != expected))
+      {
+        throw std::runtime_error("the points of the scan are not stored line by line. convert it without '-grid_step'");
+      }
+      done += piece;
+    }
+  };
+  std::vector<E57slot> slots;
+  e57::CompressedVectorReader* reader;
+  E57packetindex index;
+  std::vector<E57packetdecoder> decoders;
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable condition;
+  unsigned int size;
+  I64 number_points;
+  // -1 while libE57 decodes and its last read tells the end
+  I64 number_batches;
+  unsigned int unit;
+  int current;
+  I64 batch;
+  bool handed_out;
+  bool stop;
+  std::string error;
+  const E57scancache* cache;
+  I64 cache_next;
+  int cache_step;
+  I64 cache_row_min;
+  I64 cache_column_min;
+  std::vector<unsigned int> cache_index;
+  // the kept lines of a scan that is decoded line by line
+  std::vector<I64> lines;
+  I64 line_length;
+  bool line_by_column;
+  I32 line_first;
+  I32 line_step;
+  std::vector<U32> value_sizes;
+};
+
+// decodes all fields of a scan once and appends them as columns to the cache
+
+static bool e57_cache_scan(E57scancache& cache, const char* file_name, e57::ImageFile& imf, int scanIndex, const E57fields& layout, unsigned int size, int cores)
+{
+  e57::VectorNode data3D(imf.root().get("/data3D"));
+  e57::StructureNode scanNode(data3D.get(scanIndex));
+  e57::CompressedVectorNode points(scanNode.get("points"));
+  e57::StructureNode proto(points.prototype());
+  I64 number_points = points.childCount();
+
+  std::vector<E57cachecolumn> columns;
+  std::vector<void*> values;
+  layout.add_columns(proto, columns, values);
+  if (!cache.begin_scan(scanIndex, number_points, columns)) return false;
+
+  LASMessage(LAS_VERBOSE, "  decoding %lld points with %d fields into the cache", number_points, (int)columns.size());
+
+  E57reader reader;
+  reader.open(file_name, imf, scanIndex, layout, size, cores);
+  I64 first = 0;
+  unsigned int count;
+  while ((count = reader.read()) > 0)
+  {
+    if (first + count > number_points) return false;
+    columns.clear();
+    values.clear();
+    reader.front().add_columns(proto, columns, values);
+    for (size_t c = 0; c < values.size(); c++)
+    {
+      if (!cache.write((U32)c, first, count, values[c])) return false;
+    }
+    first += count;
+  }
+  reader.close();
+  return (first == number_points) && cache.end_scan();
+}
+
+// the statistics of one scan. the reductions are plain loops over the arrays
+// of the batch that the compiler vectorizes
+
+class E57statistics {
+public:
+  void init(int scan, const char* name, double range_maximum)
+  {
+    memset(&record, 0, sizeof(E57statisticsRecord));
+    record.version = 1;
+    record.scan = (U32)scan;
+    record.range_bin_size = (range_maximum > 0.0 ? range_maximum / E57_STATISTICS_BINS : 0.0);
+    this->name = (name ? name : "");
+    min_X = min_Y = min_Z = I32_MAX;
+    max_X = max_Y = max_Z = I32_MIN;
+    sum_X = sum_Y = sum_Z = 0;
+  };
+  void add(const E57batch* batch)
+  {
+    unsigned int count = batch->count;
+    if (count == 0) return;
+    reduce(count, batch->X, min_X, max_X, sum_X);
+    reduce(count, batch->Y, min_Y, max_Y, sum_Y);
+    reduce(count, batch->Z, min_Z, max_Z, sum_Z);
+    if (batch->intensity)
+    {
+      record.flags |= E57_STATISTICS_INTENSITY;
+      histogram(count, batch->intensity, record.intensity);
+    }
+    if (batch->red)
+    {
+      record.flags |= E57_STATISTICS_COLOR;
+      histogram(count, batch->red, record.red);
+      histogram(count, batch->green, record.green);
+      histogram(count, batch->blue, record.blue);
+    }
+    if (batch->return_number)
+    {
+      record.flags |= E57_STATISTICS_RETURNS;
+      for (unsigned int j = 0; j < count; j++) increment(record.return_number[batch->return_number[j] & 15]);
+    }
+    if (batch->number_of_returns)
+    {
+      record.flags |= E57_STATISTICS_RETURNS;
+      for (unsigned int j = 0; j < count; j++) increment(record.number_of_returns[batch->number_of_returns[j] & 15]);
+    }
+    record.number_of_points += count;
+  };
+  // the ranges of a spherical scan are still in the decode buffer
+  template<typename T>
+  void add_ranges(unsigned int count, const T* range, const unsigned int* batchIndex)
+  {
+    if (record.range_bin_size <= 0.0) return;
+    record.flags |= E57_STATISTICS_RANGE;
+    double inverse = 1.0 / record.range_bin_size;
+    for (unsigned int j = 0; j < count; j++)
+    {
+      int bin = (int)(range[batchIndex[j]] * inverse);
+      increment(record.range[(bin < 0 ? 0 : (bin < E57_STATISTICS_BINS ? bin : E57_STATISTICS_BINS - 1))]);
+    }
+  };
+  void done(I64 number_of_invalid_points, const LASquantizer* quantizer)
+  {
+    record.number_of_invalid_points = number_of_invalid_points;
+    if (record.number_of_points == 0) return;
+    record.min[0] = quantizer->get_x(min_X);
+    record.min[1] = quantizer->get_y(min_Y);
+    record.min[2] = quantizer->get_z(min_Z);
+    record.max[0] = quantizer->get_x(max_X);
+    record.max[1] = quantizer->get_y(max_Y);
+    record.max[2] = quantizer->get_z(max_Z);
+    record.mean[0] = quantizer->x_offset + quantizer->x_scale_factor * ((F64)sum_X / record.number_of_points);
+    record.mean[1] = quantizer->y_offset + quantizer->y_scale_factor * ((F64)sum_Y / record.number_of_points);
+    record.mean[2] = quantizer->z_offset + quantizer->z_scale_factor * ((F64)sum_Z / record.number_of_points);
+  };
+  void write_json(FILE* file, bool last) const
+  {
+    I64 number = record.number_of_points + record.number_of_invalid_points;
+    fprintf(file, "  {\n");
+    fprintf(file, "    \"scan\": %u,\n", record.scan);
+    fprintf(file, "    \"name\": ");
+    write_json_string(file, name.c_str());
+    fprintf(file, ",\n");
+    fprintf(file, "    \"number_of_points\": %lld,\n", record.number_of_points);
+    fprintf(file, "    \"number_of_invalid_points\": %lld,\n", record.number_of_invalid_points);
+    fprintf(file, "    \"invalid_ratio\": %g,\n", (number ? (F64)record.number_of_invalid_points / number : 0.0));
+    fprintf(file, "    \"min\": [%.6f, %.6f, %.6f],\n", record.min[0], record.min[1], record.min[2]);
+    fprintf(file, "    \"max\": [%.6f, %.6f, %.6f],\n", record.max[0], record.max[1], record.max[2]);
+    fprintf(file, "    \"mean\": [%.6f, %.6f, %.6f]", record.mean[0], record.mean[1], record.mean[2]);
+    if (record.flags & E57_STATISTICS_INTENSITY)
+    {
+      write_json_array(file, "intensity_histogram", record.intensity, E57_STATISTICS_BINS);
+    }
+    if (record.flags & E57_STATISTICS_COLOR)
+    {
+      write_json_array(file, "red_histogram", record.red, E57_STATISTICS_BINS);
+      write_json_array(file, "green_histogram", record.green, E57_STATISTICS_BINS);
+      write_json_array(file, "blue_histogram", record.blue, E57_STATISTICS_BINS);
+    }
+    if (record.flags & E57_STATISTICS_RETURNS)
+    {
+      write_json_array(file, "return_number", record.return_number, 16);
+      write_json_array(file, "number_of_returns", record.number_of_returns, 16);
+    }
+    if (record.flags & E57_STATISTICS_RANGE)
+    {
+      fprintf(file, ",\n    \"range_bin_size\": %g", record.range_bin_size);
+      write_json_array(file, "range_histogram", record.range, E57_STATISTICS_BINS);
+    }
+    fprintf(file, "\n  }%s\n", (last ? "" : ","));
+  };
+  // windows paths and scan names need their backslashes and quotes escaped
+  static void write_json_string(FILE* file, const char* string)
+  {
+    fputc('"', file);
+    for (const char* c = string; *c; c++)
+    {
+      if ((*c == '"') || (*c == '\\')) fputc('\\', file);
+      if ((unsigned char)*c >= 32) fputc(*c, file);
+    }
+    fputc('"', file);
+  };
+  E57statisticsRecord record;
+  std::string name;
+private:
+  // min, max, and sum in separate loops without branches so that they vectorize
+  static void reduce(unsigned int count, const I32* values, I32& min, I32& max, I64& sum)
+  {
+    I32 lo = min;
+    I32 hi = max;
+    I64 total = 0;
+    for (unsigned int j = 0; j < count; j++) lo = std::min(lo, values[j]);
+    for (unsigned int j = 0; j < count; j++) hi = std::max(hi, values[j]);
+    for (unsigned int j = 0; j < count; j++) total += values[j];
+    min = lo;
+    max = hi;
+    sum += total;
+  };
+  // the 16 bit values are binned by their upper byte
+  static void histogram(unsigned int count, const U16* values, U32* bins)
+  {
+    for (unsigned int j = 0; j < count; j++) increment(bins[values[j] >> 8]);
+  };
+  static void increment(U32& bin)
+  {
+    if (bin != U32_MAX) bin++;
+  };
+  static void write_json_array(FILE* file, const char* key, const U32* values, int number)
+  {
+    fprintf(file, ",\n    \"%s\": [", key);
+    for (int i = 0; i < number; i++) fprintf(file, (i ? ",%u" : "%u"), values[i]);
+    fprintf(file, "]");
+  };
+  I32 min_X, min_Y, min_Z;
+  I32 max_X, max_Y, max_Z;
+  I64 sum_X, sum_Y, sum_Z;
+};
+
+// the non-linear reprojection of a batch in place. GeoProjectionConverter
+// only converts one point at a time, so this is the one place where a
+// batched conversion would go
+
+static void e57_to_target(const GeoProjectionConverter* geoprojectionconverter, unsigned int n, double* x, double* y, double* z)
+{
+  double coordinates[3];
+  for (unsigned int i = 0; i < n; i++)
+  {
+    coordinates[0] = x[i];
+    coordinates[1] = y[i];
+    coordinates[2] = z[i];
+    geoprojectionconverter->to_target(coordinates);
+    x[i] = coordinates[0];
+    y[i] = coordinates[1];
+    z[i] = coordinates[2];
+  }
+}
+
+static void e57_quantize(unsigned int n, const double* x, const double* y, const double* z, const LASquantizer* quantizer, I32* X, I32* Y, I32* Z)
+{
+  for (unsigned int i = 0; i < n; i++)
+  {
+    X[i] = I32_QUANTIZE((x[i] - quantizer->x_offset) / quantizer->x_scale_factor);
+    Y[i] = I32_QUANTIZE((y[i] - quantizer->y_offset) / quantizer->y_scale_factor);
+    Z[i] = I32_QUANTIZE((z[i] - quantizer->z_offset) / quantizer->z_scale_factor);
+  }
+}
+
+void E57sink::start()
+{
+  quit = false;
+  thread = std::thread(&E57sink::run, this);
+}
+
+void E57sink::post(const E57batch* batch)
+{
+  if (!thread.joinable())
+  {
+    write(batch);
+    return;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [this] { return pending == NULL; });
+  pending = batch;
+  condition.notify_all();
+}
+
+void E57sink::finish()
+{
+  if (!thread.joinable()) return;
+  std::unique_lock<std::mutex> lock(mutex);
+  condition.wait(lock, [this] { return pending == NULL; });
+}
+
+void E57sink::stop()
+{
+  if (!thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  condition.notify_all();
+  thread.join();
+}
+
+void E57sink::run()
+{
+  while (true)
+  {
+    const E57batch* batch;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [this] { return quit || (pending != NULL); });
+      if (pending == NULL) return;
+      batch = pending;
+    }
+    write(batch);
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      pending = NULL;
+    }
+    condition.notify_all();
+  }
+}
+
+E57sink::E57sink()
+{
+  pending = NULL;
+  quit = false;
+}
+
+E57sink::~E57sink()
+{
+  stop();
+}
+
+void E57ToLasConverter::add_sink(E57sink* sink)
+{
+  sinks.push_back(sink);
+}
+
+void E57ToLasConverter::remove_sinks()
+{
+  sinks.clear();
+}
+
+// libE57 initializes Xerces whenever it opens an ImageFile and terminates it
+// whenever it closes one, which is not thread-safe. the converters of several
+// '-watch' workers therefore open and close their E57 files one at a time
+
+static std::mutex e57_reader_mutex;
+
+struct E57readerdeleter
+{
+  void operator () (e57::Reader* reader) const
+  {
+    std::lock_guard<std::mutex> lock(e57_reader_mutex);
+    delete reader;
+  };
+};
+
+typedef std::unique_ptr<e57::Reader, E57readerdeleter> E57readerptr;
+
+static E57readerptr e57_open_reader(const char* file_name)
+{
+  std::lock_guard<std::mutex> lock(e57_reader_mutex);
+  return E57readerptr(new e57::Reader(file_name));
+}
+
+int E57ToLasConverter::count_scans(const char* file_name)
+{
+  try
+  {
+    E57readerptr reader = e57_open_reader(file_name);
+    if (!reader->IsOpen()) return -1;
+    return reader->GetData3DCount();
+  }
+  catch (std::exception&)
+  {
+    return -1;
+  }
+}
+
+bool E57ToLasConverter::convert(const char* file_name)
+{
+  number_points = 0;
+  number_invalid_points = 0;
+  number_duplicates = 0;
+  clean_statistics();
+  this->file_name = file_name;
+
+  // the duplicate cells are on the grid of the scans of one file only
+
+  if (duplicates)
+  {
+    delete duplicates;
+    duplicates = NULL;
+  }
+
+  if (sinks.size() == 0)
+  {
+    LASMessage(LAS_ERROR, "no sink to convert '%s' into", file_name);
+    return false;
+  }
+
+  if (sinks.size() > 1)
+  {
+    LASMessage(LAS_VERBOSE, "all %d outputs are written from one single pass", (int)sinks.size());
+    for (size_t s = 0; s < sinks.size(); s++) sinks[s]->start();
+  }
+
+  bool result = false;
+  try
+  {
+    result = convert_scans(file_name);
+  }
+  catch (std::exception& e)
+  {
+    LASMessage(LAS_ERROR, "processing '%s': %s", file_name, e.what());
+    result = false;
+  }
+
+  for (size_t s = 0; s < sinks.size(); s++) sinks[s]->stop();
+
+  // the cells and their spilled runs are not kept until the next file
+
+  if (duplicates)
+  {
+    delete duplicates;
+    duplicates = NULL;
+  }
+  return result;
+}
+
+bool E57ToLasConverter::convert_scans(const char* file_name)
+{
+  // Check if file exists
+
+  FILE* file = LASfopen(file_name, "rb");
+  if (file == 0)
+  {
+    LASMessage(LAS_ERROR, "file '%s' does not exist", file_name);
+    return false;
+  }
+  fclose(file);
+
+  // Instantiate an e57::Reader object and open the .e57 file.
+#pragma warning(push)
+#pragma warning(disable : 6387)
+  E57readerptr reader = e57_open_reader(file_name);
+#pragma warning(pop)
+  e57::Reader& eReader = *reader;
+  if (!eReader.IsOpen())
+  {
+    LASMessage(LAS_ERROR, "opening '%s'", file_name);
+    return false;
+  }
+
+  // How many individual scans are there?
+
+  int data3DCount = eReader.GetData3DCount();
+
+  LASMessage(LAS_VERBOSE, "file '%s' contains %d scan%s", file_name, data3DCount, (data3DCount == 1 ? "" : (options.merge_scans ? "s. merging ..." : "s. splitting ...")));
+
+  // the sidecar with the decoded scans belongs to the guid of the file
+
+  E57scancache cache;
+  bool caching = false;
+  if (options.cache)
+  {
+    e57::E57Root root;
+    eReader.GetE57Root(root);
+    caching = cache.open(file_name, options.cache_dir, root.guid.c_str(), data3DCount);
+    if (!caching)
+    {
+      LASMessage(LAS_WARNING, "scans of '%s' are decoded without a cache", file_name);
+    }
+  }
+
+  LASaffine transform_matrix;
+  if (options.apply_transform_matrix)
+  {
+    for (int j = 0; j < 9; j++) transform_matrix.r[j] = options.transform_matrix[j];
+    for (int j = 0; j < 3; j++) transform_matrix.t[j] = options.transform_matrix[9 + j];
+  }
+  bool apply_transform_matrix = options.apply_transform_matrix && !transform_matrix.is_identity();
+  if (apply_transform_matrix)
+  {
+    LASMessage(LAS_VERBOSE, "transform matrix (%g,%g,%g,%g,%g,%g,%g,%g,%g) and translation (%g,%g,%g) is applied after the pose", transform_matrix.r[0], transform_matrix.r[1], transform_matrix.r[2], transform_matrix.r[3], transform_matrix.r[4], transform_matrix.r[5], transform_matrix.r[6], transform_matrix.r[7], transform_matrix.r[8], transform_matrix.t[0], transform_matrix.t[1], transform_matrix.t[2]);
+  }
+
+  GeoProjectionConverter* geoprojectionconverter = options.geoprojectionconverter;
+  bool reproject = false;
+  if (geoprojectionconverter && geoprojectionconverter->has_projection(false))
+  {
+    if (!geoprojectionconverter->has_projection(true))
+    {
+      LASMessage(LAS_ERROR, "no source projection. reprojecting needs both, e.g. '-epsg 32632 -target_epsg 25832'");
+      return false;
+    }
+    reproject = true;
+    LASMessage(LAS_VERBOSE, "points are reprojected from the source to the target projection");
+  }
+  bool georeferenced = (geoprojectionconverter && geoprojectionconverter->has_projection(true));
+
+  // Derive the fields that need decoding from the sinks. fields that no sink
+  // needs are never handed to the CompressedVectorReader
+
+  bool decode_intensity = false;
+  bool decode_color = false;
+  bool decode_returns = false;
+  bool decode_time = false;
+  bool decode_grid = false;
+
+  for (size_t s = 0; s < sinks.size(); s++)
+  {
+    sinks[s]->needs(decode_intensity, decode_color, decode_returns, decode_time);
+    if (sinks[s]->needs_grid()) decode_grid = true;
+  }
+  decode_intensity = decode_intensity && !options.drop_intensity;
+  decode_color = decode_color && !options.drop_color;
+
+  bool remove_duplicates = options.remove_duplicates;
+  if (remove_duplicates && (!options.merge_scans || (data3DCount < 2)))
+  {
+    LASMessage(LAS_WARNING, "'-remove_duplicates' only removes points of one scan that an earlier scan already had. %s", (options.merge_scans ? "file has only one scan. ignoring ..." : "scans are split. ignoring ..."));
+    remove_duplicates = false;
+  }
+
+  // Loop over all scans
+  E57scan scan;
+  scan.file_name = file_name;
+  scan.number_scans = data3DCount;
+  scan.merged = options.merge_scans;
+  scan.geoprojectionconverter = (georeferenced ? geoprojectionconverter : NULL);
+  scan.reprojected = reproject;
+  scan.cores = options.cores;
+  scan.unrounded = false;
+  LASquantizer& quantizer = scan.quantizer;
+  bool output_open = false;
+  int scanIndex;
+  int scanIndexFirst = 0;
+  int scanIndexLast = data3DCount - 1;
+  const std::vector<int>& scan_vector = options.scans;
+  // just some scans requested: get first and last scan
+  if (scan_vector.size() > 0)
+  {
+    scanIndexFirst = data3DCount - 1;
+    scanIndexLast = 0;
+    for (size_t loop = 0; loop < scan_vector.size(); loop++)
+    {
+      if (scan_vector[loop] > data3DCount)
+      {
+        LASMessage(LAS_WARNING, "scan number [%d] is bigger than number of scans %d in file and will be ignored", scan_vector[loop], data3DCount);
+      }
+      else
+      {
+        scanIndexFirst = std::min(scanIndexFirst, scan_vector[loop] - 1);
+        scanIndexLast = std::max(scanIndexLast, scan_vector[loop] - 1);
+      }
+    }
+    if (scanIndexLast - scanIndexFirst < 0)
+    {
+      LASMessage(LAS_ERROR, "given scan numbers does not match any available scans");
+      return false;
+    }
+  }
+
+  LASquaternion quaternion;
+  bool scan_has_quaternion = false;
+  e57::Translation translation;
+  bool scan_has_translation = false;
+
+  // the scans that are merged into one output. the scans without complete
+  // coordinates are skipped here so that the output ends with the last scan
+  // that is actually converted
+
+  std::vector<int> selected_scans;
+  for (scanIndex = scanIndexFirst; scanIndex < scanIndexLast + 1; scanIndex++)
+  {
+    // option: just do certain scans [1...n]
+    if ((scan_vector.size() > 0) && std::find(scan_vector.begin(), scan_vector.end(), scanIndex + 1) == scan_vector.end())
+    {
+      continue;
+    }
+
+    e57::Data3D	scanHeader;
+    eReader.ReadData3D(scanIndex, scanHeader);
+
+    // check content of scan header
+    if (scanHeader.pointFields.cartesianXField || scanHeader.pointFields.cartesianYField || scanHeader.pointFields.cartesianZField)
+    {
+      if (!scanHeader.pointFields.cartesianXField)
+      {
+        fprintf(stderr, "no cartesian x coordinates for scan %d. skipping ...\n", scanIndex);
+        continue;
+      }
+
+      if (!scanHeader.pointFields.cartesianYField)
+      {
+        fprintf(stderr, "no cartesian y coordinates for scan %d. skipping ...\n", scanIndex);
+        continue;
+      }
+
+      if (!scanHeader.pointFields.cartesianZField)
+      {
+        fprintf(stderr, "no cartesian z coordinates for scan %d. skipping ...\n", scanIndex);
+        continue;
+      }
+    }
+    else if (scanHeader.pointFields.sphericalRangeField || scanHeader.pointFields.sphericalAzimuthField || scanHeader.pointFields.sphericalElevationField)
+    {
+      if (!scanHeader.pointFields.sphericalRangeField)
+      {
+        fprintf(stderr, "no spherical range coordinates for scan %d. skipping ...\n", scanIndex);
+        continue;
+      }
+
+      if (!scanHeader.pointFields.sphericalAzimuthField)
+      {
+        fprintf(stderr, "no spherical azimuth coordinates for scan %d. skipping ...\n", scanIndex);
+        continue;
+      }
+
+      if (!scanHeader.pointFields.sphericalElevationField)
+      {
+        fprintf(stderr, "no spherical elevation coordinates for scan %d. skipping ...\n", scanIndex);
+        continue;
+      }
+    }
+    else
+    {
+      fprintf(stderr, "neither cartesian nor coordinates for scan %d. skipping ...\n", scanIndex);
+      continue;
+    }
+    selected_scans.push_back(scanIndex);
+  }
+
+  if (selected_scans.size() == 0)
+  {
+    LASMessage(LAS_WARNING, "no scan of '%s' has complete coordinates", file_name);
+  }
+
+  for (size_t selected = 0; selected < selected_scans.size(); selected++)
+  {
+    scanIndex = selected_scans[selected];
+
+    // Read and access all the e57::Data3D header information from the first scan.
+    e57::Data3D	scanHeader;
+    eReader.ReadData3D(scanIndex, scanHeader);
+
+    // the scans that were selected have complete cartesian or spherical coordinates
+    bool spherical = !scanHeader.pointFields.cartesianXField;
+
+    // Get the size information about the scan.
+
+    int64_t nColumn = 0;		// Number of Columns in a structure scan (from "indexBounds" if structure data)
+    int64_t nRow = 0;			// Number of Rows in a structure scan	
+    int64_t nPointsSize = 0;	// Number of points 
+    int64_t nGroupsSize = 0;	// Number of groups (from "groupingByLine" if present)
+    int64_t nCountsSize = 0;	// Number of points per group
+    bool bColumnIndex = 0;
+
+    eReader.GetData3DSizes(scanIndex, nRow, nColumn, nPointsSize, nGroupsSize, nCountsSize, bColumnIndex);
+
+    LASMessageStream(LAS_VERBOSE) << "processing scan " << scanIndex + 1 << "\n";
+    if (nRow && nColumn)
+      LASMessageStream(LAS_VERBOSE) << "  contains grid of " << nColumn << " by " << nRow << " equaling " << nColumn * nRow << " " << (spherical ? "spherical" : "cartesian") << " points\n";
+    else
+      LASMessageStream(LAS_VERBOSE) << "  contains " << nPointsSize << " " << (spherical ? "spherical" : "cartesian") << " points\n";
+
+    // Check if scan has pose information
+
+    if ((scanHeader.pose.rotation.w != 1) || (scanHeader.pose.rotation.x != 0) || (scanHeader.pose.rotation.y != 0) || (scanHeader.pose.rotation.z != 0))
+    {
+      quaternion = LASquaternion(scanHeader.pose.rotation.w, scanHeader.pose.rotation.x, scanHeader.pose.rotation.y, scanHeader.pose.rotation.z);
+      scan_has_quaternion = true;
+      LASMessage(LAS_VERBOSE, "  has quaternion (%g,%g,%g,%g) which is %sapplied", quaternion.w, quaternion.x, quaternion.y, quaternion.z, (options.apply_quaternion ? "" : "not "));
+    }
+    else
+    {
+      scan_has_quaternion = false;
+    }
+    if ((scanHeader.pose.translation.x != 0) || (scanHeader.pose.translation.y != 0) || (scanHeader.pose.translation.z != 0))
+    {
+      translation = scanHeader.pose.translation;
+      scan_has_translation = true;
+      LASMessage(LAS_VERBOSE, "  has translation (%g,%g,%g) which is %sapplied", translation.x, translation.y, translation.z, (options.apply_translation ? "" : "not "));
+    }
+    else
+    {
+      scan_has_translation = false;
+    }
+
+    // Compose the pose with the global transform matrix into one affine transform
+
+    LASaffine pose;
+    if (scan_has_quaternion && options.apply_quaternion) pose.set_rotation(quaternion);
+    if (scan_has_translation && options.apply_translation) pose.set_translation(translation.x, translation.y, translation.z);
+    LASaffine affine = (apply_transform_matrix ? transform_matrix * pose : pose);
+
+    // Pick a size for the buffers
+
+    int32_t nSize = (nRow > 0) ? (int32_t)nRow : 1024;
+
+    // Decide which fields are decoded. the buffers are owned by the reader
+    // which double buffers them when decoding on several cores
+
+    E57fields layout;
+    layout.spherical = spherical;
+
+    // Setup the invalid data buffers if present
+
+    if (spherical)
+    {
+      layout.invalid_state = scanHeader.pointFields.sphericalInvalidStateField;
+    }
+    else
+    {
+      layout.invalid_state = scanHeader.pointFields.cartesianInvalidStateField;
+    }
+
+    // Setup the intensity buffers if present
+
+    double intRange = 0;
+    double intOffset = 0;
+
+    if (scanHeader.pointFields.intensityField && !decode_intensity)
+    {
+      LASMessage(LAS_VERBOSE, "  contains intensities which are not decoded");
+    }
+    else if (scanHeader.pointFields.intensityField)
+    {
+      layout.intensity = true;
+      intRange = scanHeader.intensityLimits.intensityMaximum - scanHeader.intensityLimits.intensityMinimum;
+      intOffset = scanHeader.intensityLimits.intensityMinimum;
+
+      LASMessage(LAS_VERBOSE, "  contains intensities (%g-%g)", scanHeader.intensityLimits.intensityMinimum, scanHeader.intensityLimits.intensityMaximum);
+    }
+
+    // Setup color buffers if present
+
+    double colorRedRange = 1;
+    double colorRedOffset = 0;
+    double colorGreenRange = 1;
+    double colorGreenOffset = 0;
+    double colorBlueRange = 1;
+    double colorBlueOffset = 0;
+
+    if (scanHeader.pointFields.colorRedField && scanHeader.pointFields.colorGreenField && scanHeader.pointFields.colorBlueField && !decode_color)
+    {
+      LASMessage(LAS_VERBOSE, "  contains RGB colors which are not decoded");
+    }
+    else if (scanHeader.pointFields.colorRedField && scanHeader.pointFields.colorGreenField && scanHeader.pointFields.colorBlueField)
+    {
+      layout.color = true;
+      colorRedRange = scanHeader.colorLimits.colorRedMaximum - scanHeader.colorLimits.colorRedMinimum;
+      colorRedOffset = scanHeader.colorLimits.colorRedMinimum;
+      colorGreenRange = scanHeader.colorLimits.colorGreenMaximum - scanHeader.colorLimits.colorGreenMinimum;
+      colorGreenOffset = scanHeader.colorLimits.colorGreenMinimum;
+      colorBlueRange = scanHeader.colorLimits.colorBlueMaximum - scanHeader.colorLimits.colorBlueMinimum;
+      colorBlueOffset = scanHeader.colorLimits.colorBlueMinimum;
+
+      LASMessage(LAS_VERBOSE, "  contains RGB colors (%g-%g, %g-%g, %g-%g)", (float)scanHeader.colorLimits.colorRedMinimum, (float)scanHeader.colorLimits.colorRedMaximum, (float)scanHeader.colorLimits.colorGreenMinimum, (float)scanHeader.colorLimits.colorGreenMaximum, (float)scanHeader.colorLimits.colorBlueMinimum, (float)scanHeader.colorLimits.colorBlueMaximum);
+    }
+
+    // Setup the GroupByLine buffers information if present
+
+    int64_t* idElementValue = NULL;
+    int64_t* startPointIndex = NULL;
+    int64_t* pointCount = NULL;
+
+    /* not used right now
+        if(nGroupsSize > 0)
+        {
+          idElementValue = new int64_t[(uint32_t)nGroupsSize];
+          startPointIndex = new int64_t[(uint32_t)nGroupsSize];
+          pointCount = new int64_t[(uint32_t)nGroupsSize];
+
+          if (!eReader.ReadData3DGroupsData(scanIndex, (int32_t)nGroupsSize, idElementValue, startPointIndex, pointCount))
+          {
+            nGroupsSize = 0;
+          }
+        }
+    */
+
+    // Setup the row/column index information if present. they are also
+    // decoded to thin the scan to every n-th row and column
+
+    bool structured = scanHeader.pointFields.rowIndexField && scanHeader.pointFields.columnIndexField;
+    int grid_step = 1;
+    if (options.grid_step > 1)
+    {
+      if (structured)
+      {
+        grid_step = options.grid_step;
+        LASMessage(LAS_VERBOSE, "  only every %d. row and column is converted", grid_step);
+      }
+      else
+      {
+        LASMessage(LAS_WARNING, "scan %d has no row and column indices. '-grid_step' is ignored", scanIndex + 1);
+      }
+    }
+    if (structured && (decode_grid || (grid_step > 1)))
+    {
+      layout.row_column = true;
+    }
+
+    // Setup the return information if present
+
+    if (scanHeader.pointFields.returnIndexField && decode_returns)
+    {
+      layout.return_index = true;
+      LASMessage(LAS_VERBOSE, "  contains return indices");
+    }
+    if (scanHeader.pointFields.returnCountField && decode_returns)
+    {
+      layout.return_count = true;
+      LASMessage(LAS_VERBOSE, "  contains return counts");
+    }
+
+    // Setup the time stamp information if present
+
+    // int8_t* isTimeStampInvalid = NULL;
+
+    if (scanHeader.pointFields.timeStampField && decode_time)
+    {
+      layout.time_stamp = true;
+      LASMessage(LAS_VERBOSE, "  contains time stamps");
+    }
+    /*
+    if (scanHeader.pointFields.isTimeStampInvalidField)
+    {
+      isTimeStampInvalid = new int8_t[nSize];
+    }
+    */
+
+
+    // Tell the sinks about the scan. a new output gets the offset from a
+    // reference point which is moved along with the global transform matrix
+    // and the reprojection (if any)
+
+    scan.index = scanIndex;
+    scan.first = !output_open;
+    scan.last = (!options.merge_scans || (scanIndex == selected_scans.back()));
+    if (options.merge_scans)
+      scan.output_scans = selected_scans;
+    else
+      scan.output_scans.assign(1, scanIndex);
+    scan.header = &scanHeader;
+    scan.spherical = spherical;
+    scan.intensity = layout.intensity;
+    scan.color = layout.color;
+    scan.return_index = layout.return_index;
+    scan.return_count = layout.return_count;
+    scan.time_stamp = layout.time_stamp;
+    scan.grid = layout.row_column && decode_grid;
+    // the scanner sits at the origin of its own coordinate system
+    scan.origin[0] = scan.origin[1] = scan.origin[2] = 0.0;
+    affine.transform(scan.origin[0], scan.origin[1], scan.origin[2]);
+    if (reproject)
+    {
+      geoprojectionconverter->to_target(scan.origin);
+    }
+    scan.statistics = NULL;
+
+    if (scan.first)
+    {
+      double center[3] = { 0.0, 0.0, 0.0 };
+
+      if (scan_has_translation && options.apply_translation)
+      {
+        center[0] = translation.x;
+        center[1] = translation.y;
+        center[2] = translation.z;
+      }
+      else
+      {
+        if ((scanHeader.cartesianBounds.xMinimum != -DBL_MAX) && (scanHeader.cartesianBounds.xMaximum != DBL_MAX))
+        {
+          center[0] = (scanHeader.cartesianBounds.xMinimum + scanHeader.cartesianBounds.xMaximum) / 2;
+        }
+        if ((scanHeader.cartesianBounds.yMinimum != -DBL_MAX) && (scanHeader.cartesianBounds.yMaximum != DBL_MAX))
+        {
+          center[1] = (scanHeader.cartesianBounds.yMinimum + scanHeader.cartesianBounds.yMaximum) / 2;
+        }
+        if ((scanHeader.cartesianBounds.zMinimum != -DBL_MAX) && (scanHeader.cartesianBounds.zMaximum != DBL_MAX))
+        {
+          center[2] = (scanHeader.cartesianBounds.zMinimum + scanHeader.cartesianBounds.zMaximum) / 2;
+        }
+      }
+
+      if (apply_transform_matrix)
+      {
+        transform_matrix.transform(center[0], center[1], center[2]);
+      }
+
+      if (reproject)
+      {
+        geoprojectionconverter->to_target(center);
+      }
+
+      // the points are quantized once with the finest resolution of all sinks
+      // and all sinks share the same offset
+
+      quantizer.x_scale_factor = quantizer.y_scale_factor = quantizer.z_scale_factor = DBL_MAX;
+      for (size_t s = 0; s < sinks.size(); s++)
+      {
+        const F64* scale_factor = sinks[s]->get_scale_factor();
+        if (scale_factor == NULL) scale_factor = options.scale_factor;
+        quantizer.x_scale_factor = std::min(quantizer.x_scale_factor, scale_factor[0]);
+        quantizer.y_scale_factor = std::min(quantizer.y_scale_factor, scale_factor[1]);
+        quantizer.z_scale_factor = std::min(quantizer.z_scale_factor, scale_factor[2]);
+      }
+      if (options.has_offset)
+      {
+        quantizer.x_offset = options.offset[0];
+        quantizer.y_offset = options.offset[1];
+        quantizer.z_offset = options.offset[2];
+      }
+      else
+      {
+        quantizer.x_offset = ((int)(center[0] / 10000)) * 10000;
+        quantizer.y_offset = ((int)(center[1] / 10000)) * 10000;
+        quantizer.z_offset = ((int)(center[2] / 10000)) * 10000;
+      }
+
+      if (spherical)
+      {
+        LASMessage(LAS_VERY_VERBOSE, "  range min %g, max %g, offset %g", scanHeader.sphericalBounds.rangeMinimum, scanHeader.sphericalBounds.rangeMaximum, quantizer.x_offset);
+        LASMessage(LAS_VERY_VERBOSE, "  elevation min %g, max %g, offset %g", scanHeader.sphericalBounds.elevationMinimum, scanHeader.sphericalBounds.elevationMaximum, quantizer.y_offset);
+        LASMessage(LAS_VERY_VERBOSE, "  azimuth min %g, zmax %g, offset %g", scanHeader.sphericalBounds.azimuthStart, scanHeader.sphericalBounds.azimuthEnd, quantizer.z_offset);
+      }
+      else
+      {
+        LASMessage(LAS_VERY_VERBOSE, "  x min %g, max %g, offset %g", scanHeader.cartesianBounds.xMinimum, scanHeader.cartesianBounds.xMaximum, quantizer.x_offset);
+        LASMessage(LAS_VERY_VERBOSE, "  y min %g, max %g, offset %g", scanHeader.cartesianBounds.yMinimum, scanHeader.cartesianBounds.yMaximum, quantizer.y_offset);
+        LASMessage(LAS_VERY_VERBOSE, "  z min %g, max %g, offset %g", scanHeader.cartesianBounds.zMinimum, scanHeader.cartesianBounds.zMaximum, quantizer.z_offset);
+      }
+      output_open = true;
+    }
+
+    for (size_t s = 0; s < sinks.size(); s++)
+    {
+      if (!sinks[s]->begin_scan(scan)) return false;
+    }
+
+    // the duplicate cells are on the grid of the first scan which all later
+    // scans share because they are merged into the same output
+
+    if (remove_duplicates && (duplicates == NULL))
+    {
+      int64_t expected_points = 0;
+      for (size_t index = 0; index < selected_scans.size(); index++)
+      {
+        e57::Data3D header3D;
+        eReader.ReadData3D(selected_scans[index], header3D);
+        expected_points += header3D.pointsSize;
+      }
+      double tolerance[3];
+      tolerance[0] = options.duplicate_tolerance / quantizer.x_scale_factor;
+      tolerance[1] = options.duplicate_tolerance / quantizer.y_scale_factor;
+      tolerance[2] = options.duplicate_tolerance / quantizer.z_scale_factor;
+      duplicates = new LASduplicates();
+      duplicates->init(expected_points, tolerance, (options.temp_file_base ? options.temp_file_base : file_name), (I64)options.duplicate_memory * 1024 * 1024);
+      if (options.duplicate_tolerance > 0.0)
+        LASMessage(LAS_VERBOSE, "  points in a %g meter cell that an earlier scan already had are removed", options.duplicate_tolerance);
+      else
+        LASMessage(LAS_VERBOSE, "  points at a position that an earlier scan already had are removed");
+    }
+
+    // Setup the xyz buffers. inspect the prototype of the compressed vector to find
+    // out whether the coordinates can be decoded into float without any loss
+
+    e57::ImageFile imf = eReader.GetRawIMF();
+    e57::VectorNode data3D = eReader.GetRawData3D();
+    e57::StructureNode scanNode(data3D.get(scanIndex));
+    e57::CompressedVectorNode points(scanNode.get("points"));
+    e57::StructureNode proto(points.prototype());
+
+    // spherical coordinates are converted into cartesian ones in their lanes,
+    // which a float could not hold exactly, so they always use double lanes
+
+    bool single = !spherical && e57_field_decodes_float(proto, "cartesianX") && e57_field_decodes_float(proto, "cartesianY") && e57_field_decodes_float(proto, "cartesianZ");
+
+    if (reproject)
+    {
+      // the projection itself needs double precision input
+      single = false;
+    }
+
+    if (options.statistics)
+    {
+      double rangeMaximum = 0.0;
+      if (spherical)
+      {
+        rangeMaximum = e57_field_max_abs(proto, "sphericalRange");
+        if (scanHeader.sphericalBounds.rangeMaximum < rangeMaximum) rangeMaximum = scanHeader.sphericalBounds.rangeMaximum;
+      }
+      statistics.push_back(new E57statistics());
+      statistics.back()->init(scanIndex + 1, scanHeader.name.c_str(), rangeMaximum);
+    }
+
+    E57passthrough passthrough;
+    bool integers = (!spherical && !reproject && passthrough.setup(proto, affine, &quantizer));
+
+    if (integers)
+    {
+      layout.coordinates = E57_COORDINATES_INTEGER;
+      LASMessage(LAS_VERBOSE, "  cartesian ScaledIntegers are mapped onto the LAS integers without rounding");
+    }
+    else if (single)
+    {
+      layout.coordinates = E57_COORDINATES_FLOAT;
+      LASMessage(LAS_VERBOSE, "  cartesian coordinates are decoded with single precision without loss");
+    }
+    else
+    {
+      layout.coordinates = E57_COORDINATES_DOUBLE;
+    }
+
+    // a sink with a coarser resolution rounds the unrounded coordinates and not
+    // the rounded ones. the integers of the passthrough are exact already
+
+    scan.unrounded = false;
+    for (size_t s = 0; s < sinks.size(); s++)
+    {
+      const F64* scale_factor = sinks[s]->get_scale_factor();
+      if (scale_factor == NULL) scale_factor = options.scale_factor;
+      if ((scale_factor[0] != quantizer.x_scale_factor) || (scale_factor[1] != quantizer.y_scale_factor) || (scale_factor[2] != quantizer.z_scale_factor)) scan.unrounded = !integers;
+    }
+
+    if (!integers && !spherical && proto.isDefined("cartesianX") && (proto.get("cartesianX").type() == e57::E57_SCALED_INTEGER))
+    {
+      LASMessage(LAS_VERY_VERBOSE, "  cartesian ScaledIntegers with scale %g cannot be mapped onto the LAS integers with scale %g", e57::ScaledIntegerNode(proto.get("cartesianX")).scale(), quantizer.x_scale_factor);
+    }
+
+    // a scan that is not cached yet is decoded once with all of its fields.
+    // the fields this conversion needs then come from the mapped columns
+
+    bool cached = false;
+    if (caching)
+    {
+      if (!cache.has_scan(scanIndex))
+      {
+        E57fields all;
+        all.spherical = spherical;
+        all.coordinates = e57_cache_coordinates(proto, spherical);
+        all.invalid_state = (spherical ? scanHeader.pointFields.sphericalInvalidStateField : scanHeader.pointFields.cartesianInvalidStateField);
+        all.intensity = scanHeader.pointFields.intensityField;
+        all.color = scanHeader.pointFields.colorRedField && scanHeader.pointFields.colorGreenField && scanHeader.pointFields.colorBlueField;
+        all.return_index = scanHeader.pointFields.returnIndexField;
+        all.return_count = scanHeader.pointFields.returnCountField;
+        all.time_stamp = scanHeader.pointFields.timeStampField;
+        all.row_column = scanHeader.pointFields.rowIndexField && scanHeader.pointFields.columnIndexField;
+        e57_cache_scan(cache, file_name, imf, scanIndex, all, nSize, options.cores);
+      }
+      cached = cache.map_scan(scanIndex);
+      if (cached)
+      {
+        LASMessage(LAS_VERBOSE, "  %lld points are read from the cache", cache.get_number_points());
+      }
+      else
+      {
+        LASMessage(LAS_WARNING, "scan %d is decoded without the cache '%s'", scanIndex + 1, cache.get_file_name());
+      }
+    }
+
+    // two batches so that the next batch is converted while the sinks write the current one
+
+    if (batch_capacity < (unsigned int)nSize)
+    {
+      if (batch_index) delete[] batch_index;
+      batch_index = new unsigned int[nSize];
+      batch_capacity = nSize;
+    }
+    unsigned int* batchIndex = batch_index;
+    batches[0].alloc(nSize, scan);
+    batches[1].alloc(nSize, scan);
+    int current = 0;
+    double* projectedX = (reproject ? new double[nSize] : NULL);
+    double* projectedY = (reproject ? new double[nSize] : NULL);
+    double* projectedZ = (reproject ? new double[nSize] : NULL);
+
+    // Pick the conversion loop for the fields of this scan
+
+    E57attributes attributes;
+    const double colorOffset[3] = { colorRedOffset, colorGreenOffset, colorBlueOffset };
+    const double colorRange[3] = { colorRedRange, colorGreenRange, colorBlueRange };
+    attributes.setup(layout, intOffset, intRange, colorOffset, colorRange);
+
+    // Setup the reader with one or more packet decoders
+
+    E57reader dataReader;
+    int decoders = (cached ? dataReader.open(&cache, layout, nSize, grid_step, scanHeader.indexBounds.rowMinimum, scanHeader.indexBounds.columnMinimum) : dataReader.open(file_name, imf, scanIndex, layout, nSize, options.cores, grid_step, &scanHeader.indexBounds));
+    if (!cached && (decoders > 1))
+    {
+      LASMessage(LAS_VERBOSE, "  points are decoded from the data packets on %d cores", decoders);
+    }
+
+    // Read the data into the buffers and hand them to the sinks
+
+    unsigned int size;
+    unsigned int number_invalid_points = 0;
+
+    while ((size = dataReader.read()) > 0)
+    {
+      E57fields& fields = dataReader.front();
+
+      // drop the points between the grid steps before any trigonometry, pose,
+      // or quantization. the reader of a cached scan already skipped them and
+      // the packet decoders may have skipped the lines between the steps
+
+      if ((grid_step > 1) && !cached)
+      {
+        size = fields.select(size, grid_step, scanHeader.indexBounds.rowMinimum, scanHeader.indexBounds.columnMinimum, batch_index);
+        if (size == 0) continue;
+        fields.compact(size, batch_index);
+      }
+
+      E57batch& batch = batches[current];
+      I32* batchX = batch.X;
+      I32* batchY = batch.Y;
+      I32* batchZ = batch.Z;
+      current ^= 1;
+
+      // gather the (valid) points of this read into the cartesian buffers
+
+      unsigned int count;
+
+      if (integers)
+        count = passthrough.map(size, fields.isInvalidData, options.include_invalid, fields.rawX, fields.rawY, fields.rawZ, batchIndex, number_invalid_points, batchX, batchY, batchZ);
+      else if (single)
+        count = fields.coordinatesF.gather(size, fields.isInvalidData, options.include_invalid, batchIndex, number_invalid_points);
+      else
+        count = fields.coordinatesD.gather(size, fields.isInvalidData, options.include_invalid, batchIndex, number_invalid_points);
+
+      // pose and global transform matrix in one pass over the batch. the
+      // non-linear reprojection (if any) in a separate pass over the batch
+
+      if (integers)
+      {
+        // already on the LAS grid
+      }
+      else if (reproject || scan.unrounded)
+      {
+        double* x = (scan.unrounded ? batch.x : projectedX);
+        double* y = (scan.unrounded ? batch.y : projectedY);
+        double* z = (scan.unrounded ? batch.z : projectedZ);
+        if (single)
+          affine.transform(count, fields.coordinatesF.x, fields.coordinatesF.y, fields.coordinatesF.z, x, y, z);
+        else
+          affine.transform(count, fields.coordinatesD.x, fields.coordinatesD.y, fields.coordinatesD.z, x, y, z);
+        if (reproject) e57_to_target(geoprojectionconverter, count, x, y, z);
+        e57_quantize(count, x, y, z, &quantizer, batchX, batchY, batchZ);
+      }
+      else if (single)
+      {
+        affine.transform_quantize(count, fields.coordinatesF.x, fields.coordinatesF.y, fields.coordinatesF.z, &quantizer, batchX, batchY, batchZ);
+      }
+      else
+      {
+        affine.transform_quantize(count, fields.coordinatesD.x, fields.coordinatesD.y, fields.coordinatesD.z, &quantizer, batchX, batchY, batchZ);
+      }
+
+      // drop the points whose cell an earlier scan already emitted
+
+      if (remove_duplicates)
+      {
+        count = duplicates->remove(count, batchX, batchY, batchZ, batchIndex, batch.x, batch.y, batch.z);
+      }
+
+      number_points += count;
+
+      // convert the attributes of the batch once for all sinks
+
+      attributes.convert(size, count, batchIndex, fields, batch);
+
+      if (scan.grid)
+      {
+        for (unsigned int j = 0; j < count; j++)
+        {
+          batch.row[j] = fields.rowIndex[batchIndex[j]];
+          batch.column[j] = fields.columnIndex[batchIndex[j]];
+        }
+      }
+
+      batch.count = count;
+      batch.point_source_ID = (U16)(scanIndex + 1);
+
+      if (options.statistics)
+      {
+        statistics.back()->add(&batch);
+        if (spherical)
+        {
+          if (single)
+            statistics.back()->add_ranges(count, fields.coordinatesF.range, batchIndex);
+          else
+            statistics.back()->add_ranges(count, fields.coordinatesD.range, batchIndex);
+        }
+      }
+
+      for (size_t s = 0; s < sinks.size(); s++)
+      {
+        sinks[s]->post(&batch);
+      }
+    }
+
+    for (size_t s = 0; s < sinks.size(); s++)
+    {
+      sinks[s]->finish();
+    }
+
+    if (remove_duplicates)
+    {
+      LASMessage(LAS_VERBOSE, "  %lld points were removed as duplicates of earlier scans", duplicates->get_removed() - number_duplicates);
+      number_duplicates = duplicates->get_removed();
+      duplicates->end_scan();
+    }
+
+    if (options.statistics)
+    {
+      statistics.back()->done(number_invalid_points, &quantizer);
+      scan.statistics = &statistics.back()->record;
+    }
+
+    bool ended = true;
+    for (size_t s = 0; s < sinks.size(); s++)
+    {
+      if (!sinks[s]->end_scan(scan)) ended = false;
+    }
+    if (scan.last)
+    {
+      output_open = false;
+    }
+
+    if (number_invalid_points)
+    {
+      LASMessage(LAS_VERBOSE, "  %u invalid points were %s", number_invalid_points, (options.include_invalid ? "included" : "omitted"));
+      this->number_invalid_points += number_invalid_points;
+    }
+
+    // Close the reader and clean up the buffer.
+
+    dataReader.close();
+    if (cached) cache.unmap();
+
+    if (projectedX) delete[] projectedX;
+    if (projectedY) delete[] projectedY;
+    if (projectedZ) delete[] projectedZ;
+
+    if (idElementValue) delete[] idElementValue;
+    if (startPointIndex) delete[] startPointIndex;
+    if (pointCount) delete[] pointCount;
+
+    if (!ended) return false;
+  } // for
+
+  if (this->number_invalid_points)
+  {
+    LASMessage(LAS_VERBOSE, "scan%s of '%s' contain%s %lld invalid points that were %s", (data3DCount > 1 ? "s" : ""), file_name, (data3DCount == 1 ? "s" : ""), this->number_invalid_points, (options.include_invalid ? "included" : "omitted"));
+  }
+
+  if (number_duplicates)
+  {
+    LASMessage(LAS_VERBOSE, "removed a total of %lld points as duplicates", number_duplicates);
+  }
+
+  LASMessage(LAS_VERBOSE, "written a total %lld points", number_points);
+
+  return true;
+}
+
+const E57statisticsRecord* E57ToLasConverter::get_statistics(int i) const
+{
+  if ((i < 0) || (i >= (int)statistics.size())) return NULL;
+  return &statistics[i]->record;
+}
+
+bool E57ToLasConverter::write_statistics_json(const char* file_name) const
+{
+  FILE* file = LASfopen(file_name, "w");
+  if (file == 0)
+  {
+    LASMessage(LAS_WARNING, "cannot open '%s' for the statistics", file_name);
+    return false;
+  }
+  fprintf(file, "{\n\"file\": ");
+  E57statistics::write_json_string(file, this->file_name.c_str());
+  fprintf(file, ",\n\"scans\": [\n");
+  for (size_t s = 0; s < statistics.size(); s++)
+  {
+    statistics[s]->write_json(file, (s + 1) == statistics.size());
+  }
+  fprintf(file, "]\n}\n");
+  fclose(file);
+  LASMessage(LAS_VERBOSE, "statistics of %d scan%s written to '%s'", (int)statistics.size(), (statistics.size() == 1 ? "" : "s"), file_name);
+  return true;
+}
+
+void E57ToLasConverter::clean_statistics()
+{
+  for (size_t s = 0; s < statistics.size(); s++) delete statistics[s];
+  statistics.clear();
+}
+
+E57ToLasConverter::E57ToLasConverter(const E57ToLasOptions& options)
+{
+  this->options = options;
+  duplicates = NULL;
+  batch_index = NULL;
+  batch_capacity = 0;
+  number_points = 0;
+  number_invalid_points = 0;
+  number_duplicates = 0;
+}
+
+E57ToLasConverter::~E57ToLasConverter()
+{
+  clean_statistics();
+  if (duplicates) delete duplicates;
+  if (batch_index) delete[] batch_index;
+}
@@ -0,0 +1,325 @@
+// e57tolasconverter.hpp : converts the scans of an E57 file into batches of LAS points.
+
+#ifndef E57_TO_LAS_CONVERTER_HPP
+#define E57_TO_LAS_CONVERTER_HPP
+
+#include <E57Simple.h>
+
+#include "lasdefinitions.hpp"
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+class GeoProjectionConverter;
+class LASduplicates;
+class E57statistics;
+
+// the statistics of one scan that are gathered from the converted batches while
+// they pass by. the record has a fixed size so that a file sink can reserve a
+// VLR for it when the header is written and fill it in once the file is closed
+
+#define E57_STATISTICS_BINS 256
+
+#define E57_STATISTICS_INTENSITY 1
+#define E57_STATISTICS_COLOR 2
+#define E57_STATISTICS_RETURNS 4
+#define E57_STATISTICS_RANGE 8
+
+struct E57statisticsRecord {
+  U16 version;
+  U16 flags;
+  U32 scan;
+  I64 number_of_points;
+  I64 number_of_invalid_points;
+  F64 min[3];
+  F64 max[3];
+  F64 mean[3];
+  F64 range_bin_size;
+  U32 intensity[E57_STATISTICS_BINS];
+  U32 red[E57_STATISTICS_BINS];
+  U32 green[E57_STATISTICS_BINS];
+  U32 blue[E57_STATISTICS_BINS];
+  U32 range[E57_STATISTICS_BINS];
+  U32 return_number[16];
+  U32 number_of_returns[16];
+};
+
+// what the sinks are told about the scan whose batches follow
+
+struct E57scan {
+  // the E57 file and this scan [0..n-1] of its n scans
+  const char* file_name;
+  int index;
+  int number_scans;
+  // an output starts with the 'first' scan and ends with the 'last' scan. all
+  // scans from 'output_scans' go into it (one scan unless they are merged)
+  bool merged;
+  bool first;
+  bool last;
+  std::vector<int> output_scans;
+  const e57::Data3D* header;
+  bool spherical;
+  // the fields of the batches
+  bool intensity;
+  bool color;
+  bool return_index;
+  bool return_count;
+  bool time_stamp;
+  // the row and column of each point of a structured scan
+  bool grid;
+  // scale and offset of the integer coordinates of the batches
+  LASquantizer quantizer;
+  // whether the batches also carry the unrounded coordinates
+  bool unrounded;
+  // the projection of the points (if any) and whether they were reprojected
+  GeoProjectionConverter* geoprojectionconverter;
+  bool reprojected;
+  // where the scanner stood in the coordinates of the points
+  F64 origin[3];
+  int cores;
+  // only set when the scan ends and statistics are gathered
+  const E57statisticsRecord* statistics;
+};
+
+// the converted points of one read that all sinks share. the coordinates
+// are quantized with the finest resolution of all sinks. a sink with a
+// coarser resolution quantizes the unrounded coordinates that come along
+// (unless they are exact on the finest grid) so that its points are the
+// same as if it were the only sink. the arrays of the fields that the scan
+// does not have are NULL
+
+class E57batch {
+public:
+  // the buffers only grow so that they are reused from scan to scan
+  void alloc(unsigned int size, const E57scan& scan)
+  {
+    if (size > capacity) clean();
+    if (X == NULL)
+    {
+      X = new I32[size];
+      Y = new I32[size];
+      Z = new I32[size];
+      capacity = size;
+    }
+    if (scan.unrounded && (buffer_xyz == NULL)) buffer_xyz = new F64[3 * capacity];
+    x = (scan.unrounded ? buffer_xyz : NULL);
+    y = (scan.unrounded ? buffer_xyz + capacity : NULL);
+    z = (scan.unrounded ? buffer_xyz + 2 * capacity : NULL);
+    if (scan.intensity && (buffer_intensity == NULL)) buffer_intensity = new U16[capacity];
+    if (scan.color && (buffer_rgb == NULL)) buffer_rgb = new U16[3 * capacity];
+    if (scan.return_index && (buffer_return_number == NULL)) buffer_return_number = new U8[capacity];
+    if (scan.return_count && (buffer_number_of_returns == NULL)) buffer_number_of_returns = new U8[capacity];
+    if (scan.time_stamp && (buffer_gps_time == NULL)) buffer_gps_time = new F64[capacity];
+    if (scan.grid && (buffer_row_column == NULL)) buffer_row_column = new I32[2 * capacity];
+    intensity = (scan.intensity ? buffer_intensity : NULL);
+    red = (scan.color ? buffer_rgb : NULL);
+    green = (scan.color ? buffer_rgb + capacity : NULL);
+    blue = (scan.color ? buffer_rgb + 2 * capacity : NULL);
+    return_number = (scan.return_index ? buffer_return_number : NULL);
+    number_of_returns = (scan.return_count ? buffer_number_of_returns : NULL);
+    gps_time = (scan.time_stamp ? buffer_gps_time : NULL);
+    row = (scan.grid ? buffer_row_column : NULL);
+    column = (scan.grid ? buffer_row_column + capacity : NULL);
+  };
+  void clean()
+  {
+    if (X) delete[] X;
+    if (Y) delete[] Y;
+    if (Z) delete[] Z;
+    if (buffer_xyz) delete[] buffer_xyz;
+    if (buffer_intensity) delete[] buffer_intensity;
+    if (buffer_rgb) delete[] buffer_rgb;
+    if (buffer_return_number) delete[] buffer_return_number;
+    if (buffer_number_of_returns) delete[] buffer_number_of_returns;
+    if (buffer_gps_time) delete[] buffer_gps_time;
+    if (buffer_row_column) delete[] buffer_row_column;
+    X = Y = Z = NULL;
+    x = y = z = buffer_xyz = NULL;
+    intensity = red = green = blue = buffer_intensity = buffer_rgb = NULL;
+    return_number = number_of_returns = buffer_return_number = buffer_number_of_returns = NULL;
+    gps_time = buffer_gps_time = NULL;
+    row = column = buffer_row_column = NULL;
+    capacity = 0;
+    count = 0;
+  };
+  E57batch()
+  {
+    X = Y = Z = NULL;
+    x = y = z = buffer_xyz = NULL;
+    intensity = red = green = blue = buffer_intensity = buffer_rgb = NULL;
+    return_number = number_of_returns = buffer_return_number = buffer_number_of_returns = NULL;
+    gps_time = buffer_gps_time = NULL;
+    row = column = buffer_row_column = NULL;
+    capacity = 0;
+    count = 0;
+    point_source_ID = 0;
+  };
+  ~E57batch()
+  {
+    clean();
+  };
+  unsigned int count;
+  U16 point_source_ID;
+  I32* X;
+  I32* Y;
+  I32* Z;
+  F64* x;
+  F64* y;
+  F64* z;
+  U16* intensity;
+  U16* red;
+  U16* green;
+  U16* blue;
+  U8* return_number;
+  U8* number_of_returns;
+  F64* gps_time;
+  I32* row;
+  I32* column;
+private:
+  unsigned int capacity;
+  F64* buffer_xyz;
+  U16* buffer_intensity;
+  U16* buffer_rgb;
+  U8* buffer_return_number;
+  U8* buffer_number_of_returns;
+  F64* buffer_gps_time;
+  I32* buffer_row_column;
+};
+
+// receives the converted batches. the file outputs of e572las are sinks and
+// so can be anything that wants the points in-process. with several sinks
+// each one writes on its own thread off the shared batch so that the slowest
+// sink and not the sum of all sinks sets the pace
+
+class E57sink {
+public:
+  // adds the fields that this sink needs. fields no sink needs are not decoded
+  virtual void needs(bool& intensity, bool& color, bool& returns, bool& time) const
+  {
+    intensity = color = returns = time = true;
+  };
+  // whether this sink needs the row and column of the points of structured scans
+  virtual bool needs_grid() const { return false; };
+  // the resolution this sink wants or NULL for the one of the options
+  virtual const F64* get_scale_factor() const { return NULL; };
+  // called before the first batch of each scan. an output starts with 'first'
+  virtual bool begin_scan(const E57scan& scan) { return true; };
+  virtual void write(const E57batch* batch) = 0;
+  // called once all batches of the scan were written. an output ends with 'last'
+  virtual bool end_scan(const E57scan& scan) { return true; };
+
+  void start();
+  // hands a batch to the thread of the sink once it is done with the previous one
+  void post(const E57batch* batch);
+  void finish();
+  void stop();
+  E57sink();
+  virtual ~E57sink();
+private:
+  void run();
+  std::thread thread;
+  std::mutex mutex;
+  std::condition_variable condition;
+  const E57batch* pending;
+  bool quit;
+};
+
+struct E57ToLasOptions {
+  bool merge_scans;
+  bool apply_quaternion;
+  bool apply_translation;
+  bool include_invalid;
+  // r11 r12 r13 r21 r22 r23 r31 r32 r33 tr1 tr2 tr3 applied after the pose
+  bool apply_transform_matrix;
+  F64 transform_matrix[12];
+  // for the sinks that do not ask for their own resolution
+  F64 scale_factor[3];
+  // the same offset for all outputs (e.g. of pieces that are merged later)
+  bool has_offset;
+  F64 offset[3];
+  int cores;
+  bool drop_intensity;
+  bool drop_color;
+  bool remove_duplicates;
+  F64 duplicate_tolerance;
+  // megabytes of duplicate cells (and their Bloom filter) kept in memory
+  int duplicate_memory;
+  // where the duplicate cells are spilled to (default is next to the E57 file)
+  const char* temp_file_base;
+  bool statistics;
+  // keeps the decoded scans in a sidecar file (next to the E57 file or in 'cache_dir')
+  bool cache;
+  const char* cache_dir;
+  // just these scans [1..n]
+  std::vector<int> scans;
+  // just every n-th row and column of structured scans
+  int grid_step;
+  // reprojects when it has a source and a target projection
+  GeoProjectionConverter* geoprojectionconverter;
+  E57ToLasOptions()
+  {
+    merge_scans = true;
+    apply_quaternion = true;
+    apply_translation = true;
+    include_invalid = false;
+    apply_transform_matrix = false;
+    for (int i = 0; i < 12; i++) transform_matrix[i] = ((i == 0) || (i == 4) || (i == 8) ? 1.0 : 0.0);
+    scale_factor[0] = scale_factor[1] = scale_factor[2] = 0.001;
+    has_offset = false;
+    offset[0] = offset[1] = offset[2] = 0.0;
+    cores = 1;
+    drop_intensity = false;
+    drop_color = false;
+    remove_duplicates = false;
+    duplicate_tolerance = 0.0;
+    duplicate_memory = 2048;
+    temp_file_base = 0;
+    statistics = false;
+    cache = false;
+    cache_dir = 0;
+    grid_step = 1;
+    geoprojectionconverter = 0;
+  };
+};
+
+// reads the scans of an E57 file and hands the converted points to the sinks.
+// one converter can convert one file after another and keeps its buffers
+
+class E57ToLasConverter {
+public:
+  // the sinks are not owned by the converter
+  void add_sink(E57sink* sink);
+  void remove_sinks();
+  // returns the number of scans or -1 if the file cannot be opened
+  static int count_scans(const char* file_name);
+  // converts all (or the selected) scans. returns false after an error
+  bool convert(const char* file_name);
+  I64 get_number_points() const { return number_points; };
+  I64 get_number_invalid_points() const { return number_invalid_points; };
+  I64 get_number_duplicates() const { return number_duplicates; };
+  // the statistics of the scans of the last conversion
+  int get_number_statistics() const { return (int)statistics.size(); };
+  const E57statisticsRecord* get_statistics(int i) const;
+  bool write_statistics_json(const char* file_name) const;
+  E57ToLasConverter(const E57ToLasOptions& options);
+  ~E57ToLasConverter();
+  E57ToLasOptions options;
+private:
+  bool convert_scans(const char* file_name);
+  void clean_statistics();
+  std::string file_name;
+  std::vector<E57sink*> sinks;
+  std::vector<E57statistics*> statistics;
+  LASduplicates* duplicates;
+  E57batch batches[2];
+  unsigned int* batch_index;
+  unsigned int batch_capacity;
+  I64 number_points;
+  I64 number_invalid_points;
+  I64 number_duplicates;
+};
+
+#endif
@@ -0,0 +1,395 @@
+// e57watcher.cpp : converts the E57 files that are dropped into a directory.
+
+#include "e57watcher.hpp"
+
+#include <chrono>
+#include <cctype>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+std::atomic<bool> E57watcher::stopping(false);
+
+// only the files that end with ".e57" are converted. temporary files of a
+// copy (e.g. ".campus.e57.Xa3f" of rsync) are picked up once they are renamed
+
+static bool e57_is_e57(const char* name)
+{
+  size_t length = strlen(name);
+  if ((length < 5) || (name[0] == '.')) return false;
+  const char* suffix = name + length - 4;
+  return (suffix[0] == '.') && (tolower(suffix[1]) == 'e') && (suffix[2] == '5') && (suffix[3] == '7');
+}
+
+static void e57_write_json_string(FILE* file, const char* string)
+{
+  fputc('"', file);
+  for (const char* c = string; *c; c++)
+  {
+    if ((*c == '"') || (*c == '\\')) fputc('\\', file);
+    if ((unsigned char)*c >= 32) fputc(*c, file);
+  }
+  fputc('"', file);
+}
+
+// the size and modification time of a regular file
+
+bool E57watcher::get_stamp(const std::string& file_name, E57stamp& stamp)
+{
+  struct stat status;
+  if ((stat(file_name.c_str(), &status) != 0) || ((status.st_mode & S_IFMT) != S_IFREG)) return false;
+  stamp.size = (I64)status.st_size;
+  stamp.modification_time = (I64)status.st_mtime;
+  return true;
+}
+
+void E57watcher::stop()
+{
+  stopping = true;
+}
+
+bool E57watcher::watch(const char* directory, const char* status_file_name)
+{
+#ifdef __linux__
+  int descriptor = inotify_init1(IN_CLOEXEC);
+  if (descriptor < 0)
+  {
+    LASMessage(LAS_ERROR, "cannot watch '%s': %s", directory, strerror(errno));
+    return false;
+  }
+  if (inotify_add_watch(descriptor, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+  {
+    LASMessage(LAS_ERROR, "cannot watch '%s': %s", directory, strerror(errno));
+    close(descriptor);
+    return false;
+  }
+
+  this->directory = directory;
+  while ((this->directory.size() > 1) && (this->directory.back() == '/')) this->directory.pop_back();
+  this->status_file_name = (status_file_name ? status_file_name : this->directory + "/e572las_status.json");
+  start_time = (I64)time(0);
+
+  LASMessage(LAS_INFO, "watching '%s' with %d worker%s. status in '%s'", directory, number_workers, (number_workers == 1 ? "" : "s"), this->status_file_name.c_str());
+
+  // the sinks of all workers are created up front so that a bad output
+  // option fails right away
+
+  sinks.resize(number_workers);
+  for (int w = 0; w < number_workers; w++)
+  {
+    if (!factory(sinks[w]))
+    {
+      LASMessage(LAS_ERROR, "cannot create the outputs of worker %d", w + 1);
+      close(descriptor);
+      return false;
+    }
+  }
+
+  // the files that were dropped while no one was watching
+
+  scan_directory();
+
+  for (int w = 0; w < number_workers; w++)
+  {
+    threads.push_back(std::thread(&E57watcher::work, this, w));
+  }
+
+  alignas(struct inotify_event) char buffer[4096];
+  I64 status_time = 0;
+  while (!stopping)
+  {
+    struct pollfd events;
+    events.fd = descriptor;
+    events.events = POLLIN;
+    events.revents = 0;
+    int ready = poll(&events, 1, 1000);
+    if (ready > 0)
+    {
+      ssize_t length = read(descriptor, buffer, sizeof(buffer));
+      for (ssize_t offset = 0; offset < length; )
+      {
+        const struct inotify_event* event = (const struct inotify_event*)(buffer + offset);
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+          // events were lost. the files that are unchanged are not converted again
+          scan_directory();
+        }
+        else if ((event->len > 0) && !(event->mask & IN_ISDIR) && e57_is_e57(event->name))
+        {
+          add(this->directory + "/" + event->name);
+        }
+        offset += sizeof(struct inotify_event) + event->len;
+      }
+    }
+    else if ((ready < 0) && (errno != EINTR))
+    {
+      LASMessage(LAS_ERROR, "watching '%s': %s", directory, strerror(errno));
+      stopping = true;
+    }
+    if ((I64)time(0) != status_time)
+    {
+      status_time = (I64)time(0);
+      settle();
+      write_status();
+    }
+  }
+  close(descriptor);
+
+  // the workers finish the files they are converting
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    LASMessage(LAS_INFO, "stopped watching '%s'. finishing %d running conversion%s ...", directory, busy, (busy == 1 ? "" : "s"));
+    condition.notify_all();
+  }
+  for (size_t w = 0; w < threads.size(); w++)
+  {
+    threads[w].join();
+  }
+  threads.clear();
+  write_status();
+  return true;
+#else
+  LASMessage(LAS_ERROR, "'-watch' needs inotify and is only available on Linux");
+  return false;
+#endif
+}
+
+// a file that is found in the directory (and not reported closed by inotify)
+// may still be copied. it is only queued once its size and modification time
+// stayed the same for E57_WATCH_SETTLE_SECONDS
+
+void E57watcher::scan_directory()
+{
+#ifdef __linux__
+  DIR* dir = opendir(directory.c_str());
+  if (dir == 0) return;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != 0)
+  {
+    if (e57_is_e57(entry->d_name))
+    {
+      std::string file_name = directory + "/" + entry->d_name;
+      E57stamp stamp;
+      if (get_stamp(file_name, stamp) && (settling.count(file_name) == 0))
+      {
+        settling[file_name] = std::make_pair(stamp, (I64)time(0));
+      }
+    }
+  }
+  closedir(dir);
+#endif
+}
+
+void E57watcher::settle()
+{
+  I64 now = (I64)time(0);
+  std::map<std::string, std::pair<E57stamp, I64> >::iterator it = settling.begin();
+  while (it != settling.end())
+  {
+    E57stamp stamp;
+    if (!get_stamp(it->first, stamp))
+    {
+      it = settling.erase(it);
+    }
+    else if (!(stamp == it->second.first))
+    {
+      // still written
+      it->second = std::make_pair(stamp, now);
+      it++;
+    }
+    else if ((now - it->second.second) >= E57_WATCH_SETTLE_SECONDS)
+    {
+      std::string file_name = it->first;
+      it = settling.erase(it);
+      add(file_name);
+    }
+    else
+    {
+      it++;
+    }
+  }
+}
+
+void E57watcher::add(const std::string& file_name)
+{
+  E57stamp stamp;
+  if (!get_stamp(file_name, stamp)) return;
+  // its writer closed it
+  settling.erase(file_name);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  std::map<std::string, E57stamp>::iterator done = converted.find(file_name);
+  if ((done != converted.end()) && (done->second == stamp)) return;
+  std::map<std::string, I64>::iterator waiting = queued.find(file_name);
+  if (waiting != queued.end())
+  {
+    // written again before it was converted
+    queue.erase(std::make_pair(waiting->second, file_name));
+    queued.erase(waiting);
+  }
+  queue.insert(std::make_pair(stamp.size, file_name));
+  queued[file_name] = stamp.size;
+  LASMessage(LAS_VERBOSE, "queued '%s' with %lld bytes (%d queued)", file_name.c_str(), stamp.size, (int)queue.size());
+  condition.notify_one();
+}
+
+// the smallest file that no other worker is converting right now
+
+std::set<std::pair<I64, std::string> >::iterator E57watcher::next()
+{
+  std::set<std::pair<I64, std::string> >::iterator it = queue.begin();
+  while ((it != queue.end()) && converting.count(it->second)) it++;
+  return it;
+}
+
+void E57watcher::work(int worker)
+{
+  // the converter and the sinks of a worker keep their buffers from file to file
+
+  E57ToLasConverter converter(options);
+  for (size_t s = 0; s < sinks[worker].size(); s++)
+  {
+    converter.add_sink(sinks[worker][s]);
+  }
+
+  while (true)
+  {
+    std::string file_name;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      condition.wait(lock, [this] { return stopping || (next() != queue.end()); });
+      if (stopping) break;
+      std::set<std::pair<I64, std::string> >::iterator it = next();
+      file_name = it->second;
+      queue.erase(it);
+      queued.erase(file_name);
+      converting.insert(file_name);
+      busy++;
+    }
+
+    struct stat status;
+    E57stamp stamp;
+    stamp.size = stamp.modification_time = 0;
+    if (stat(file_name.c_str(), &status) == 0)
+    {
+      stamp.size = (I64)status.st_size;
+      stamp.modification_time = (I64)status.st_mtime;
+    }
+
+    LASMessage(LAS_INFO, "worker %d converts '%s'", worker + 1, file_name.c_str());
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+    bool success = converter.convert(file_name.c_str());
+    F64 seconds = std::chrono::duration<F64>(std::chrono::steady_clock::now() - begin).count();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      converting.erase(file_name);
+      busy--;
+      seconds_converting += seconds;
+      if (success)
+      {
+        number_files++;
+        number_points += converter.get_number_points();
+        number_bytes += stamp.size;
+      }
+      else
+      {
+        number_failed++;
+      }
+      // a file that failed is only tried again once it was written again
+      converted[file_name] = stamp;
+      // another worker may wait for a file this worker was converting
+      condition.notify_all();
+    }
+    if (success)
+      LASMessage(LAS_INFO, "worker %d converted %lld points of '%s' in %.1f seconds", worker + 1, converter.get_number_points(), file_name.c_str(), seconds);
+    else
+      LASMessage(LAS_WARNING, "worker %d failed to convert '%s'", worker + 1, file_name.c_str());
+  }
+
+  converter.remove_sinks();
+}
+
+// the status file is replaced in one rename so that a reader never sees half of it
+
+bool E57watcher::write_status()
+{
+  std::string temp_file_name = status_file_name + ".tmp";
+  FILE* file = LASfopen(temp_file_name.c_str(), "w");
+  if (file == 0)
+  {
+    LASMessage(LAS_WARNING, "cannot write status '%s'", temp_file_name.c_str());
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    I64 queued_bytes = 0;
+    for (std::set<std::pair<I64, std::string> >::const_iterator it = queue.begin(); it != queue.end(); it++) queued_bytes += it->first;
+    I64 uptime = (I64)time(0) - start_time;
+    fprintf(file, "{\n");
+    fprintf(file, "  \"directory\": ");
+    e57_write_json_string(file, directory.c_str());
+    fprintf(file, ",\n");
+    fprintf(file, "  \"workers\": %d,\n", number_workers);
+    fprintf(file, "  \"busy_workers\": %d,\n", busy);
+    fprintf(file, "  \"queue_depth\": %d,\n", (int)queue.size());
+    fprintf(file, "  \"queued_bytes\": %lld,\n", queued_bytes);
+    fprintf(file, "  \"converted_files\": %lld,\n", number_files);
+    fprintf(file, "  \"failed_files\": %lld,\n", number_failed);
+    fprintf(file, "  \"converted_points\": %lld,\n", number_points);
+    fprintf(file, "  \"converted_bytes\": %lld,\n", number_bytes);
+    fprintf(file, "  \"uptime_seconds\": %lld,\n", uptime);
+    fprintf(file, "  \"files_per_hour\": %.1f,\n", (uptime ? 3600.0 * number_files / uptime : 0.0));
+    fprintf(file, "  \"points_per_second\": %.0f,\n", (uptime ? (F64)number_points / uptime : 0.0));
+    fprintf(file, "  \"megabytes_per_second\": %.2f,\n", (uptime ? number_bytes / 1048576.0 / uptime : 0.0));
+    fprintf(file, "  \"seconds_converting\": %.1f\n", seconds_converting);
+    fprintf(file, "}\n");
+  }
+  bool written = (fclose(file) == 0);
+  if (!written || (rename(temp_file_name.c_str(), status_file_name.c_str()) != 0))
+  {
+    LASMessage(LAS_WARNING, "cannot write status '%s'", status_file_name.c_str());
+    return false;
+  }
+  return true;
+}
+
+E57watcher::E57watcher(const E57ToLasOptions& options, const E57sinkfactory& factory, int number_workers) : options(options), factory(factory)
+{
+  this->number_workers = (number_workers > 0 ? number_workers : 1);
+  busy = 0;
+  number_files = 0;
+  number_failed = 0;
+  number_points = 0;
+  number_bytes = 0;
+  seconds_converting = 0.0;
+  start_time = 0;
+  stopping = false;
+}
+
+E57watcher::~E57watcher()
+{
+  stop();
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    condition.notify_all();
+  }
+  for (size_t w = 0; w < threads.size(); w++)
+  {
+    threads[w].join();
+  }
+  for (size_t w = 0; w < sinks.size(); w++)
+  {
+    for (size_t s = 0; s < sinks[w].size(); s++) delete sinks[w][s];
+  }
+}
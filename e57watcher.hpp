@@ -0,0 +1,83 @@
+// e57watcher.hpp : converts the E57 files that are dropped into a directory.
+
+#ifndef E57_WATCHER_HPP
+#define E57_WATCHER_HPP
+
+#include "e57tolasconverter.hpp"
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <atomic>
+#include <functional>
+
+// with '-watch' e572las stays up as a daemon that converts every E57 file
+// that appears in a directory. inotify reports a file once its writer closed
+// it (or once it was renamed into the directory) and the file is queued with
+// its size. a pool of workers, each with its own converter and its own sinks
+// that keep their buffers from file to file, converts the smallest file of
+// the queue first. the queue depth and the throughput are written into a
+// small JSON status file every second
+
+// the files that are already in the directory are queued once they stopped changing
+
+#define E57_WATCH_SETTLE_SECONDS 2
+
+// creates the sinks of one worker. the watcher deletes them (also after a failure)
+
+typedef std::function<bool(std::vector<E57sink*>& sinks)> E57sinkfactory;
+
+class E57watcher
+{
+public:
+  // converts the E57 files of 'directory' until stop() is called. returns
+  // false if the directory cannot be watched
+  bool watch(const char* directory, const char* status_file_name);
+  // may be called from a signal handler. running conversions are finished
+  static void stop();
+  E57watcher(const E57ToLasOptions& options, const E57sinkfactory& factory, int number_workers);
+  ~E57watcher();
+private:
+  // a file is converted again only if its size or modification time changed
+  struct E57stamp
+  {
+    I64 size;
+    I64 modification_time;
+    bool operator == (const E57stamp& stamp) const { return (size == stamp.size) && (modification_time == stamp.modification_time); };
+  };
+  static bool get_stamp(const std::string& file_name, E57stamp& stamp);
+  void scan_directory();
+  void settle();
+  void add(const std::string& file_name);
+  void work(int worker);
+  std::set<std::pair<I64, std::string> >::iterator next();
+  bool write_status();
+  E57ToLasOptions options;
+  E57sinkfactory factory;
+  int number_workers;
+  std::string directory;
+  std::string status_file_name;
+  std::vector<std::thread> threads;
+  std::vector<std::vector<E57sink*> > sinks;
+  std::mutex mutex;
+  std::condition_variable condition;
+  // smallest file first
+  std::set<std::pair<I64, std::string> > queue;
+  std::map<std::string, I64> queued;
+  std::set<std::string> converting;
+  std::map<std::string, E57stamp> converted;
+  // the files found in the directory with their stamp and since when they have it
+  std::map<std::string, std::pair<E57stamp, I64> > settling;
+  // the counters of the status file
+  int busy;
+  I64 number_files;
+  I64 number_failed;
+  I64 number_points;
+  I64 number_bytes;
+  F64 seconds_converting;
+  I64 start_time;
+  static std::atomic<bool> stopping;
+};
+
+#endif
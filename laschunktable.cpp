@@ -0,0 +1,155 @@
+// laschunktable.cpp : reads and writes the chunk table of a LAZ file.
+
+#include "laschunktable.hpp"
+
+#include "bytestreamin.hpp"
+#include "bytestreamout.hpp"
+#include "arithmeticdecoder.hpp"
+#include "arithmeticencoder.hpp"
+#include "integercompressor.hpp"
+
+BOOL LASchunktable::read(ByteStreamIn* stream, I64 offset_to_point_data, U32 chunk_size, I64 number_of_point_records)
+{
+  clean();
+
+  try
+  {
+    I64 chunk_table_start_position;
+    if (!stream->seek(offset_to_point_data)) return FALSE;
+    stream->get64bitsLE((U8*)&chunk_table_start_position);
+    chunk_start = offset_to_point_data + 8;
+
+    // a writer that could not seek appended the pointer to the end of the file
+
+    if (chunk_table_start_position == -1)
+    {
+      if (!stream->seekEnd(8)) return FALSE;
+      stream->get64bitsLE((U8*)&chunk_table_start_position);
+    }
+
+    if (!stream->seek(chunk_table_start_position)) return FALSE;
+
+    U32 version;
+    stream->get32bitsLE((U8*)&version);
+    if (version != 0) return FALSE;
+
+    U32 number;
+    stream->get32bitsLE((U8*)&number);
+
+    if (number)
+    {
+      chunk_sizes = new U32[number];
+      chunk_bytes = new U32[number];
+      alloced_chunks = number;
+
+      ArithmeticDecoder dec;
+      dec.init(stream);
+      IntegerCompressor ic(&dec, 32, 2);
+      ic.initDecompressor();
+      for (U32 i = 0; i < number; i++)
+      {
+        if (chunk_size == U32_MAX)
+        {
+          chunk_sizes[i] = (U32)ic.decompress((i ? chunk_sizes[i - 1] : 0), 0);
+        }
+        else
+        {
+          chunk_sizes[i] = chunk_size;
+        }
+        chunk_bytes[i] = (U32)ic.decompress((i ? chunk_bytes[i - 1] : 0), 1);
+      }
+      dec.done();
+
+      // with fixed chunks the last chunk holds the remaining points
+
+      if ((chunk_size != U32_MAX) && number_of_point_records)
+      {
+        chunk_sizes[number - 1] = (U32)(number_of_point_records - (I64)(number - 1) * chunk_size);
+      }
+    }
+    number_chunks = number;
+  }
+  catch (...)
+  {
+    clean();
+    return FALSE;
+  }
+  return TRUE;
+}
+
+BOOL LASchunktable::write(ByteStreamOut* stream, I64 chunk_table_pointer, BOOL variable) const
+{
+  I64 position = stream->tell();
+
+  if (chunk_table_pointer >= 0)
+  {
+    if (!stream->seek(chunk_table_pointer)) return FALSE;
+    if (!stream->put64bitsLE((const U8*)&position)) return FALSE;
+    if (!stream->seek(position)) return FALSE;
+  }
+
+  U32 version = 0;
+  if (!stream->put32bitsLE((const U8*)&version)) return FALSE;
+  if (!stream->put32bitsLE((const U8*)&number_chunks)) return FALSE;
+
+  if (number_chunks)
+  {
+    ArithmeticEncoder enc;
+    enc.init(stream);
+    IntegerCompressor ic(&enc, 32, 2);
+    ic.initCompressor();
+    for (U32 i = 0; i < number_chunks; i++)
+    {
+      if (variable) ic.compress((i ? chunk_sizes[i - 1] : 0), chunk_sizes[i], 0);
+      ic.compress((i ? chunk_bytes[i - 1] : 0), chunk_bytes[i], 1);
+    }
+    enc.done();
+  }
+  return TRUE;
+}
+
+void LASchunktable::add(U32 points, U32 bytes)
+{
+  if (number_chunks == alloced_chunks)
+  {
+    U32 alloc = (alloced_chunks ? 2 * alloced_chunks : 256);
+    U32* sizes = new U32[alloc];
+    U32* bytes_new = new U32[alloc];
+    if (number_chunks)
+    {
+      memcpy(sizes, chunk_sizes, number_chunks * sizeof(U32));
+      memcpy(bytes_new, chunk_bytes, number_chunks * sizeof(U32));
+    }
+    if (chunk_sizes) delete[] chunk_sizes;
+    if (chunk_bytes) delete[] chunk_bytes;
+    chunk_sizes = sizes;
+    chunk_bytes = bytes_new;
+    alloced_chunks = alloc;
+  }
+  chunk_sizes[number_chunks] = points;
+  chunk_bytes[number_chunks] = bytes;
+  number_chunks++;
+}
+
+void LASchunktable::clean()
+{
+  if (chunk_sizes) delete[] chunk_sizes;
+  if (chunk_bytes) delete[] chunk_bytes;
+  chunk_sizes = 0;
+  chunk_bytes = 0;
+  number_chunks = 0;
+  alloced_chunks = 0;
+  chunk_start = 0;
+}
+
+LASchunktable::LASchunktable()
+{
+  chunk_sizes = 0;
+  chunk_bytes = 0;
+  clean();
+}
+
+LASchunktable::~LASchunktable()
+{
+  clean();
+}
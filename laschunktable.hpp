@@ -0,0 +1,39 @@
+// laschunktable.hpp : reads and writes the chunk table of a LAZ file.
+
+#ifndef LAS_CHUNK_TABLE_HPP
+#define LAS_CHUNK_TABLE_HPP
+
+#include "mydefs.hpp"
+
+class ByteStreamIn;
+class ByteStreamOut;
+
+// every LAZ chunk is compressed independently of all other chunks. with the
+// chunk table at hand the compressed bytes of a chunk can therefore be copied
+// from one LAZ file into another without decompressing a single point. this is
+// the same table that LASzip writes in LASwritePoint::write_chunk_table()
+
+class LASchunktable
+{
+public:
+  // reads the chunk table of the LAZ points that start at 'offset_to_point_data'.
+  // the points per chunk are only stored for variable chunks (chunk_size U32_MAX)
+  // and are otherwise derived from 'chunk_size' and 'number_of_point_records'
+  BOOL read(ByteStreamIn* stream, I64 offset_to_point_data, U32 chunk_size = U32_MAX, I64 number_of_point_records = 0);
+  // writes the chunk table at the current position of the stream and patches the
+  // chunk table pointer at 'chunk_table_pointer' (which is where the points start)
+  BOOL write(ByteStreamOut* stream, I64 chunk_table_pointer, BOOL variable = TRUE) const;
+  void add(U32 points, U32 bytes);
+  void clean();
+  LASchunktable();
+  ~LASchunktable();
+  // file position of the first chunk (just after the chunk table pointer)
+  I64 chunk_start;
+  U32 number_chunks;
+  U32* chunk_sizes;
+  U32* chunk_bytes;
+private:
+  U32 alloced_chunks;
+};
+
+#endif
@@ -0,0 +1,469 @@
+// lasduplicates.cpp : finds points that fall into a cell that an earlier scan already emitted.
+
+#include "lasduplicates.hpp"
+
+#include <cmath>
+#include <algorithm>
+#include <iterator>
+
+// this many cells of the current scan are sorted into one run
+#define LAS_DUPLICATES_RUN_KEYS 4000000
+// a spilled run is read in blocks of this many keys
+#define LAS_DUPLICATES_BLOCK_KEYS 1024
+// spilled runs are merged on disk in pieces of this many keys
+#define LAS_DUPLICATES_MERGE_KEYS 65536
+// number of probes and bits per expected point of the Bloom filter
+#define LAS_DUPLICATES_BLOOM_PROBES 5
+#define LAS_DUPLICATES_BLOOM_BITS 10
+#define LAS_DUPLICATES_BLOOM_MAX_BITS (((U64)1) << 33)
+
+static U64 las_duplicates_mix(U64 h)
+{
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ULL;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  return h;
+}
+
+BOOL LASduplicates::init(I64 expected_points, const F64* tolerance, const CHAR* temp_file_base, I64 memory_budget)
+{
+  clean();
+
+  exact = TRUE;
+  for (I32 i = 0; i < 3; i++)
+  {
+    this->tolerance[i] = tolerance[i];
+    if (tolerance[i] > 1.0) exact = FALSE;
+  }
+  this->temp_file_base = LASCopyString(temp_file_base);
+  this->memory_budget = memory_budget;
+
+  // a power of two number of bits with about ten bits per expected point
+  // that takes at most half of the memory budget
+
+  U64 bits = 1 << 20;
+  while ((bits < (U64)expected_points * LAS_DUPLICATES_BLOOM_BITS) && (bits < LAS_DUPLICATES_BLOOM_MAX_BITS) && ((bits << 1) / 8 <= (U64)memory_budget / 2))
+  {
+    bits <<= 1;
+  }
+  bloom.assign((size_t)(bits / 64), 0);
+  bloom_mask = bits - 1;
+  return TRUE;
+}
+
+LASduplicates::LASduplicatekey LASduplicates::key(I32 X, I32 Y, I32 Z) const
+{
+  LASduplicatekey k;
+  if (exact)
+  {
+    k.X = X;
+    k.Y = Y;
+    k.Z = Z;
+  }
+  else
+  {
+    k.X = (I32)floor(X / tolerance[0]);
+    k.Y = (I32)floor(Y / tolerance[1]);
+    k.Z = (I32)floor(Z / tolerance[2]);
+  }
+  return k;
+}
+
+U64 LASduplicates::hash(const LASduplicatekey& k) const
+{
+  return las_duplicates_mix((((U64)(U32)k.X) << 32) ^ ((U64)(U32)k.Y) ^ (((U64)(U32)k.Z) * 0x9E3779B97F4A7C15ULL));
+}
+
+BOOL LASduplicates::bloom_contains(const LASduplicatekey& k) const
+{
+  U64 h1 = hash(k);
+  U64 h2 = las_duplicates_mix(h1) | 1;
+  for (I32 i = 0; i < LAS_DUPLICATES_BLOOM_PROBES; i++)
+  {
+    U64 bit = (h1 + i * h2) & bloom_mask;
+    if ((bloom[bit >> 6] & (((U64)1) << (bit & 63))) == 0) return FALSE;
+  }
+  return TRUE;
+}
+
+void LASduplicates::bloom_add(const LASduplicatekey& k)
+{
+  U64 h1 = hash(k);
+  U64 h2 = las_duplicates_mix(h1) | 1;
+  for (I32 i = 0; i < LAS_DUPLICATES_BLOOM_PROBES; i++)
+  {
+    U64 bit = (h1 + i * h2) & bloom_mask;
+    bloom[bit >> 6] |= (((U64)1) << (bit & 63));
+  }
+}
+
+BOOL LASduplicates::contains(LASduplicaterun* run, const LASduplicatekey& k)
+{
+  if (run->file == 0)
+  {
+    return std::binary_search(run->keys.begin(), run->keys.end(), k);
+  }
+
+  // the sparse index holds the first key of every block
+
+  std::vector<LASduplicatekey>::iterator it = std::upper_bound(run->index.begin(), run->index.end(), k);
+  if (it == run->index.begin()) return FALSE;
+  I64 block = (it - run->index.begin()) - 1;
+  if (block != run->cached_block)
+  {
+    I64 first = block * LAS_DUPLICATES_BLOCK_KEYS;
+    I64 number = std::min((I64)LAS_DUPLICATES_BLOCK_KEYS, run->number_keys - first);
+    run->cache.resize((size_t)number);
+#ifdef _WIN32
+    _fseeki64(run->file, first * sizeof(LASduplicatekey), SEEK_SET);
+#else
+    fseeko(run->file, (off_t)(first * sizeof(LASduplicatekey)), SEEK_SET);
+#endif
+    if (fread(&run->cache[0], sizeof(LASduplicatekey), (size_t)number, run->file) != (size_t)number)
+    {
+      LASMessage(LAS_WARNING, "reading spilled duplicate cells from '%s'", run->file_name);
+      run->cached_block = -1;
+      return FALSE;
+    }
+    run->cached_block = block;
+  }
+  return std::binary_search(run->cache.begin(), run->cache.end(), k);
+}
+
+U32 LASduplicates::remove(U32 count, I32* X, I32* Y, I32* Z, U32* index, F64* x, F64* y, F64* z)
+{
+  // the keys that pass the Bloom filter are sorted so that each run is swept
+  // once in order and each block of a spilled run is read at most once
+
+  batch_keys.resize(count);
+  found.assign(count, 0);
+  candidates.clear();
+  for (U32 j = 0; j < count; j++)
+  {
+    batch_keys[j] = key(X[j], Y[j], Z[j]);
+    if (visible && bloom_contains(batch_keys[j])) candidates.push_back(j);
+  }
+  if (candidates.size())
+  {
+    std::sort(candidates.begin(), candidates.end(), [this](U32 a, U32 b) { return batch_keys[a] < batch_keys[b]; });
+    for (size_t r = 0; r < runs.size(); r++)
+    {
+      // the cells of the current scan are not visible yet
+      if (runs[r]->scan != -1) continue;
+      for (size_t c = 0; c < candidates.size(); c++)
+      {
+        U32 j = candidates[c];
+        if (!found[j] && contains(runs[r], batch_keys[j])) found[j] = 1;
+      }
+    }
+  }
+
+  U32 kept = 0;
+  for (U32 j = 0; j < count; j++)
+  {
+    if (found[j])
+    {
+      removed++;
+      continue;
+    }
+    pending.push_back(batch_keys[j]);
+    X[kept] = X[j];
+    Y[kept] = Y[j];
+    Z[kept] = Z[j];
+    index[kept] = index[j];
+    if (x)
+    {
+      x[kept] = x[j];
+      y[kept] = y[j];
+      z[kept] = z[j];
+    }
+    kept++;
+  }
+  if (pending.size() >= LAS_DUPLICATES_RUN_KEYS)
+  {
+    // the runs of the current scan count against the budget right away
+    flush_pending();
+    fit_budget();
+  }
+  return kept;
+}
+
+void LASduplicates::flush_pending()
+{
+  if (pending.size() == 0) return;
+  std::sort(pending.begin(), pending.end());
+  pending.erase(std::unique(pending.begin(), pending.end()), pending.end());
+  LASduplicaterun* run = new LASduplicaterun();
+  run->scan = scan;
+  run->keys.swap(pending);
+  run->file_name = 0;
+  run->file = 0;
+  run->number_keys = (I64)run->keys.size();
+  run->cached_block = -1;
+  runs.push_back(run);
+  pending.clear();
+}
+
+// merges the newest in-memory runs while they are about as large as the run
+// before them. this keeps the number of runs logarithmic in the number of cells
+
+void LASduplicates::merge_runs()
+{
+  while (true)
+  {
+    size_t l = runs.size();
+    while ((l > 0) && runs[l - 1]->file) l--;
+    size_t p = (l > 0 ? l - 1 : 0);
+    while ((p > 0) && runs[p - 1]->file) p--;
+    if ((l == 0) || (p == 0)) break;
+    LASduplicaterun* last = runs[l - 1];
+    LASduplicaterun* previous = runs[p - 1];
+    if (2 * last->keys.size() < previous->keys.size()) break;
+    std::vector<LASduplicatekey> merged;
+    merged.reserve(last->keys.size() + previous->keys.size());
+    std::merge(previous->keys.begin(), previous->keys.end(), last->keys.begin(), last->keys.end(), std::back_inserter(merged));
+    merged.erase(std::unique(merged.begin(), merged.end()), merged.end());
+    previous->keys.swap(merged);
+    previous->number_keys = (I64)previous->keys.size();
+    delete last;
+    runs.erase(runs.begin() + (l - 1));
+  }
+}
+
+FILE* LASduplicates::create_file(CHAR** file_name)
+{
+  *file_name = (CHAR*)malloc(strlen(temp_file_base) + 32);
+  sprintf(*file_name, "%s.cells%d", temp_file_base, number_spilled++);
+  FILE* file = LASfopen(*file_name, "w+b");
+  if (file == 0)
+  {
+    LASMessage(LAS_WARNING, "cannot create '%s' for the duplicate cells", *file_name);
+    free(*file_name);
+    *file_name = 0;
+  }
+  return file;
+}
+
+// merges the two smallest visible spilled runs on disk while they are about
+// the same size. this keeps the number of spilled runs logarithmic as well
+
+void LASduplicates::merge_spilled()
+{
+  while (true)
+  {
+    size_t smallest = runs.size();
+    size_t second = runs.size();
+    for (size_t r = 0; r < runs.size(); r++)
+    {
+      if ((runs[r]->file == 0) || (runs[r]->scan != -1)) continue;
+      if ((smallest == runs.size()) || (runs[r]->number_keys < runs[smallest]->number_keys))
+      {
+        second = smallest;
+        smallest = r;
+      }
+      else if ((second == runs.size()) || (runs[r]->number_keys < runs[second]->number_keys))
+      {
+        second = r;
+      }
+    }
+    if (second == runs.size()) return;
+    if (2 * runs[smallest]->number_keys < runs[second]->number_keys) return;
+    LASduplicaterun* merged = merge_files(runs[std::min(smallest, second)], runs[std::max(smallest, second)]);
+    if (merged == 0) return;
+    delete_run(runs[std::max(smallest, second)]);
+    runs.erase(runs.begin() + std::max(smallest, second));
+    delete_run(runs[std::min(smallest, second)]);
+    runs[std::min(smallest, second)] = merged;
+  }
+}
+
+// merges two spilled runs into a new one with one sequential pass over both
+
+LASduplicates::LASduplicaterun* LASduplicates::merge_files(LASduplicaterun* previous, LASduplicaterun* last)
+{
+  LASduplicaterun* run = new LASduplicaterun();
+  run->scan = -1;
+  run->number_keys = 0;
+  run->cached_block = -1;
+  run->file = create_file(&run->file_name);
+  if (run->file == 0)
+  {
+    delete run;
+    return 0;
+  }
+
+  LASduplicaterun* from[2] = { previous, last };
+  std::vector<LASduplicatekey> in[2];
+  size_t position[2] = { 0, 0 };
+  I64 next[2] = { 0, 0 };
+  std::vector<LASduplicatekey> out;
+  out.reserve(LAS_DUPLICATES_MERGE_KEYS);
+  LASduplicatekey k;
+  LASduplicatekey written;
+  BOOL failed = FALSE;
+
+  while (!failed)
+  {
+    for (I32 i = 0; i < 2; i++)
+    {
+      if ((position[i] == in[i].size()) && (next[i] < from[i]->number_keys))
+      {
+        I64 number = std::min((I64)LAS_DUPLICATES_MERGE_KEYS, from[i]->number_keys - next[i]);
+        in[i].resize((size_t)number);
+        position[i] = 0;
+#ifdef _WIN32
+        _fseeki64(from[i]->file, next[i] * sizeof(LASduplicatekey), SEEK_SET);
+#else
+        fseeko(from[i]->file, (off_t)(next[i] * sizeof(LASduplicatekey)), SEEK_SET);
+#endif
+        if (fread(&in[i][0], sizeof(LASduplicatekey), (size_t)number, from[i]->file) != (size_t)number) failed = TRUE;
+        next[i] += number;
+        from[i]->cached_block = -1;
+      }
+    }
+    BOOL more[2] = { position[0] < in[0].size(), position[1] < in[1].size() };
+    if (failed || (!more[0] && !more[1])) break;
+    if (more[0] && (!more[1] || !(in[1][position[1]] < in[0][position[0]])))
+      k = in[0][position[0]++];
+    else
+      k = in[1][position[1]++];
+    // the runs of one scan may share cells
+    if (run->number_keys && (k == written)) continue;
+    if ((run->number_keys % LAS_DUPLICATES_BLOCK_KEYS) == 0) run->index.push_back(k);
+    out.push_back(k);
+    written = k;
+    run->number_keys++;
+    if (out.size() == LAS_DUPLICATES_MERGE_KEYS)
+    {
+      if (fwrite(&out[0], sizeof(LASduplicatekey), out.size(), run->file) != out.size()) failed = TRUE;
+      out.clear();
+    }
+  }
+  if (!failed && out.size() && (fwrite(&out[0], sizeof(LASduplicatekey), out.size(), run->file) != out.size())) failed = TRUE;
+  if (failed)
+  {
+    LASMessage(LAS_WARNING, "cannot merge the spilled duplicate cells into '%s'", run->file_name);
+    delete_run(run);
+    return 0;
+  }
+  return run;
+}
+
+void LASduplicates::delete_run(LASduplicaterun* run)
+{
+  if (run->file)
+  {
+    fclose(run->file);
+    ::remove(run->file_name);
+  }
+  if (run->file_name) free(run->file_name);
+  delete run;
+}
+
+BOOL LASduplicates::spill(LASduplicaterun* run)
+{
+  run->file = create_file(&run->file_name);
+  if (run->file == 0) return FALSE;
+  if (fwrite(&run->keys[0], sizeof(LASduplicatekey), run->keys.size(), run->file) != run->keys.size())
+  {
+    LASMessage(LAS_WARNING, "cannot spill duplicate cells to '%s'. keeping them in memory", run->file_name);
+    fclose(run->file);
+    run->file = 0;
+    ::remove(run->file_name);
+    free(run->file_name);
+    run->file_name = 0;
+    return FALSE;
+  }
+  for (size_t i = 0; i < run->keys.size(); i += LAS_DUPLICATES_BLOCK_KEYS)
+  {
+    run->index.push_back(run->keys[i]);
+  }
+  // the cells of a run of the current scan go into the Bloom filter now as
+  // they are no longer in memory once the scan ends
+  if (run->scan != -1)
+  {
+    for (size_t i = 0; i < run->keys.size(); i++) bloom_add(run->keys[i]);
+  }
+  std::vector<LASduplicatekey>().swap(run->keys);
+  run->cached_block = -1;
+  return TRUE;
+}
+
+I64 LASduplicates::memory() const
+{
+  I64 bytes = (I64)(bloom.size() * sizeof(U64));
+  bytes += (I64)(pending.capacity() * sizeof(LASduplicatekey));
+  for (size_t r = 0; r < runs.size(); r++)
+  {
+    bytes += (I64)(runs[r]->keys.capacity() * sizeof(LASduplicatekey));
+  }
+  return bytes;
+}
+
+void LASduplicates::end_scan()
+{
+  flush_pending();
+  for (size_t r = 0; r < runs.size(); r++)
+  {
+    if (runs[r]->scan == scan)
+    {
+      for (size_t i = 0; i < runs[r]->keys.size(); i++) bloom_add(runs[r]->keys[i]);
+      visible += runs[r]->number_keys;
+      runs[r]->scan = -1;
+    }
+  }
+  merge_runs();
+  fit_budget();
+  merge_spilled();
+  scan++;
+}
+
+// spills the largest runs (of earlier scans or of the current one) until the
+// others fit into the memory budget
+
+void LASduplicates::fit_budget()
+{
+  while (memory() > memory_budget)
+  {
+    LASduplicaterun* largest = 0;
+    for (size_t r = 0; r < runs.size(); r++)
+    {
+      if ((runs[r]->file == 0) && ((largest == 0) || (runs[r]->keys.size() > largest->keys.size()))) largest = runs[r];
+    }
+    if ((largest == 0) || !spill(largest)) break;
+  }
+}
+
+void LASduplicates::clean()
+{
+  for (size_t r = 0; r < runs.size(); r++)
+  {
+    delete_run(runs[r]);
+  }
+  runs.clear();
+  pending.clear();
+  bloom.clear();
+  bloom_mask = 0;
+  if (temp_file_base) free(temp_file_base);
+  temp_file_base = 0;
+  scan = 0;
+  visible = 0;
+  removed = 0;
+  number_spilled = 0;
+}
+
+LASduplicates::LASduplicates()
+{
+  temp_file_base = 0;
+  exact = TRUE;
+  tolerance[0] = tolerance[1] = tolerance[2] = 0.0;
+  memory_budget = 0;
+  clean();
+}
+
+LASduplicates::~LASduplicates()
+{
+  clean();
+}
@@ -0,0 +1,98 @@
+// lasduplicates.hpp : finds points that fall into a cell that an earlier scan already emitted.
+
+#ifndef LAS_DUPLICATES_HPP
+#define LAS_DUPLICATES_HPP
+
+#include "mydefs.hpp"
+
+#include <vector>
+
+// the cells of all emitted points are kept in sorted runs of keys. while a
+// scan is processed the runs of the earlier scans are only read, so lookups
+// need no locking. the cells of the current scan are sorted into runs as
+// they are collected and become visible when the scan ends. a Bloom filter
+// in front answers most lookups without touching the runs. whenever the
+// Bloom filter and the runs (also those of the current scan) outgrow the
+// memory budget the largest runs are spilled to sorted files on disk with a
+// sparse in-memory index. like the runs in memory the spilled runs are merged
+// (on disk) so that their number stays logarithmic. the keys of a batch that
+// pass the Bloom filter are sorted and looked up in one sweep over each run,
+// so that every block of a spilled run is read at most once per batch
+
+class LASduplicates
+{
+public:
+  // 'tolerance' is the size of a cell in the integer units of each axis
+  // (zero means exact integer coordinates). the Bloom filter and the runs
+  // in memory stay within 'memory_budget' bytes
+  BOOL init(I64 expected_points, const F64* tolerance, const CHAR* temp_file_base, I64 memory_budget);
+  // compacts the points that survive (and their index and unrounded
+  // coordinates, if any) to the front and returns how many that are
+  U32 remove(U32 count, I32* X, I32* Y, I32* Z, U32* index, F64* x = 0, F64* y = 0, F64* z = 0);
+  // makes the cells of the current scan visible to all later scans
+  void end_scan();
+  I64 get_removed() const { return removed; };
+  void clean();
+  LASduplicates();
+  ~LASduplicates();
+private:
+  struct LASduplicatekey
+  {
+    I32 X, Y, Z;
+    bool operator<(const LASduplicatekey& k) const
+    {
+      if (X != k.X) return X < k.X;
+      if (Y != k.Y) return Y < k.Y;
+      return Z < k.Z;
+    };
+    bool operator==(const LASduplicatekey& k) const
+    {
+      return (X == k.X) && (Y == k.Y) && (Z == k.Z);
+    };
+  };
+  struct LASduplicaterun
+  {
+    I32 scan;
+    std::vector<LASduplicatekey> keys;
+    // a spilled run
+    CHAR* file_name;
+    FILE* file;
+    I64 number_keys;
+    std::vector<LASduplicatekey> index;
+    I64 cached_block;
+    std::vector<LASduplicatekey> cache;
+  };
+  LASduplicatekey key(I32 X, I32 Y, I32 Z) const;
+  U64 hash(const LASduplicatekey& k) const;
+  BOOL bloom_contains(const LASduplicatekey& k) const;
+  void bloom_add(const LASduplicatekey& k);
+  BOOL contains(LASduplicaterun* run, const LASduplicatekey& k);
+  void flush_pending();
+  void merge_runs();
+  BOOL spill(LASduplicaterun* run);
+  FILE* create_file(CHAR** file_name);
+  void merge_spilled();
+  LASduplicaterun* merge_files(LASduplicaterun* previous, LASduplicaterun* last);
+  void delete_run(LASduplicaterun* run);
+  void fit_budget();
+  I64 memory() const;
+
+  F64 tolerance[3];
+  BOOL exact;
+  CHAR* temp_file_base;
+  I64 memory_budget;
+  std::vector<U64> bloom;
+  U64 bloom_mask;
+  I32 scan;
+  I64 visible;
+  I64 removed;
+  I32 number_spilled;
+  std::vector<LASduplicatekey> pending;
+  std::vector<LASduplicaterun*> runs;
+  // the keys of the current batch and the ones that passed the Bloom filter
+  std::vector<LASduplicatekey> batch_keys;
+  std::vector<U32> candidates;
+  std::vector<U8> found;
+};
+
+#endif
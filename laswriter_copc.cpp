@@ -0,0 +1,806 @@
+// laswriter_copc.cpp : writes the points as COPC (cloud optimized point cloud).
+
+#include "laswriter_copc.hpp"
+
+#include "laschunktable.hpp"
+#include "bytestreamin_file.hpp"
+#include "bytestreamout_file.hpp"
+
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <unordered_set>
+
+#undef min
+#undef max
+
+// the octree is addressed with 21 bits per axis which allows 14 levels of 128^3 cells
+#define COPC_CELL_BITS 7
+#define COPC_GRID_BITS 21
+#define COPC_MAX_LEVEL (COPC_GRID_BITS - COPC_CELL_BITS)
+// a node with fewer points is not split any further
+#define COPC_MAX_LEAF_POINTS 100000
+// about the number of points that the subtrees built at the same time are
+// allowed to bring into memory. each core gets its share and the subtrees
+// with more are split
+#define COPC_MAX_BUCKET_POINTS 20000000
+// the top levels are sampled while the points are sorted into buckets. their
+// cells take 256 KB, 2 MB, and 16 MB of bits
+#define COPC_MAX_BUCKET_LEVEL 3
+
+#define COPC_INFO_SIZE 160
+#define COPC_ENTRY_SIZE 32
+#define COPC_EVLR_HEADER_SIZE 60
+
+static CHAR* copc_temp_name(const CHAR* file_name, const CHAR* what, I32 number)
+{
+  CHAR* name = (CHAR*)malloc(strlen(file_name) + 32);
+  sprintf(name, "%s.%s%d%s", file_name, what, number, (strcmp(what, "temp") == 0 ? ".laz" : ""));
+  return name;
+}
+
+static U64 copc_key(I32 level, U32 x, U32 y, U32 z)
+{
+  return (((U64)level) << 60) | (((U64)x) << 40) | (((U64)y) << 20) | ((U64)z);
+}
+
+void LASwriterCOPC::init_header(LASheader* header)
+{
+  header->version_major = 1;
+  header->version_minor = 4;
+  header->header_size = 375;
+  header->offset_to_point_data = 375;
+  U8* data = new U8[COPC_INFO_SIZE];
+  memset(data, 0, COPC_INFO_SIZE);
+  header->add_vlr("copc", 1, COPC_INFO_SIZE, data, FALSE, "copc info");
+}
+
+BOOL LASwriterCOPC::is_copc(const CHAR* file_name)
+{
+  if (file_name == 0) return FALSE;
+  size_t len = strlen(file_name);
+  if (len < 9) return FALSE;
+  const CHAR* ext = file_name + len - 9;
+  return (strncmp(ext, ".copc.laz", 9) == 0) || (strncmp(ext, ".COPC.LAZ", 9) == 0);
+}
+
+BOOL LASwriterCOPC::open(const CHAR* file_name, const LASheader* header, I32 cores)
+{
+  if ((header->point_data_format < 6) || (header->point_data_format > 8))
+  {
+    LASMessage(LAS_ERROR, "COPC needs point type 6, 7, or 8 and not %d", (I32)header->point_data_format);
+    return FALSE;
+  }
+  if ((header->number_of_variable_length_records == 0) || (strncmp(header->vlrs[0].user_id, "copc", 16) != 0) || (header->vlrs[0].record_id != 1))
+  {
+    LASMessage(LAS_ERROR, "COPC info VLR must be the first VLR");
+    return FALSE;
+  }
+
+  clean();
+
+  this->file_name = LASCopyString(file_name);
+  this->header = header;
+  this->cores = (cores > 1 ? cores : 1);
+
+  CHAR* spill_name = copc_temp_name(file_name, "spill", 0);
+  spill = LASfopen(spill_name, "wb");
+  free(spill_name);
+  if (spill == 0)
+  {
+    LASMessage(LAS_ERROR, "cannot open temporary file for '%s'", file_name);
+    return FALSE;
+  }
+
+  quantizer = *header;
+  point_size = header->point_data_record_length;
+  stride = 12 + point_size;
+  record = new U8[stride];
+
+  min_X = min_Y = min_Z = I32_MAX;
+  max_X = max_Y = max_Z = I32_MIN;
+  min_gps_time = F64_MAX;
+  max_gps_time = -F64_MAX;
+  memset(number_of_points_by_return, 0, sizeof(number_of_points_by_return));
+
+  npoints = 0;
+  p_count = 0;
+  return TRUE;
+}
+
+BOOL LASwriterCOPC::write_point(const LASpoint* point)
+{
+  point->copy_to(record);
+  if (fwrite(record, point_size, 1, spill) != 1) return FALSE;
+
+  I32 X = point->get_X();
+  I32 Y = point->get_Y();
+  I32 Z = point->get_Z();
+  if (X < min_X) min_X = X;
+  if (X > max_X) max_X = X;
+  if (Y < min_Y) min_Y = Y;
+  if (Y > max_Y) max_Y = Y;
+  if (Z < min_Z) min_Z = Z;
+  if (Z > max_Z) max_Z = Z;
+  if (point->gps_time < min_gps_time) min_gps_time = point->gps_time;
+  if (point->gps_time > max_gps_time) max_gps_time = point->gps_time;
+  if ((point->extended_return_number >= 1) && (point->extended_return_number <= 15))
+  {
+    number_of_points_by_return[point->extended_return_number - 1]++;
+  }
+
+  p_count++;
+  return TRUE;
+}
+
+BOOL LASwriterCOPC::chunk()
+{
+  // the chunks are the nodes of the octree
+  return FALSE;
+}
+
+BOOL LASwriterCOPC::update_header(const LASheader* header, BOOL use_inventory, BOOL update_extra_bytes)
+{
+  // counts and bounding box are patched into the COPC file when it is closed
+  return TRUE;
+}
+
+void LASwriterCOPC::cell(const LASpoint* point, U32* xyz) const
+{
+  F64 coordinates[3] = { point->get_x(), point->get_y(), point->get_z() };
+  for (I32 i = 0; i < 3; i++)
+  {
+    I64 c = (I64)((coordinates[i] - (center[i] - halfsize)) / (2 * halfsize) * (1 << COPC_GRID_BITS));
+    if (c < 0) c = 0;
+    else if (c >= (1 << COPC_GRID_BITS)) c = (1 << COPC_GRID_BITS) - 1;
+    xyz[i] = (U32)c;
+  }
+}
+
+I32 LASwriterCOPC::add_bucket(I32 level, U32 x, U32 y, U32 z, BOOL sampled)
+{
+  COPCbucket bucket;
+  bucket.node.level = level;
+  bucket.node.x = (I32)x;
+  bucket.node.y = (I32)y;
+  bucket.node.z = (I32)z;
+  bucket.node.number_points = 0;
+  bucket.number_points = 0;
+  bucket.sampled = sampled;
+  buckets.push_back(bucket);
+  return (I32)buckets.size() - 1;
+}
+
+// appends the current record to bucket 'b' whose file is opened when needed
+
+BOOL LASwriterCOPC::put(std::vector<FILE*>& files, I32 b)
+{
+  if ((I32)files.size() <= b) files.resize(b + 1, (FILE*)0);
+  if (files[b] == 0)
+  {
+    CHAR* bucket_name = copc_temp_name(file_name, "bucket", b);
+    files[b] = LASfopen(bucket_name, "wb");
+    free(bucket_name);
+    if (files[b] == 0)
+    {
+      LASMessage(LAS_ERROR, "cannot open temporary bucket file for '%s'", file_name);
+      return FALSE;
+    }
+  }
+  if (fwrite(record, stride, 1, files[b]) != 1)
+  {
+    LASMessage(LAS_ERROR, "writing temporary bucket file for '%s'", file_name);
+    return FALSE;
+  }
+  buckets[b].number_points++;
+  return TRUE;
+}
+
+// reads the spilled points once. a point is kept by the first top level whose
+// cell is still empty and is otherwise sorted into the bucket of its subtree.
+// the cells of top level l are (128 * 2^l)^3 bits
+
+BOOL LASwriterCOPC::distribute(I32 level)
+{
+  CHAR* spill_name = copc_temp_name(file_name, "spill", 0);
+  spill = LASfopen(spill_name, "rb");
+  if (spill == 0)
+  {
+    LASMessage(LAS_ERROR, "cannot reopen temporary file '%s'", spill_name);
+    free(spill_name);
+    return FALSE;
+  }
+
+  LASpoint point;
+  point.init(header, header->point_data_format, header->point_data_record_length, header);
+
+  buckets.clear();
+  std::vector<FILE*> files;
+  std::map<U64, I32> top_buckets;
+  std::vector<I32> subtree_buckets((size_t)1 << (3 * level), -1);
+  std::vector< std::vector<bool> > cells(level);
+  for (I32 l = 0; l < level; l++) cells[l].assign((size_t)1 << (3 * (COPC_CELL_BITS + l)), false);
+
+  BOOL success = TRUE;
+  U32* xyz = (U32*)record;
+  for (I64 p = 0; p < p_count; p++)
+  {
+    if (fread(record + 12, point_size, 1, spill) != 1)
+    {
+      LASMessage(LAS_ERROR, "reading temporary file '%s'", spill_name);
+      success = FALSE;
+      break;
+    }
+    point.copy_from(record + 12);
+    cell(&point, xyz);
+
+    I32 b = -1;
+    for (I32 l = 0; l < level; l++)
+    {
+      I32 bits = COPC_CELL_BITS + l;
+      I32 shift = COPC_GRID_BITS - bits;
+      size_t c = ((size_t)(xyz[0] >> shift) << (2 * bits)) | ((size_t)(xyz[1] >> shift) << bits) | (size_t)(xyz[2] >> shift);
+      if (!cells[l][c])
+      {
+        cells[l][c] = true;
+        shift = COPC_GRID_BITS - l;
+        U64 key = copc_key(l, xyz[0] >> shift, xyz[1] >> shift, xyz[2] >> shift);
+        std::map<U64, I32>::iterator it = top_buckets.find(key);
+        b = (it != top_buckets.end() ? it->second : (top_buckets[key] = add_bucket(l, xyz[0] >> shift, xyz[1] >> shift, xyz[2] >> shift, TRUE)));
+        break;
+      }
+    }
+    if (b == -1)
+    {
+      I32 shift = COPC_GRID_BITS - level;
+      size_t s = ((size_t)(xyz[0] >> shift) << (2 * level)) | ((size_t)(xyz[1] >> shift) << level) | (size_t)(xyz[2] >> shift);
+      if (subtree_buckets[s] == -1) subtree_buckets[s] = add_bucket(level, xyz[0] >> shift, xyz[1] >> shift, xyz[2] >> shift, FALSE);
+      b = subtree_buckets[s];
+    }
+    if (!put(files, b))
+    {
+      success = FALSE;
+      break;
+    }
+  }
+
+  fclose(spill);
+  spill = 0;
+  remove(spill_name);
+  free(spill_name);
+
+  for (size_t b = 0; b < files.size(); b++)
+  {
+    if (files[b]) fclose(files[b]);
+  }
+  return success;
+}
+
+// the points of a subtree that does not fit into memory are read once more.
+// its root node keeps the first point in each of its cells (just like build()
+// does) and all others go into the buckets of the subtrees of its children
+
+BOOL LASwriterCOPC::split(I32 b)
+{
+  COPCnode node = buckets[b].node;
+  I64 number_points = buckets[b].number_points;
+
+  CHAR* bucket_name = copc_temp_name(file_name, "bucket", b);
+  FILE* file = LASfopen(bucket_name, "rb");
+  if (file == 0)
+  {
+    LASMessage(LAS_ERROR, "cannot reopen temporary bucket file '%s'", bucket_name);
+    free(bucket_name);
+    return FALSE;
+  }
+
+  I32 shift = COPC_GRID_BITS - node.level - COPC_CELL_BITS;
+  I32 child_shift = COPC_GRID_BITS - node.level - 1;
+  U32 mask = (1 << COPC_CELL_BITS) - 1;
+  std::vector<bool> cells((size_t)1 << (3 * COPC_CELL_BITS), false);
+  I32 root = -1;
+  I32 children[8] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+  std::vector<FILE*> files;
+
+  BOOL success = TRUE;
+  const U32* xyz = (const U32*)record;
+  for (I64 p = 0; p < number_points; p++)
+  {
+    if (fread(record, stride, 1, file) != 1)
+    {
+      LASMessage(LAS_ERROR, "reading temporary bucket file '%s'", bucket_name);
+      success = FALSE;
+      break;
+    }
+    U32 c = (((xyz[0] >> shift) & mask) << (2 * COPC_CELL_BITS)) | (((xyz[1] >> shift) & mask) << COPC_CELL_BITS) | ((xyz[2] >> shift) & mask);
+    I32 k;
+    if (!cells[c])
+    {
+      cells[c] = true;
+      if (root == -1) root = add_bucket(node.level, node.x, node.y, node.z, TRUE);
+      k = root;
+    }
+    else
+    {
+      I32 child = (((xyz[0] >> child_shift) & 1) << 2) | (((xyz[1] >> child_shift) & 1) << 1) | ((xyz[2] >> child_shift) & 1);
+      if (children[child] == -1) children[child] = add_bucket(node.level + 1, 2 * node.x + ((child >> 2) & 1), 2 * node.y + ((child >> 1) & 1), 2 * node.z + (child & 1), FALSE);
+      k = children[child];
+    }
+    if (!put(files, k))
+    {
+      success = FALSE;
+      break;
+    }
+  }
+
+  fclose(file);
+  remove(bucket_name);
+  free(bucket_name);
+  buckets[b].number_points = 0;
+
+  for (size_t f = 0; f < files.size(); f++)
+  {
+    if (files[f]) fclose(files[f]);
+  }
+  return success;
+}
+
+void LASwriterCOPC::write_node(I32 w, LASpoint* point, const COPCnode& node, const U8* records, const std::vector<U32>& index)
+{
+  // every node but the first closes the chunk of the previous node
+  if (nodes[w].size()) writers[w]->chunk();
+  for (size_t i = 0; i < index.size(); i++)
+  {
+    point->copy_from(records + (size_t)index[i] * stride + 12);
+    writers[w]->write_point(point);
+  }
+  nodes[w].push_back(node);
+  nodes[w].back().number_points = (U32)index.size();
+}
+
+void LASwriterCOPC::build(I32 w, LASpoint* point, const COPCnode& node, const U8* records, std::vector<U32>& index)
+{
+  if ((index.size() <= COPC_MAX_LEAF_POINTS) || (node.level == COPC_MAX_LEVEL))
+  {
+    write_node(w, point, node, records, index);
+    return;
+  }
+
+  I32 shift = COPC_GRID_BITS - node.level - COPC_CELL_BITS;
+  I32 child_shift = COPC_GRID_BITS - node.level - 1;
+  U32 mask = (1 << COPC_CELL_BITS) - 1;
+
+  std::unordered_set<U32> cells;
+  std::vector<U32> sampled;
+  std::vector<U32> children[8];
+
+  for (size_t i = 0; i < index.size(); i++)
+  {
+    const U32* xyz = (const U32*)(records + (size_t)index[i] * stride);
+    U32 c = (((xyz[0] >> shift) & mask) << (2 * COPC_CELL_BITS)) | (((xyz[1] >> shift) & mask) << COPC_CELL_BITS) | ((xyz[2] >> shift) & mask);
+    if (cells.insert(c).second)
+    {
+      sampled.push_back(index[i]);
+    }
+    else
+    {
+      children[(((xyz[0] >> child_shift) & 1) << 2) | (((xyz[1] >> child_shift) & 1) << 1) | ((xyz[2] >> child_shift) & 1)].push_back(index[i]);
+    }
+  }
+  index.clear();
+  index.shrink_to_fit();
+
+  write_node(w, point, node, records, sampled);
+
+  for (I32 c = 0; c < 8; c++)
+  {
+    if (children[c].size())
+    {
+      COPCnode child;
+      child.level = node.level + 1;
+      child.x = 2 * node.x + ((c >> 2) & 1);
+      child.y = 2 * node.y + ((c >> 1) & 1);
+      child.z = 2 * node.z + (c & 1);
+      child.number_points = 0;
+      build(w, point, child, records, children[c]);
+    }
+  }
+}
+
+// a task is a bucket with either a subtree or the points of a single node
+
+void LASwriterCOPC::work(I32 w)
+{
+  LASpoint point;
+  point.init(header, header->point_data_format, header->point_data_record_length, header);
+
+  I32 t;
+  while (!failed && ((t = next_task++) < (I32)tasks.size()))
+  {
+    I32 b = tasks[t];
+    const COPCbucket& bucket = buckets[b];
+
+    CHAR* bucket_name = copc_temp_name(file_name, "bucket", b);
+    FILE* file = LASfopen(bucket_name, "rb");
+    std::vector<U8> records((size_t)bucket.number_points * stride);
+    if ((file == 0) || (fread(&records[0], stride, (size_t)bucket.number_points, file) != (size_t)bucket.number_points))
+    {
+      LASMessage(LAS_ERROR, "reading temporary bucket file '%s'", bucket_name);
+      failed = true;
+    }
+    if (file) fclose(file);
+    remove(bucket_name);
+    free(bucket_name);
+    if (failed) break;
+
+    std::vector<U32> index((size_t)bucket.number_points);
+    for (size_t i = 0; i < index.size(); i++) index[i] = (U32)i;
+    if (bucket.sampled)
+      write_node(w, &point, bucket.node, &records[0], index);
+    else
+      build(w, &point, bucket.node, &records[0], index);
+  }
+}
+
+// copies the header and the chunks of the temporary LAZ files into the COPC
+// file, writes the new chunk table and the hierarchy EVLR, and then patches
+// the counts, the bounding box, and the COPC info into the header
+
+BOOL LASwriterCOPC::assemble(I64& bytes)
+{
+  FILE* file = LASfopen(file_name, "wb");
+  if (file == 0)
+  {
+    LASMessage(LAS_ERROR, "cannot open '%s'", file_name);
+    return FALSE;
+  }
+  ByteStreamOutFileLE* stream = new ByteStreamOutFileLE(file);
+
+  BOOL success = TRUE;
+  LASchunktable table;
+  std::vector<U8> entries;
+  std::vector<U8> buffer;
+  I64 chunk_table_pointer = -1;
+
+  for (size_t w = 0; (w < writers.size()) && success; w++)
+  {
+    CHAR* temp_name = copc_temp_name(file_name, "temp", (I32)w);
+    FILE* temp = LASfopen(temp_name, "rb");
+    if (temp == 0)
+    {
+      LASMessage(LAS_ERROR, "cannot reopen temporary file '%s'", temp_name);
+      free(temp_name);
+      success = FALSE;
+      break;
+    }
+    ByteStreamInFileLE* in = new ByteStreamInFileLE(temp);
+
+    U32 offset_to_point_data;
+    in->seek(96);
+    in->get32bitsLE((U8*)&offset_to_point_data);
+
+    if (w == 0)
+    {
+      // all temporary files share the header and the VLRs
+      buffer.resize(offset_to_point_data);
+      in->seek(0);
+      in->getBytes(&buffer[0], offset_to_point_data);
+      stream->putBytes(&buffer[0], offset_to_point_data);
+      chunk_table_pointer = stream->tell();
+      stream->put64bitsLE((const U8*)&chunk_table_pointer);
+    }
+
+    LASchunktable chunks;
+    if (!chunks.read(in, offset_to_point_data) || (chunks.number_chunks != nodes[w].size()))
+    {
+      LASMessage(LAS_ERROR, "corrupt chunk table in temporary file '%s'", temp_name);
+      success = FALSE;
+    }
+    else
+    {
+      in->seek(chunks.chunk_start);
+      for (U32 c = 0; c < chunks.number_chunks; c++)
+      {
+        const COPCnode& node = nodes[w][c];
+        if (chunks.chunk_sizes[c] != node.number_points)
+        {
+          LASMessage(LAS_ERROR, "chunk %u of temporary file '%s' has %u instead of %u points", c, temp_name, chunks.chunk_sizes[c], node.number_points);
+          success = FALSE;
+          break;
+        }
+        U64 offset = (U64)stream->tell();
+        buffer.resize(chunks.chunk_bytes[c]);
+        in->getBytes(&buffer[0], chunks.chunk_bytes[c]);
+        stream->putBytes(&buffer[0], chunks.chunk_bytes[c]);
+        table.add(chunks.chunk_sizes[c], chunks.chunk_bytes[c]);
+
+        U8 entry[COPC_ENTRY_SIZE];
+        I32 byte_size = (I32)chunks.chunk_bytes[c];
+        I32 point_count = (I32)node.number_points;
+        memcpy(entry + 0, &node.level, 4);
+        memcpy(entry + 4, &node.x, 4);
+        memcpy(entry + 8, &node.y, 4);
+        memcpy(entry + 12, &node.z, 4);
+        memcpy(entry + 16, &offset, 8);
+        memcpy(entry + 24, &byte_size, 4);
+        memcpy(entry + 28, &point_count, 4);
+        entries.insert(entries.end(), entry, entry + COPC_ENTRY_SIZE);
+      }
+    }
+
+    delete in;
+    fclose(temp);
+    remove(temp_name);
+    free(temp_name);
+  }
+
+  if (success)
+  {
+    table.write(stream, chunk_table_pointer, TRUE);
+
+    // the hierarchy is one single page with all nodes
+
+    U64 start_of_first_extended_variable_length_record = (U64)stream->tell();
+    U16 reserved = 0;
+    CHAR user_id[16];
+    CHAR description[32];
+    U16 record_id = 1000;
+    U64 record_length_after_header = entries.size();
+    memset(user_id, 0, 16);
+    memset(description, 0, 32);
+    strcpy(user_id, "copc");
+    strcpy(description, "copc hierarchy");
+    stream->put16bitsLE((const U8*)&reserved);
+    stream->putBytes((const U8*)user_id, 16);
+    stream->put16bitsLE((const U8*)&record_id);
+    stream->put64bitsLE((const U8*)&record_length_after_header);
+    stream->putBytes((const U8*)description, 32);
+    if (entries.size()) stream->putBytes(&entries[0], (U32)entries.size());
+    bytes = stream->tell();
+
+    // patch the header. the legacy counts are zero for the point types of LAS 1.4
+
+    U32 zero[6] = { 0, 0, 0, 0, 0, 0 };
+    stream->seek(107);
+    stream->putBytes((const U8*)zero, 24);
+
+    F64 bounds[6];
+    bounds[0] = header->get_x(max_X);
+    bounds[1] = header->get_x(min_X);
+    bounds[2] = header->get_y(max_Y);
+    bounds[3] = header->get_y(min_Y);
+    bounds[4] = header->get_z(max_Z);
+    bounds[5] = header->get_z(min_Z);
+    if (p_count == 0) memset(bounds, 0, sizeof(bounds));
+    stream->seek(179);
+    for (I32 i = 0; i < 6; i++) stream->put64bitsLE((const U8*)&bounds[i]);
+
+    U32 number_of_extended_variable_length_records = 1;
+    U64 extended_number_of_point_records = (U64)p_count;
+    stream->seek(235);
+    stream->put64bitsLE((const U8*)&start_of_first_extended_variable_length_record);
+    stream->put32bitsLE((const U8*)&number_of_extended_variable_length_records);
+    stream->put64bitsLE((const U8*)&extended_number_of_point_records);
+    for (I32 i = 0; i < 15; i++) stream->put64bitsLE((const U8*)&number_of_points_by_return[i]);
+
+    // the COPC info is the first VLR
+
+    F64 spacing = 2 * halfsize / (1 << COPC_CELL_BITS);
+    U64 root_hier_offset = start_of_first_extended_variable_length_record + COPC_EVLR_HEADER_SIZE;
+    U64 root_hier_size = entries.size();
+    F64 gps_time[2] = { (p_count ? min_gps_time : 0.0), (p_count ? max_gps_time : 0.0) };
+    stream->seek(header->header_size + 54);
+    for (I32 i = 0; i < 3; i++) stream->put64bitsLE((const U8*)&center[i]);
+    stream->put64bitsLE((const U8*)&halfsize);
+    stream->put64bitsLE((const U8*)&spacing);
+    stream->put64bitsLE((const U8*)&root_hier_offset);
+    stream->put64bitsLE((const U8*)&root_hier_size);
+    stream->put64bitsLE((const U8*)&gps_time[0]);
+    stream->put64bitsLE((const U8*)&gps_time[1]);
+  }
+
+  delete stream;
+  fclose(file);
+  if (!success) remove(file_name);
+  return success;
+}
+
+I64 LASwriterCOPC::close(BOOL update_npoints)
+{
+  if (spill == 0) return 0;
+  fclose(spill);
+  spill = 0;
+
+  npoints = p_count;
+
+  // the cube around the bounding box
+
+  F64 min[3] = { header->get_x(min_X), header->get_y(min_Y), header->get_z(min_Z) };
+  F64 max[3] = { header->get_x(max_X), header->get_y(max_Y), header->get_z(max_Z) };
+  if (p_count == 0)
+  {
+    min[0] = min[1] = min[2] = 0.0;
+    max[0] = max[1] = max[2] = 0.0;
+  }
+  halfsize = 0.0;
+  for (I32 i = 0; i < 3; i++)
+  {
+    center[i] = (min[i] + max[i]) / 2;
+    if ((max[i] - min[i]) / 2 > halfsize) halfsize = (max[i] - min[i]) / 2;
+  }
+  halfsize += std::max(header->x_scale_factor, std::max(header->y_scale_factor, header->z_scale_factor));
+
+  // the subtrees that all cores build at the same time must fit into memory
+  // and there should be enough of them for all cores
+
+  I64 max_bucket_points = std::max((I64)COPC_MAX_LEAF_POINTS, (I64)COPC_MAX_BUCKET_POINTS / cores);
+  bucket_level = 0;
+  while (bucket_level < COPC_MAX_BUCKET_LEVEL)
+  {
+    I64 bucket_points = p_count >> (3 * bucket_level);
+    if (bucket_points > max_bucket_points)
+      bucket_level++;
+    else if ((cores > 1) && (bucket_points > COPC_MAX_LEAF_POINTS) && ((1 << (3 * bucket_level)) < 2 * cores))
+      bucket_level++;
+    else
+      break;
+  }
+
+  if (!distribute(bucket_level))
+  {
+    clean();
+    return 0;
+  }
+
+  // the level was picked for evenly spread points. the subtrees that got
+  // too many points are split until they fit (the new buckets are appended)
+
+  I32 number_splits = 0;
+  for (size_t b = 0; b < buckets.size(); b++)
+  {
+    if (!buckets[b].sampled && (buckets[b].number_points > max_bucket_points) && (buckets[b].node.level < COPC_MAX_LEVEL))
+    {
+      if (!split((I32)b))
+      {
+        clean();
+        return 0;
+      }
+      number_splits++;
+    }
+  }
+  if (number_splits)
+  {
+    LASMessage(LAS_VERBOSE, "  split %d COPC subtree%s with more than %lld points", number_splits, (number_splits > 1 ? "s" : ""), max_bucket_points);
+  }
+
+  // the largest buckets are built first
+
+  tasks.clear();
+  for (I32 b = 0; b < (I32)buckets.size(); b++)
+  {
+    if (buckets[b].number_points) tasks.push_back(b);
+  }
+  std::sort(tasks.begin(), tasks.end(), [this](I32 a, I32 b) { return buckets[a].number_points > buckets[b].number_points; });
+
+  I32 number_writers = std::max(1, std::min(cores, (I32)tasks.size()));
+  writers.assign(number_writers, (LASwriter*)0);
+  nodes.assign(number_writers, std::vector<COPCnode>());
+  for (I32 w = 0; w < number_writers; w++)
+  {
+    CHAR* temp_name = copc_temp_name(file_name, "temp", w);
+    LASwriteOpener laswriteopener;
+    laswriteopener.set_file_name(temp_name);
+    laswriteopener.set_chunk_size(U32_MAX);
+    writers[w] = laswriteopener.open(header);
+    free(temp_name);
+    if (writers[w] == 0)
+    {
+      LASMessage(LAS_ERROR, "cannot open temporary LAZ file for '%s'", file_name);
+      clean();
+      return 0;
+    }
+  }
+
+  LASMessage(LAS_VERBOSE, "  building COPC octree of %lld points from %d buckets on %d core%s", p_count, (I32)tasks.size(), number_writers, (number_writers > 1 ? "s" : ""));
+
+  next_task = 0;
+  failed = false;
+  if (number_writers == 1)
+  {
+    work(0);
+  }
+  else
+  {
+    std::vector<std::thread> threads;
+    for (I32 w = 0; w < number_writers; w++)
+    {
+      threads.push_back(std::thread(&LASwriterCOPC::work, this, w));
+    }
+    for (I32 w = 0; w < number_writers; w++)
+    {
+      threads[w].join();
+    }
+  }
+
+  for (I32 w = 0; w < number_writers; w++)
+  {
+    writers[w]->close();
+    delete writers[w];
+    writers[w] = 0;
+  }
+
+  I64 bytes = 0;
+  if (failed || !assemble(bytes))
+  {
+    clean();
+    return 0;
+  }
+
+  U32 number_nodes = 0;
+  for (I32 w = 0; w < number_writers; w++) number_nodes += (U32)nodes[w].size();
+  LASMessage(LAS_VERBOSE, "  COPC octree has %u nodes with a spacing of %g", number_nodes, 2 * halfsize / (1 << COPC_CELL_BITS));
+
+  clean();
+  return bytes;
+}
+
+void LASwriterCOPC::clean()
+{
+  if (spill)
+  {
+    fclose(spill);
+    spill = 0;
+    CHAR* spill_name = copc_temp_name(file_name, "spill", 0);
+    remove(spill_name);
+    free(spill_name);
+  }
+  for (size_t w = 0; w < writers.size(); w++)
+  {
+    if (writers[w])
+    {
+      writers[w]->close();
+      delete writers[w];
+      CHAR* temp_name = copc_temp_name(file_name, "temp", (I32)w);
+      remove(temp_name);
+      free(temp_name);
+    }
+  }
+  for (size_t b = 0; b < buckets.size(); b++)
+  {
+    if (buckets[b].number_points)
+    {
+      // buckets that were not processed are left over after a failure
+      CHAR* bucket_name = copc_temp_name(file_name, "bucket", (I32)b);
+      remove(bucket_name);
+      free(bucket_name);
+    }
+  }
+  writers.clear();
+  nodes.clear();
+  buckets.clear();
+  tasks.clear();
+  if (file_name) free(file_name);
+  file_name = 0;
+  if (record) delete[] record;
+  record = 0;
+}
+
+LASwriterCOPC::LASwriterCOPC()
+{
+  file_name = 0;
+  header = 0;
+  cores = 1;
+  spill = 0;
+  point_size = 0;
+  stride = 0;
+  record = 0;
+  bucket_level = 0;
+  halfsize = 0.0;
+  next_task = 0;
+  failed = false;
+}
+
+LASwriterCOPC::~LASwriterCOPC()
+{
+  clean();
+}
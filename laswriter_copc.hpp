@@ -0,0 +1,96 @@
+// laswriter_copc.hpp : writes the points as COPC (cloud optimized point cloud).
+
+#ifndef LAS_WRITER_COPC_HPP
+#define LAS_WRITER_COPC_HPP
+
+#include "laswriter.hpp"
+
+#include <vector>
+#include <atomic>
+
+// the points are spilled to a temporary file as they arrive. on close a first
+// pass over the spilled points samples the top levels of the octree and sorts
+// all points into bucket files: one per top level node for the points it keeps
+// and one per subtree for all others. only the bits of the cells of the top
+// levels stay in memory. a subtree with too many points for memory is read once
+// more and split into a bucket for the points its root node keeps and buckets
+// for the subtrees of its eight children. then the subtrees are sampled and LAZ
+// compressed on several cores into one temporary LAZ file per core with one
+// variable sized chunk per octree node. finally these chunks are copied into
+// the COPC file without recompressing them and the hierarchy EVLR is appended.
+// a node keeps the first point that arrives in each of its 128^3 cells, all
+// other points are handed down to its eight children
+
+class LASwriterCOPC : public LASwriter
+{
+public:
+  // makes the header LAS 1.4 and adds the COPC info VLR as the first VLR. must
+  // be called before any other VLR is added to the header
+  static void init_header(LASheader* header);
+  static BOOL is_copc(const CHAR* file_name);
+
+  BOOL open(const CHAR* file_name, const LASheader* header, I32 cores = 1);
+  BOOL write_point(const LASpoint* point);
+  BOOL chunk();
+  BOOL update_header(const LASheader* header, BOOL use_inventory = FALSE, BOOL update_extra_bytes = FALSE);
+  I64 close(BOOL update_npoints = TRUE);
+  LASwriterCOPC();
+  ~LASwriterCOPC();
+private:
+  struct COPCnode
+  {
+    I32 level;
+    I32 x;
+    I32 y;
+    I32 z;
+    U32 number_points;
+  };
+  // the points of a bucket file are either a subtree or (when it is sampled)
+  // just the points of its root node
+  struct COPCbucket
+  {
+    COPCnode node;
+    I64 number_points;
+    BOOL sampled;
+  };
+  void cell(const LASpoint* point, U32* xyz) const;
+  I32 add_bucket(I32 level, U32 x, U32 y, U32 z, BOOL sampled);
+  BOOL put(std::vector<FILE*>& files, I32 b);
+  BOOL distribute(I32 level);
+  BOOL split(I32 b);
+  void work(I32 w);
+  void build(I32 w, LASpoint* point, const COPCnode& node, const U8* records, std::vector<U32>& index);
+  void write_node(I32 w, LASpoint* point, const COPCnode& node, const U8* records, const std::vector<U32>& index);
+  BOOL assemble(I64& bytes);
+  void clean();
+
+  CHAR* file_name;
+  const LASheader* header;
+  I32 cores;
+  FILE* spill;
+  U32 point_size;
+  U32 stride;
+  U8* record;
+
+  // bounding box and statistics of the points
+  I32 min_X, max_X, min_Y, max_Y, min_Z, max_Z;
+  F64 min_gps_time, max_gps_time;
+  I64 number_of_points_by_return[15];
+
+  // the octree cube
+  F64 center[3];
+  F64 halfsize;
+
+  // the top level nodes and the subtrees below are in buckets
+  I32 bucket_level;
+  std::vector<COPCbucket> buckets;
+  std::vector<I32> tasks;
+  std::atomic<I32> next_task;
+  std::atomic<bool> failed;
+
+  // one temporary LAZ file per core with one chunk per node
+  std::vector<LASwriter*> writers;
+  std::vector< std::vector<COPCnode> > nodes;
+};
+
+#endif